@@ -0,0 +1,84 @@
+#include "Arena.h"
+#include <stddef.h>
+#include <string.h>
+
+/* Minimum size of a block (excluding its header) */
+#define MIN_BLOCK_SIZE 16384
+
+/* Alignment of allocations */
+typedef union MaxAlign
+{
+    long double ld;
+    long long   ll;
+    void        *p;
+    void        (*f)(void);
+} MaxAlign;
+#define ALIGNMENT sizeof(MaxAlign)
+
+struct ArenaBlock
+{
+    ArenaBlock  *next;
+    MaxAlign    data[1];
+};
+
+void *AN_alloc(Arena *arena, size_t size)
+{
+    char *res;
+
+    /* Zero-sized allocations return a unique pointer, like malloc() */
+    size = (size > 0 ? size + ALIGNMENT - 1 : ALIGNMENT)/ALIGNMENT*ALIGNMENT;
+    if (size > (size_t)(arena->end - arena->pos))
+    {
+        size_t block_size = size > MIN_BLOCK_SIZE ? size : MIN_BLOCK_SIZE;
+        ArenaBlock *block = malloc(offsetof(ArenaBlock, data) + block_size);
+        if (block == NULL)
+            return NULL;
+
+        if (size < block_size)
+        {
+            /* Allocate from the new block from now on */
+            block->next   = arena->blocks;
+            arena->blocks = block;
+            arena->pos    = (char*)block->data;
+            arena->end    = arena->pos + block_size;
+        }
+        else
+        {
+            /* Large allocation: keep using the current block */
+            if (arena->blocks == NULL)
+            {
+                block->next   = NULL;
+                arena->blocks = block;
+            }
+            else
+            {
+                block->next = arena->blocks->next;
+                arena->blocks->next = block;
+            }
+            return block->data;
+        }
+    }
+
+    res = arena->pos;
+    arena->pos += size;
+    return res;
+}
+
+void *AN_calloc(Arena *arena, size_t size)
+{
+    void *res = AN_alloc(arena, size);
+    if (res != NULL)
+        memset(res, 0, size);
+    return res;
+}
+
+void AN_destroy(Arena *arena)
+{
+    while (arena->blocks != NULL)
+    {
+        ArenaBlock *next = arena->blocks->next;
+        free(arena->blocks);
+        arena->blocks = next;
+    }
+    arena->pos = arena->end = NULL;
+}
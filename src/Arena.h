@@ -0,0 +1,30 @@
+#ifndef ARENA_H_INCLUDED
+#define ARENA_H_INCLUDED
+
+#include <stdlib.h>
+
+/* A memory arena: objects are allocated from large blocks by advancing a
+   pointer, and are all freed at once when the arena is destroyed. This makes
+   allocation cheap and keeps related data close together in memory. */
+
+typedef struct ArenaBlock ArenaBlock;
+
+typedef struct Arena
+{
+    ArenaBlock  *blocks;    /* list of allocated blocks (most recent first) */
+    char        *pos, *end; /* free space in the most recent block */
+} Arena;
+
+#define AN_INIT { NULL, NULL, NULL }
+
+/* Allocates `size' bytes, suitably aligned for any type. Returns NULL if no
+   memory could be allocated. */
+void *AN_alloc(Arena *arena, size_t size);
+
+/* Allocates `size' bytes and sets them to zero. */
+void *AN_calloc(Arena *arena, size_t size);
+
+/* Frees all memory allocated from the arena. */
+void AN_destroy(Arena *arena);
+
+#endif /* ndef ARENA_H_INCLUDED */
@@ -0,0 +1,194 @@
+#include "WordTrie.h"
+#include <string.h>
+
+static int entry_cmp(const void *a, const void *b)
+{
+    return strcmp(((const WTEntry*)a)->text, ((const WTEntry*)b)->text);
+}
+
+bool WT_create(WordTrie *trie, const char * const *words, int nword)
+{
+    int n;
+
+    trie->nentry  = nword;
+    trie->entries = malloc(sizeof(WTEntry)*(nword > 0 ? nword : 1));
+    trie->max_len = 0;
+    if (trie->entries == NULL)
+        return false;
+
+    for (n = 0; n < nword; ++n)
+    {
+        size_t len = strlen(words[n]);
+        trie->entries[n].text = words[n];
+        trie->entries[n].word = n;
+        if (len > trie->max_len)
+            trie->max_len = len;
+    }
+    qsort(trie->entries, nword, sizeof(WTEntry), &entry_cmp);
+
+    return true;
+}
+
+void WT_destroy(WordTrie *trie)
+{
+    free(trie->entries);
+    trie->entries = NULL;
+    trie->nentry  = 0;
+}
+
+/* State of a fuzzy search. The search walks the trie depth-first, computing
+   one row of the edit distance table for each character of the prefix, and
+   stops descending when all entries in a row exceed the maximum distance
+   (since entries never decrease in later rows). */
+typedef struct FuzzyQuery
+{
+    const WordTrie  *trie;
+    const char      *word;
+    size_t          len;
+    int             max_dist;
+    int             *rows;      /* max_len + 1 rows of len + 1 entries */
+    WTMatch         *matches;
+    int             max_matches, nmatch, found;
+} FuzzyQuery;
+
+static void add_match(FuzzyQuery *q, int word, int dist)
+{
+    WTMatch m = { word, dist };
+    int i = q->nmatch < q->max_matches ? q->nmatch++ : q->max_matches;
+
+    /* Insert into the sorted list of best matches */
+    while (i > 0 && ( q->matches[i - 1].dist > dist ||
+                      ( q->matches[i - 1].dist == dist &&
+                        q->matches[i - 1].word > word ) ))
+    {
+        if (i < q->max_matches)
+            q->matches[i] = q->matches[i - 1];
+        --i;
+    }
+    if (i < q->max_matches)
+        q->matches[i] = m;
+    ++q->found;
+}
+
+static int min3(int a, int b, int c)
+{
+    return a < b ? (a < c ? a : c) : (b < c ? b : c);
+}
+
+/* Visits the trie node at `depth' that consists of entries[lo..hi). */
+static void fuzzy_walk(FuzzyQuery *q, int lo, int hi, size_t depth)
+{
+    const WTEntry *entries = q->trie->entries;
+    const char *word = q->word;
+    size_t len = q->len, j;
+    const int *row = q->rows + depth*(len + 1);
+    int *next = q->rows + (depth + 1)*(len + 1);
+
+    /* The word equal to the prefix (if any) sorts first */
+    while (lo < hi && entries[lo].text[depth] == '\0')
+    {
+        if (row[len] <= q->max_dist)
+            add_match(q, entries[lo].word, row[len]);
+        ++lo;
+    }
+
+    while (lo < hi)
+    {
+        char c = entries[lo].text[depth];
+
+        /* Find the end of the range of words continuing with c */
+        int a = lo + 1, b = hi;
+        while (a < b)
+        {
+            int m = a + (b - a)/2;
+            if (entries[m].text[depth] == c)
+                a = m + 1;
+            else
+                b = m;
+        }
+
+        /* Compute the row for the prefix extended with c */
+        int row_min = next[0] = (int)depth + 1;
+        for (j = 1; j <= len; ++j)
+        {
+            next[j] = min3(row[j] + 1, next[j - 1] + 1,
+                           row[j - 1] + (word[j - 1] != c));
+            if ( depth > 0 && j > 1 && word[j - 2] == c &&
+                 word[j - 1] == entries[lo].text[depth - 1] &&
+                 row[j - 2 - (len + 1)] + 1 < next[j] )
+                next[j] = row[j - 2 - (len + 1)] + 1;
+            if (next[j] < row_min)
+                row_min = next[j];
+        }
+
+        if (row_min <= q->max_dist)
+            fuzzy_walk(q, lo, a, depth + 1);
+        lo = a;
+    }
+}
+
+int WT_fuzzy( const WordTrie *trie, const char *word, size_t len,
+              int max_dist, WTMatch *matches, int max_matches )
+{
+    FuzzyQuery q;
+    size_t j;
+
+    if (trie->nentry == 0)
+        return 0;
+
+    q.trie        = trie;
+    q.word        = word;
+    q.len         = len;
+    q.max_dist    = max_dist;
+    q.rows        = malloc(sizeof(int)*(trie->max_len + 1)*(len + 1));
+    q.matches     = matches;
+    q.max_matches = max_matches;
+    q.nmatch      = 0;
+    q.found       = 0;
+    if (q.rows == NULL)
+        return 0;
+
+    for (j = 0; j <= len; ++j)
+        q.rows[j] = (int)j;
+    fuzzy_walk(&q, 0, trie->nentry, 0);
+
+    free(q.rows);
+    return q.found;
+}
+
+/* Compares the first `len' characters of an entry with a prefix. */
+static int prefix_cmp(const WTEntry *e, const char *prefix, size_t len)
+{
+    return strncmp(e->text, prefix, len);
+}
+
+bool WT_prefix( const WordTrie *trie, const char *prefix, size_t len,
+                int *lo, int *hi )
+{
+    int a = 0, b = trie->nentry;
+
+    /* Find the first entry not less than the prefix */
+    while (a < b)
+    {
+        int m = a + (b - a)/2;
+        if (prefix_cmp(&trie->entries[m], prefix, len) < 0)
+            a = m + 1;
+        else
+            b = m;
+    }
+    *lo = a;
+
+    /* Find the first entry greater than the prefix */
+    b = trie->nentry;
+    while (a < b)
+    {
+        int m = a + (b - a)/2;
+        if (prefix_cmp(&trie->entries[m], prefix, len) <= 0)
+            a = m + 1;
+        else
+            b = m;
+    }
+    *hi = a;
+
+    return *lo < *hi;
+}
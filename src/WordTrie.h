@@ -0,0 +1,56 @@
+#ifndef WORD_TRIE_H_INCLUDED
+#define WORD_TRIE_H_INCLUDED
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+/* A trie over a fixed list of words, used to find words that are similar to
+   a given (misspelled) word.
+
+   The trie is stored implicitly as a sorted array of words: every node of
+   the trie corresponds to the range of words that start with the node's
+   prefix, so no memory is needed for the nodes themselves. The trie does not
+   copy the words; the word list must outlive it.
+*/
+
+typedef struct WTEntry
+{
+    const char  *text;
+    int         word;       /* index into the word list */
+} WTEntry;
+
+typedef struct WordTrie
+{
+    int         nentry;
+    WTEntry     *entries;   /* sorted by text */
+    size_t      max_len;    /* length of the longest word */
+} WordTrie;
+
+typedef struct WTMatch
+{
+    int word;               /* index into the word list */
+    int dist;               /* edit distance to the query word */
+} WTMatch;
+
+/* Builds a trie containing words[0..nword-1]. */
+bool WT_create(WordTrie *trie, const char * const *words, int nword);
+
+/* Frees all memory allocated for the trie. */
+void WT_destroy(WordTrie *trie);
+
+/* Finds words within edit distance `max_dist' of `word' (which is `len'
+   characters long and need not be zero-terminated), counting insertions,
+   deletions, substitutions and transpositions of adjacent characters as single
+   edits. Up to `max_matches' matches are stored in `matches', ordered by
+   increasing distance, then by increasing word index. Returns the total
+   number of words found. */
+int WT_fuzzy( const WordTrie *trie, const char *word, size_t len,
+              int max_dist, WTMatch *matches, int max_matches );
+
+/* Finds the trie node for the given prefix (which is `len' characters long),
+   and stores the range of entries below it in [*lo, *hi). Returns whether
+   any word starts with the prefix. */
+bool WT_prefix( const WordTrie *trie, const char *prefix, size_t len,
+                int *lo, int *hi );
+
+#endif /* ndef WORD_TRIE_H_INCLUDED */
@@ -1,4 +1,7 @@
 #include "debug.h"
+#include "image.h"
+#include "savegame.h"
+#include "undo.h"
 #include "io.h"
 #include "opcodes.h"
 #include "interpreter.h"
@@ -51,9 +54,34 @@ static void ali_pause(Interpreter *I);
 
 
 /* Global variables: */
+#ifdef WITH_EMBEDDED_MODULE
+/* Module linked into the executable (see embed.S), which is used when no
+   module path is given. The data is writable, since the loader uses it in
+   place and normalizes words in it. */
+extern unsigned char ali_embedded_module[], ali_embedded_module_end[];
+static const char *module_path = NULL;
+#else
 static const char *module_path = "module.alo";
+#endif
+static const char *shared_dir = NULL;   /* directory for shared module images
+                                           (see load_shared_module()) */
+static const char *cache_dir = NULL;    /* directory for cached module images
+                                           (see load_cached_module()) */
+static size_t cache_size = 256;         /* maximum size of cache (in MiB) */
+static bool eager_decode = false;       /* decode functions in background? */
 static FILE *fp_transcript = NULL;      /* transcript file handle */
-static FILE *fp_savedgame = NULL;       /* saved game file handle */
+static SaveFile *save_file = NULL;      /* saved game file */
+static int commit_window = 100;         /* commit window for saved games
+                                           (in milliseconds) */
+static bool map_saved_game = false;     /* map variables from saved game? */
+static bool sync_saved_game = false;    /* sync mapped saved game each turn? */
+static bool compress_saved_game = false;    /* compress saved game? */
+static int undo_turns = 0;              /* number of turns that can be undone
+                                           (0 disables undo) */
+static size_t undo_size = 1024;         /* maximum size of undo history
+                                           (in KiB) */
+static const char *transcript_command = NULL;   /* command not yet written to
+                                                   the transcript */
 
 /* Interpreter state: */
 static Interpreter interpreter;
@@ -87,6 +115,7 @@ static void free_interpreter(Interpreter *I)
 {
     AR_destroy(I->output);
     AR_destroy(I->stack);
+    disable_undo(I);
     free_vars(I->vars);
     free_module(I->mod);
 }
@@ -313,6 +342,17 @@ static const char *get_string_var(Interpreter *I, int var, const char *def)
 }
 */
 
+static char *get_time_str()
+{
+    time_t t = time(NULL);
+    struct tm *tm = localtime(&t);
+    static char buf[32];
+    snprintf(buf, sizeof(buf), "%04d%02d%02dT%02d%02d%02d",
+        tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday,
+        tm->tm_hour, tm->tm_min, tm->tm_sec);
+    return buf;
+}
+
 static void process_output(Interpreter *I)
 {
 #ifdef WITH_GLK
@@ -336,6 +376,12 @@ static void process_output(Interpreter *I)
 */
 #endif
 
+    /* The command is normalized by process_input(), so we write it to the
+       transcript just before the output it produced. */
+    if (fp_transcript != NULL && transcript_command != NULL)
+        fprintf(fp_transcript, "%s> %s\n\n", get_time_str(), transcript_command);
+    transcript_command = NULL;
+
     char ch = '\0';
     AR_append(I->output, &ch);
     char *p, *buf = AR_data(I->output);
@@ -399,12 +445,13 @@ static void do_exit(int code)
 
 static void ali_quit(Interpreter *I, int code)
 {
-    if (fp_savedgame != NULL)
-        fclose(fp_savedgame);
+    process_output(I);
+
+    if (save_file != NULL && !close_save_file(save_file))
+        error("Could not save game data!");
     if (fp_transcript != NULL)
         fclose(fp_transcript);
 
-    process_output(I);
     free_interpreter(I);
     do_exit(code);
 }
@@ -416,36 +463,54 @@ static void ali_pause(Interpreter *I)
     read_line();
 }
 
-static char *get_time_str()
-{
-    time_t t = time(NULL);
-    struct tm *tm = localtime(&t);
-    static char buf[32];
-    snprintf(buf, sizeof(buf), "%04d%02d%02dT%02d%02d%02d",
-        tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday,
-        tm->tm_hour, tm->tm_min, tm->tm_sec);
-    return buf;
-}
-
 static void load_game(Interpreter *I)
 {
-    fseek(fp_savedgame, 0, SEEK_SET);
-    if (fread(I->vars->vals, sizeof(Value), I->vars->nval, fp_savedgame)
-        != (size_t)I->vars->nval)
-    {
+    if (!load_save_file(save_file, I->vars))
         fatal("Could not load game data!");
-    }
 }
 
 static void save_game(Interpreter *I)
 {
-    fseek(fp_savedgame, 0, SEEK_SET);
-    if (fwrite(I->vars->vals, sizeof(Value), I->vars->nval, fp_savedgame)
-        != (size_t)I->vars->nval)
-    {
+    if (!save_changes(save_file, I->vars))
         fatal("Could not save game data!");
-    }
-    fflush(fp_savedgame);
+}
+
+/* Appends a string to the interpreter's output. */
+static void append_output(Interpreter *I, const char *str)
+{
+    for ( ; *str != '\0'; ++str)
+        AR_push(I->output, str);
+}
+
+/* Returns whether `line' consists of the single word `word' (which must be
+   normalized). The line itself is left unchanged. */
+static bool is_command(const char *line, const char *word)
+{
+    char buf[16];
+
+    if (strlen(line) >= sizeof(buf))
+        return false;
+    strcpy(buf, line);
+    return strcmp(normalize(buf), word) == 0;
+}
+
+/* Handles the UNDO and REDO commands, unless the game defines a word with the
+   same name (in which case the command is passed on to the game). Returns
+   false if `line' is another command. */
+static bool process_undo(Interpreter *I, const char *line)
+{
+    if (I->undo == NULL)
+        return false;
+    if (is_command(line, "UNDO") && find_word(I->mod, "UNDO") < 0)
+        append_output(I, undo_turn(I) ? "[Previous turn undone.]"
+                                      : "[Nothing to undo.]");
+    else
+    if (is_command(line, "REDO") && find_word(I->mod, "REDO") < 0)
+        append_output(I, redo_turn(I) ? "[Turn redone.]"
+                                      : "[Nothing to redo.]");
+    else
+        return false;
+    return true;
 }
 
 static void command_loop(Interpreter *I)
@@ -459,10 +524,12 @@ static void command_loop(Interpreter *I)
         write_str("\n");
         if (line == NULL)
             break;
-        normalize(line);
-        if (fp_transcript != NULL)
-            fprintf(fp_transcript, "%s> %s\n\n", get_time_str(), line);
-        process_command(I, line);
+        transcript_command = line;
+        if (!process_undo(I, line))
+        {
+            process_input(I, line);
+            end_turn(I);
+        }
         process_output(I);
         save_game(I);
     }
@@ -537,9 +604,19 @@ static void select_game(Interpreter *I)
 
     /* Open saved game */
     snprintf(filename, sizeof(filename), "savedgame-%d.bin", c);
-    fp_savedgame = fopen(filename, (c < n) ? "r+b" : "wb");
-    if (fp_savedgame == NULL)
+    save_file = open_save_file(filename, I->mod, c == n, commit_window);
+    if (save_file == NULL)
         fatal("Could not open %s!", filename);
+    set_save_compression(save_file, compress_saved_game);
+    if (map_saved_game)
+    {
+        Value *vals = map_save_file(save_file, sync_saved_game);
+        Variables *vars = vals == NULL ? NULL : alloc_vars_at(I->mod, vals);
+        if (vars == NULL)
+            fatal("Could not map %s!", filename);
+        free_vars(I->vars);
+        I->vars = vars;
+    }
 
     /* Open transcript */
     snprintf(filename, sizeof(filename), "transcript-%d.txt", c);
@@ -549,8 +626,14 @@ static void select_game(Interpreter *I)
 
     if (c < n)
     {
-        write_fmt("\nResuming game %d.\n\n", c);
+        /* Report the last turn that was written durably (which is unknown
+           for mapped saved games) */
         load_game(I);
+        if (durable_turn(save_file) > 0)
+            write_fmt( "\nResuming game %d at turn %d.\n\n",
+                       c, durable_turn(save_file) );
+        else
+            write_fmt("\nResuming game %d.\n\n", c);
     }
     else
     {
@@ -572,13 +655,48 @@ static void do_main()
 
     IOStream ios;
 
-    /* Attempt to load executable module */
-    if(!ios_open(&ios, module_path, IOM_RDONLY, IOC_AUTO))
-        fatal("Unable to open file \"%s\" for reading.", module_path);
-    interpreter.mod = load_module(&ios);
-    ios_close(&ios);
+    /* Attempt to load executable module (or a native image of it). The
+       embedded module is used in place, so it is never shared or cached. */
+    if (module_path != NULL && is_module_image(module_path))
+    {
+        interpreter.mod = load_module_image(module_path);
+    }
+    else
+    if (module_path != NULL && shared_dir != NULL)
+    {
+        interpreter.mod = load_shared_module(module_path, shared_dir);
+    }
+    else
+    if (module_path != NULL && cache_dir != NULL)
+    {
+        interpreter.mod = load_cached_module( module_path, cache_dir,
+                                              cache_size << 20 );
+    }
+    else
+    {
+#ifdef WITH_EMBEDDED_MODULE
+        if (module_path == NULL)
+        {
+            if (!ios_open_memory( &ios, ali_embedded_module,
+                                  ali_embedded_module_end -
+                                  ali_embedded_module ))
+                fatal("Unable to read embedded module.");
+        }
+        else
+#endif
+        if(!ios_open(&ios, module_path, IOM_RDONLY, IOC_AUTO))
+            fatal("Unable to open file \"%s\" for reading.", module_path);
+        interpreter.mod = load_module(&ios);
+        ios_close(&ios);
+    }
     if (interpreter.mod == NULL)
+    {
+        if (module_path == NULL)
+            fatal("Invalid embedded module.");
         fatal("Invalid module file: \"%s\".", module_path);
+    }
+    if (eager_decode)
+        decode_functions(interpreter.mod, true);
 
     /* Initialize rest of the interpreter */
     interpreter.vars      = alloc_vars(interpreter.mod);
@@ -588,9 +706,14 @@ static void do_main()
     interpreter.output    = &output;
     interpreter.callbacks = &callbacks;
     interpreter.aux       = NULL;
+    interpreter.undo      = NULL;
+    interpreter.transaction = NULL;
 
     /* Load game */
     select_game(&interpreter);
+    if (undo_turns > 0 &&
+        !enable_undo(&interpreter, undo_turns, undo_size << 10))
+        error("Could not enable undo!");
     command_loop(&interpreter);
     warn("Unexpected end of input!");
     ali_quit(&interpreter, 1);
@@ -605,15 +728,122 @@ EXPORT void glk_main(void)
 
 #else
 
+/* Returns the default directory for cached module images: $XDG_CACHE_HOME/ali
+   or $HOME/.cache/ali (or NULL if neither variable is set). */
+static const char *default_cache_dir()
+{
+    const char *base = getenv("XDG_CACHE_HOME"), *suffix = "/ali";
+    char *dir;
+
+    if (base == NULL || *base == '\0')
+    {
+        base = getenv("HOME");
+        suffix = "/.cache/ali";
+        if (base == NULL || *base == '\0')
+            return NULL;
+    }
+    dir = malloc(strlen(base) + strlen(suffix) + 1);
+    if (dir != NULL)
+        sprintf(dir, "%s%s", base, suffix);
+    return dir;
+}
+
+/* Loads a module and writes a native image of it (see image.h). */
+static void build_image(const char *path, const char *image_path)
+{
+    IOStream ios;
+    Module *mod;
+    bool ok;
+
+    if (!ios_open(&ios, path, IOM_RDONLY, IOC_AUTO))
+        fatal("Unable to open file \"%s\" for reading.", path);
+    mod = load_module(&ios);
+    ios_close(&ios);
+    if (mod == NULL)
+        fatal("Invalid module file: \"%s\".", path);
+    ok = write_module_image(mod, path, image_path);
+    free_module(mod);
+    free(mod);
+    if (!ok)
+        fatal("Unable to write module image \"%s\".", image_path);
+}
+
 int main(int argc, char *argv[])
 {
 #ifdef WIN32
     hStdOut = GetStdHandle(STD_OUTPUT_HANDLE);
 #endif
 
+    if (argc == 4 && strcmp(argv[1], "--build-image") == 0)
+    {
+        build_image(argv[2], argv[3]);
+        return 0;
+    }
+
+    while (argc > 1)
+    {
+        if (strncmp(argv[1], "--shared", 8) == 0 &&
+            (argv[1][8] == '\0' || argv[1][8] == '='))
+            shared_dir = argv[1][8] == '=' ? argv[1] + 9 : "/dev/shm";
+        else
+        if (strncmp(argv[1], "--cache", 7) == 0 &&
+            (argv[1][7] == '\0' || argv[1][7] == '='))
+        {
+            cache_dir = argv[1][7] == '=' ? argv[1] + 8 : default_cache_dir();
+            if (cache_dir == NULL)
+                fatal("No cache directory given, and HOME is not set.");
+        }
+        else
+        if (strncmp(argv[1], "--cache-size=", 13) == 0)
+            cache_size = strtoul(argv[1] + 13, NULL, 10);
+        else
+        if (strncmp(argv[1], "--commit-window=", 16) == 0)
+            commit_window = atoi(argv[1] + 16);
+        else
+        if (strcmp(argv[1], "--compress-save") == 0)
+            compress_saved_game = true;
+        else
+        if (strcmp(argv[1], "--map-save") == 0)
+            map_saved_game = true;
+        else
+        if (strcmp(argv[1], "--sync-save") == 0)
+            map_saved_game = sync_saved_game = true;
+        else
+        if (strncmp(argv[1], "--undo=", 7) == 0)
+            undo_turns = atoi(argv[1] + 7);
+        else
+        if (strncmp(argv[1], "--undo-size=", 12) == 0)
+            undo_size = strtoul(argv[1] + 12, NULL, 10);
+        else
+        if (strcmp(argv[1], "--eager") == 0)
+            eager_decode = true;
+        else
+            break;
+        --argc;
+        ++argv;
+    }
+
     if (argc > 2 || (argc > 1 && argv[1][0] == '-'))
     {
-        printf("Usage: ali [<module>]\n");
+        printf("Usage: ali [<options>] [<module>]\n"
+               "       ali --build-image <module> <image>\n"
+               "Options:\n"
+               "  --shared[=<dir>]     share the decoded module with other processes\n"
+               "                       through an image in <dir> (default: /dev/shm)\n"
+               "  --cache[=<dir>]      keep decoded modules in a cache directory\n"
+               "                       (default: ~/.cache/ali) for faster startup\n"
+               "  --cache-size=<MiB>   maximum size of the cache (default: 256)\n"
+               "  --commit-window=<ms> time to collect turns before writing them\n"
+               "                       to the saved game together (default: 100)\n"
+               "  --compress-save      compress snapshots in the saved game\n"
+               "  --map-save           map variables directly from the saved game\n"
+               "  --sync-save          like --map-save, but write changes to disk\n"
+               "                       after every turn\n"
+               "  --undo=<turns>       enable UNDO and REDO for up to <turns> turns\n"
+               "                       (unless the game defines these words itself)\n"
+               "  --undo-size=<KiB>    maximum size of the undo history (default: 1024)\n"
+               "  --eager              decode all functions in the background,\n"
+               "                       instead of when they are first called\n");
         return 0;
     }
 
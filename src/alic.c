@@ -18,7 +18,7 @@ int yyparse();
 
 /* Data structure used to represent a parsed fragment pattern */
 typedef enum PatternNodeType {
-    PN_FRAG, PN_SEQ, PN_ALT, PN_OPT, PN_WORD
+    PN_FRAG, PN_SEQ, PN_ALT, PN_OPT, PN_WORD, PN_SLOT
 } PatternNodeType;
 
 typedef struct PatternNode PatternNode;
@@ -36,6 +36,13 @@ PatternNode *pattern_normalize(PatternNode *node);
 /* Default path */
 const char *output_path = "module.alo";
 
+/* LZMA compression level for the output file (or -1 to write it
+   uncompressed) */
+static int compression_level = -1;
+
+/* Compress blocks of the output file independently? (see IOC_LZMA_BLOCKS) */
+static bool compress_blocks = false;
+
 static int num_verbs = 0, num_prepositions = 0, num_entities = 0;
 
 /* Global variable table */
@@ -54,7 +61,8 @@ static ScapegoatTree st_strings = ST_INIT(
     (EA_cmp)strcmp, (EA_dup)strdup, (EA_free)free, EA_no_dup, EA_no_free );
 
 /* Symbol table */
-static int next_symbol_id = -1;  /* symbols are numbered -1, -2, etc. */
+static int next_symbol_id = -2;  /* symbols are numbered -2, -3, etc.
+                                    (-1 is reserved for nil) */
 static ScapegoatTree st_symbols = ST_INIT(
     (EA_cmp)strcmp, (EA_dup)strdup, (EA_free)free, EA_no_dup, EA_no_free );
 
@@ -83,14 +91,48 @@ static Array ar_functions = AR_INIT(sizeof(Function));
 static ScapegoatTree st_functions = ST_INIT(
     (EA_cmp)strcmp, (EA_dup)strdup, (EA_free)free, EA_no_dup, EA_no_free );
 
+/* Guard functions, keyed by function index but compared by code, so that
+   identical guards are shared between commands (see end_guard()). */
+static int guard_cmp(const void *a, const void *b);
+static ScapegoatTree st_guards = ST_INIT(
+    guard_cmp, EA_no_dup, EA_no_free, EA_no_dup, EA_no_free );
+
 /* Command table */
 static Array ar_commands = AR_INIT(sizeof(Command));
+static Array ar_command_sets = AR_INIT(sizeof(int)); /* set index per command */
+
+/* Patterns of commands with slots, which are converted to grammar rules only
+   after all entities have been declared (see resolve_slot_commands()); NULL
+   for commands without slots. */
+static Array ar_command_patterns = AR_INIT(sizeof(PatternNode*));
+
+/* Names of the slots of the command being parsed (including the leading $),
+   and the number of fragments parsed for it so far. */
+static Array cmd_slots = AR_INIT(sizeof(char*));
+static int cmd_nfrag = 0;
+
+/* Non-terminal symbol matching any entity, with one rule per entity (or -1 if
+   no command uses slots). */
+static int slot_symbol = -1;
+
+/* Context symbols of command sets (in order of first use), and the context
+   in which commands are currently declared. */
+static Array ar_contexts = AR_INIT(sizeof(int));
+static int cur_context = -1;  /* nil */
 
 /* Word table; similar to string table, but contains words recognized by the
    parser instead of strings used in the code. */
 static Array ar_words = AR_INIT(sizeof(char*));
 /* TODO: later add ScapegoatTree to lookup words faster? */
 
+/* Perfect hash table for the word table (see build_word_index()) */
+static Array ar_word_disp  = AR_INIT(sizeof(unsigned));
+static Array ar_word_slots = AR_INIT(sizeof(int));
+
+/* Types and checksums of the chunks written so far (see write_CRC_chunk()) */
+static Array ar_chunk_ids  = AR_INIT(4);
+static Array ar_chunk_crcs = AR_INIT(sizeof(uint32_t));
+
 /* Grammar rules.
    NB: rules must be stored in increasing order of left-hand-side nonterminal.
 */
@@ -389,6 +431,8 @@ void end_function()
     f.nret   = func_nret;
     f.ninstr = AR_size(&func_body) + func_nlocal;
     f.instrs = malloc(f.ninstr*sizeof(Instruction));
+    f.code   = NULL;
+    f.state  = FUNC_DECODED;
 
     /* Add local variables */
     for (n = 0; n < func_nlocal; ++n)
@@ -436,9 +480,14 @@ void begin_preposition()
 
 void begin_entity()
 {
+    /* Entities need not have synonyms, but entity patterns are indexed by
+       entity, so add an empty pattern to be replaced by the first synonym. */
+    PatternNode *none = NULL;
+    AR_append(&ar_ents, &none);
+
     fragment.type  = F_ENTITY;
     fragment.id    = num_entities++;
-    fragment.canon = true;
+    fragment.canon = false;
 }
 
 void add_synonym(PatternNode *node)
@@ -474,7 +523,8 @@ void add_synonym(PatternNode *node)
     else
     {
         PatternNode **prev = AR_last(ar);
-        node = make_pattern_node(PN_ALT, NULL, *prev, node);
+        if (*prev != NULL)
+            node = make_pattern_node(PN_ALT, NULL, *prev, node);
         assert(node != NULL);
         *prev = node;
     }
@@ -548,7 +598,7 @@ int find_fragment(Array *ar_patterns, const char *i, const char *j)
 
     for (n = 0; n < npattern; ++n)
     {
-        if (!match_pattern(patterns[n], i, j))
+        if (patterns[n] == NULL || !match_pattern(patterns[n], i, j))
             continue;
         if (res != -1)
             return -2;
@@ -612,6 +662,24 @@ int resolve_entity(const char *text)
     return res;
 }
 
+/* Adds a (sorted) rule set to the grammar, unless an equal rule set exists,
+   and returns the index of its non-terminal symbol. */
+static int add_ruleset(GrammarRuleSet *ruleset)
+{
+    GrammarRuleSet **rulesets = AR_data(&ar_grammar);
+    size_t nruleset = AR_size(&ar_grammar), n;
+    for (n = 0; n < nruleset; ++n)
+        if (ruleset_cmp(rulesets[n], ruleset) == 0)
+            break;
+
+    if (n < nruleset)
+        ruleset_destroy(ruleset);
+    else
+        AR_push(&ar_grammar, &ruleset);
+
+    return (int)n;
+}
+
 SymbolRef pattern_to_grammar(PatternNode *node)
 {
     GrammarRuleSet *ruleset;
@@ -672,26 +740,90 @@ SymbolRef pattern_to_grammar(PatternNode *node)
             ruleset->rules[1]->refs[0] = pattern_to_grammar(node->left);
         } break;
 
+    case PN_SLOT:
+        {
+            assert(slot_symbol >= 0);
+            SymbolRef res = { SYM_NONTERMINAL, slot_symbol };
+            return res;
+        }
+
     default:
         assert(false);
     }
 
+    /* See if the rule set matches an existing symbol's rule set */
     ruleset_sort(ruleset);
+    SymbolRef res = { SYM_NONTERMINAL, add_ruleset(ruleset) };
+    return res;
+}
 
-    /* See if the rule set matches an existing symbol's rule set */
-    GrammarRuleSet **rulesets = AR_data(&ar_grammar);
-    size_t nruleset = AR_size(&ar_grammar), n;
-    for (n = 0; n < nruleset; ++n)
-        if (ruleset_cmp(rulesets[n], ruleset) == 0)
-            break;
+/* Creates the slot symbol, which has one rule for each entity that derives
+   the entity's pattern. Entities without synonyms get a rule that derives a
+   symbol without rules, which matches nothing. */
+static void create_slot_symbol()
+{
+    PatternNode **ents = AR_data(&ar_ents);
+    size_t nent = AR_size(&ar_ents), n;
+    GrammarRuleSet *ruleset = ruleset_create(nent);
+    assert(ruleset != NULL);
 
-    if (n < nruleset)
-        ruleset_destroy(ruleset);
-    else
-        AR_push(&ar_grammar, &ruleset);
+    for (n = 0; n < nent; ++n)
+    {
+        ruleset->rules[n] = symrefs_create(1);
+        assert(ruleset->rules[n] != NULL);
+        if (ents[n] != NULL)
+        {
+            ruleset->rules[n]->refs[0] = pattern_to_grammar(ents[n]);
+        }
+        else
+        {
+            ruleset->rules[n]->refs[0].type  = SYM_NONTERMINAL;
+            ruleset->rules[n]->refs[0].index = add_ruleset(ruleset_create(0));
+        }
+    }
 
-    SymbolRef res = { SYM_NONTERMINAL, (int)n };
-    return res;
+    /* NB: not sorted, since the interpreter identifies the entity matched by
+       the index of the rule used. */
+    slot_symbol = (int)AR_size(&ar_grammar);
+    AR_push(&ar_grammar, &ruleset);
+}
+
+/* Converts the patterns of commands with slots to grammar rules. */
+static void resolve_slot_commands()
+{
+    PatternNode **patterns = AR_data(&ar_command_patterns);
+    size_t ncommand = AR_size(&ar_commands), n;
+
+    for (n = 0; n < ncommand; ++n)
+    {
+        if (patterns[n] == NULL)
+            continue;
+        if (slot_symbol < 0)
+            create_slot_symbol();
+        ((Command*)AR_at(&ar_commands, n))->symbol =
+            pattern_to_grammar(patterns[n]);
+    }
+}
+
+/* Returned by resolve_object() for a slot. */
+#define SLOT_ENTITY (-3)
+
+/* Resolves the object of a command given by string [i:j), which is either an
+   entity or a slot (a single word starting with $). Returns SLOT_ENTITY for a
+   slot, and the result of resolve_fragment() otherwise. */
+static int resolve_object(const char *i, const char *j)
+{
+    if (*i == '$' && skip_word(i) == j)
+        return SLOT_ENTITY;
+    return resolve_fragment(F_ENTITY, i, j);
+}
+
+/* Returns the pattern for an object resolved by resolve_object(). */
+static PatternNode *object_node(int ent)
+{
+    if (ent == SLOT_ENTITY)
+        return make_pattern_node(PN_SLOT, NULL, NULL, NULL);
+    return *(PatternNode**)AR_at(&ar_ents, ent);
 }
 
 static bool parse_command(char *str, PatternNode **pattern)
@@ -713,17 +845,17 @@ static bool parse_command(char *str, PatternNode **pattern)
     for (p = skip_word(str); *p != '\0'; p = skip_word(p))
     {
         int v = resolve_fragment(F_VERB, str, p);
-        int e = resolve_fragment(F_ENTITY, p, end);
-        if (v < 0 || e < 0) continue;
+        int e = resolve_object(p, end);
+        if (v < 0 || (e < 0 && e != SLOT_ENTITY)) continue;
 
         verb = v;
         ent1 = e;
         // don't break here, so we find the longest matching verb
     }
-    if (verb >= 0 && ent1 >= 0)
+    if (verb >= 0)
     {
         PatternNode *verb_node = *(PatternNode**)AR_at(&ar_verbs, verb);
-        PatternNode *ent1_node = *(PatternNode**)AR_at(&ar_ents,  ent1);
+        PatternNode *ent1_node = object_node(ent1);
         assert(verb_node != NULL);
         assert(ent1_node != NULL);
         *pattern = make_pattern_node(PN_SEQ, NULL, verb_node, ent1_node);
@@ -739,14 +871,14 @@ static bool parse_command(char *str, PatternNode **pattern)
 
         for (q = skip_word(p); *q != '\0'; q = skip_word(q))
         {
-            int e1 = resolve_fragment(F_ENTITY, p, q);
-            if (e1 < 0) continue;
+            int e1 = resolve_object(p, q);
+            if (e1 < 0 && e1 != SLOT_ENTITY) continue;
 
             for (r = skip_word(q); *r != '\0'; r = skip_word(r))
             {
                 int p  = resolve_fragment(F_PREPOSITION, q, r);
-                int e2 = resolve_fragment(F_ENTITY, r, end);
-                if (p < 0 || e2 < 0) continue;
+                int e2 = resolve_object(r, end);
+                if (p < 0 || (e2 < 0 && e2 != SLOT_ENTITY)) continue;
 
                 // Match found:
                 verb = v;
@@ -757,12 +889,12 @@ static bool parse_command(char *str, PatternNode **pattern)
             }
         }
     }
-    if (verb >= 0 && ent1 >= 0 && prep >= 0 && ent2 >= 0)
+    if (verb >= 0)
     {
         PatternNode *verb_node = *(PatternNode**)AR_at(&ar_verbs, verb);
-        PatternNode *ent1_node = *(PatternNode**)AR_at(&ar_ents,  ent1);
+        PatternNode *ent1_node = object_node(ent1);
         PatternNode *prep_node = *(PatternNode**)AR_at(&ar_preps, prep);
-        PatternNode *ent2_node = *(PatternNode**)AR_at(&ar_ents,  ent2);
+        PatternNode *ent2_node = object_node(ent2);
         assert(verb_node != NULL);
         assert(ent1_node != NULL);
         assert(prep_node != NULL);
@@ -776,15 +908,77 @@ static bool parse_command(char *str, PatternNode **pattern)
     return false;
 }
 
+/* Returns the index of the command set for the given context symbol,
+   creating a new command set if necessary. */
+static int get_command_set(int context)
+{
+    size_t n;
+    for (n = 0; n < AR_size(&ar_contexts); ++n)
+        if (*(int*)AR_at(&ar_contexts, n) == context)
+            return (int)n;
+    AR_append(&ar_contexts, &context);
+    return (int)n;
+}
+
+void begin_context(const char *str)
+{
+    cur_context = resolve_symbol(str);
+}
+
+/* Normalizes a command fragment, except for slot words (which start with $),
+   and adds the names of the slots to `slots'. */
+static char *normalize_command(const char *str, Array *slots)
+{
+    char *res = malloc(strlen(str) + 1), *out = res;
+    const char *i = str, *j;
+    assert(res != NULL);
+
+    while (*i != '\0')
+    {
+        for (j = i; *j != '\0' && *j != ' '; ++j) continue;
+
+        char *word = malloc(j - i + 1);
+        assert(word != NULL);
+        memcpy(word, i, j - i);
+        word[j - i] = '\0';
+        if (word[0] == '$')
+        {
+            size_t n;
+            for (n = 0; n < AR_size(slots); ++n)
+                if (strcmp(*(char**)AR_at(slots, n), word) == 0)
+                    fatal("Duplicate slot %s in command on line %d.",
+                          word, lineno + 1);
+            AR_append(slots, &word);
+        }
+        else
+        {
+            normalize(word);
+        }
+        if (*word != '\0')
+        {
+            if (out > res)
+                *out++ = ' ';
+            strcpy(out, word);
+            out += strlen(word);
+        }
+        if (word[0] != '$')
+            free(word);
+
+        for (i = j; *i == ' '; ++i) continue;
+    }
+    *out = '\0';
+    return res;
+}
+
 void begin_command(const char *str)
 {
     PatternNode *node = NULL;
     Command command;
+    Array slots = AR_INIT(sizeof(char*));
+    size_t n;
 
     /* Normalize and then parse fragment */
-    char *fragment = strdup(str);
-    normalize(fragment);
-    assert(fragment != NULL);
+    char *fragment = normalize_command(str, &slots);
     if (!parse_command(fragment, &node))
     {
         fatal("Could not parse command \"%s\" on line %d.",
@@ -793,13 +987,69 @@ void begin_command(const char *str)
     free(fragment);
     assert(node != NULL);
 
-    /* Convert fragment node to grammar rule */
-    command.symbol = pattern_to_grammar(node);
+    /* Slots are passed to the guard and body as parameters, so all fragments
+       of a command must have the same slots. */
+    if (AR_size(&slots) > MAX_COMMAND_SLOTS)
+        fatal("Too many slots in command on line %d.", lineno + 1);
+    if (cmd_nfrag++ == 0)
+    {
+        for (n = 0; n < AR_size(&slots); ++n)
+            AR_append(&cmd_slots, AR_at(&slots, n));
+    }
+    else
+    {
+        bool same = AR_size(&slots) == AR_size(&cmd_slots);
+        for (n = 0; same && n < AR_size(&slots); ++n)
+            same = strcmp( *(char**)AR_at(&slots, n),
+                           *(char**)AR_at(&cmd_slots, n) ) == 0;
+        if (!same)
+            fatal("Command fragments use different slots on line %d.",
+                  lineno + 1);
+        for (n = 0; n < AR_size(&slots); ++n)
+            free(*(char**)AR_at(&slots, n));
+    }
+
+    /* Convert fragment node to grammar rule (or defer the conversion until
+       the slot symbol can be created) */
+    if (AR_empty(&slots))
+    {
+        command.symbol = pattern_to_grammar(node);
+        node = NULL;
+    }
+    else
+    {
+        command.symbol.type  = SYM_NONE;
+        command.symbol.index = 0;
+    }
+    AR_destroy(&slots);
+    AR_append(&ar_command_patterns, &node);
 
     /* Add partial command to command array */
     command.guard    = -1;
     command.function = -1;
     AR_append(&ar_commands, &command);
+
+    int set = get_command_set(cur_context);
+    AR_append(&ar_command_sets, &set);
+}
+
+static int guard_cmp(const void *a, const void *b)
+{
+    const Function *f = AR_at(&ar_functions, (long)a);
+    const Function *g = AR_at(&ar_functions, (long)b);
+    if (f->nparam != g->nparam)
+        return f->nparam - g->nparam;
+    if (f->ninstr != g->ninstr)
+        return f->ninstr - g->ninstr;
+    int n;
+    for (n = 0; n < f->ninstr; ++n)
+    {
+        if (f->instrs[n].opcode != g->instrs[n].opcode)
+            return f->instrs[n].opcode - g->instrs[n].opcode;
+        if (f->instrs[n].argument != g->instrs[n].argument)
+            return f->instrs[n].argument < g->instrs[n].argument ? -1 : 1;
+    }
+    return 0;
 }
 
 void end_guard()
@@ -811,6 +1061,16 @@ void end_guard()
     func_nret = 1;
     end_function();
 
+    /* Reuse an identical guard function, if there is one */
+    const void *value = (void*)guard;
+    if (ST_find_or_insert(&st_guards, (void*)guard, &value))
+    {
+        Function *f = AR_last(&ar_functions);
+        free(f->instrs);
+        AR_pop(&ar_functions, NULL);
+        guard = (long)value;
+    }
+
     /* Add guard to open commands */
     size_t n = AR_size(&ar_commands);
     while (n-- > 0)
@@ -821,14 +1081,30 @@ void end_guard()
     }
 }
 
+/* Declares the slots of the current command as parameters of the function
+   being defined (i.e. the command guard or body). */
+void add_slot_parameters()
+{
+    size_t n;
+    for (n = 0; n < AR_size(&cmd_slots); ++n)
+        add_parameter(*(char**)AR_at(&cmd_slots, n));
+}
+
 void end_command()
 {
+    size_t n;
+
     /* Terminate body function */
     size_t function = AR_size(&ar_functions);
     end_function(0);
 
+    for (n = 0; n < AR_size(&cmd_slots); ++n)
+        free(*(char**)AR_at(&cmd_slots, n));
+    AR_clear(&cmd_slots);
+    cmd_nfrag = 0;
+
     /* Add function to open commands */
-    size_t n = AR_size(&ar_commands);
+    n = AR_size(&ar_commands);
     while (n-- > 0)
     {
         Command *cmd = AR_at(&ar_commands, n);
@@ -931,6 +1207,9 @@ PatternNode *pattern_make_words(PatternNode *node)
     {
     case PN_FRAG:
         {
+            if (strchr(node->text, '$') != NULL)
+                fatal("Slots can only be used in commands (line %d).",
+                      lineno + 1);
             normalize(node->text);
             PatternNode *res = frag_make_words(node->text);
             free_pattern_node(node);
@@ -1055,17 +1334,30 @@ PatternNode *pattern_normalize(PatternNode *node)
 static bool chunk_begin(IOStream *ios, const char *type, size_t size)
 {
     assert(strlen(type) == 4);
-    return
-        write_int8(ios, type[0]) &&
-        write_int8(ios, type[1]) &&
-        write_int8(ios, type[2]) &&
-        write_int8(ios, type[3]) &&
-        write_int32(ios, (int)size);
+    if (!write_int8(ios, type[0]) ||
+        !write_int8(ios, type[1]) ||
+        !write_int8(ios, type[2]) ||
+        !write_int8(ios, type[3]) ||
+        !write_int32(ios, (int)size))
+        return false;
+
+    /* Checksum the data of each chunk inside the form */
+    if (strcmp(type, "FORM") != 0 && strcmp(type, "CRC ") != 0)
+    {
+        AR_push(&ar_chunk_ids, type);
+        ios_begin_checksum(ios);
+    }
+    return true;
 }
 
 /* Terminates an IFF chunk header, by padding to a 2-byte boundary. */
 static bool chunk_end(IOStream *ios, size_t size)
 {
+    if (AR_size(&ar_chunk_crcs) < AR_size(&ar_chunk_ids))
+    {
+        uint32_t crc = ios_end_checksum(ios);
+        AR_push(&ar_chunk_crcs, &crc);
+    }
     return (size&1) ? write_int8(ios, 0) : true;
 }
 
@@ -1083,7 +1375,7 @@ static bool write_MOD_chunk(IOStream *ios, size_t chunk_size)
 
     return
         chunk_begin(ios, "MOD ", chunk_size) &&
-        write_int16(ios, 0x0100) &&  /* file version: 1.0 */
+        write_int16(ios, MODULE_VERSION) &&
         write_int16(ios, 0) &&       /* reserved */
         write_int32(ios, AR_size(&ar_vars)) &&
         write_int32(ios, num_entities) &&
@@ -1183,6 +1475,32 @@ static bool write_FUN_chunk(IOStream *ios, size_t chunk_size)
     return chunk_end(ios, chunk_size);
 }
 
+static size_t get_FIX_chunk_size()
+{
+    return 8*AR_size(&ar_functions);
+}
+
+static bool write_FIX_chunk(IOStream *ios, size_t chunk_size)
+{
+    if (!chunk_begin(ios, "FIX ", chunk_size))
+        return false;
+
+    /* Offset and length of each function's code in the FUN chunk, counted
+       in instructions (as laid out by write_FUN_chunk()) */
+    Function *functions = (Function*)AR_data(&ar_functions);
+    size_t nfunction = AR_size(&ar_functions), n;
+    int offset = 0;
+    for (n = 0; n < nfunction; ++n)
+    {
+        if (!write_int32(ios, offset) ||
+            !write_int32(ios, functions[n].ninstr))
+            return false;
+        offset += functions[n].ninstr + 1;
+    }
+
+    return chunk_end(ios, chunk_size);
+}
+
 static size_t get_WRD_chunk_size()
 {
     return get_string_chunk_size(&ar_words);
@@ -1193,6 +1511,146 @@ static bool write_WRD_chunk(IOStream *ios, size_t chunk_size)
     return write_string_chunk(ios, chunk_size, &ar_words, "WRD ");
 }
 
+/* Maximum number of displacements tried for a single bucket. */
+#define MAX_WORD_DISP 1000000
+
+/* Builds a minimal perfect hash table for the word table using the
+   hash-and-displace method: words are distributed over buckets by their hash
+   value, and for each bucket (largest first) a displacement is searched for
+   that maps all of its words to distinct free slots. This allows the
+   interpreter to look up a word with a single probe.
+
+   Returns false if no table could be constructed (e.g. because two words have
+   the same hash value), in which case the index is omitted from the module and
+   the interpreter builds its own. */
+static bool build_word_index()
+{
+    size_t nword = AR_size(&ar_words), nbucket = nword/4 + 1, n, m, k;
+    const char **words = AR_data(&ar_words);
+    bool ok = true;
+
+    if (nword == 0)
+        return false;
+
+    unsigned *hashes  = malloc(nword*sizeof(unsigned));
+    size_t   *members = malloc(nword*sizeof(size_t));
+    size_t   *slots   = malloc(nword*sizeof(size_t));
+    size_t   *start   = calloc(nbucket + 1, sizeof(size_t));
+    size_t   *order   = malloc(nbucket*sizeof(size_t));
+    assert(hashes && members && slots && start && order);
+
+    AR_resize(&ar_word_disp, nbucket);
+    AR_resize(&ar_word_slots, nword);
+    unsigned *disp  = AR_data(&ar_word_disp);
+    int      *table = AR_data(&ar_word_slots);
+
+    /* Group words by bucket */
+    for (n = 0; n < nword; ++n)
+    {
+        hashes[n] = hash_word(words[n]);
+        ++start[hashes[n]%nbucket + 1];
+    }
+    for (n = 0; n < nbucket; ++n)
+        start[n + 1] += start[n];
+    for (n = 0; n < nword; ++n)
+        members[start[hashes[n]%nbucket]++] = n;
+    for (n = nbucket; n > 0; --n)
+        start[n] = start[n - 1];
+    start[0] = 0;
+
+    /* Order non-empty buckets by decreasing size (bucket sizes are small, so
+       we simply make one pass over all buckets per size) */
+    size_t max_size = 0;
+    for (n = 0; n < nbucket; ++n)
+        if (start[n + 1] - start[n] > max_size)
+            max_size = start[n + 1] - start[n];
+    k = 0;
+    while (max_size > 0)
+    {
+        for (n = 0; n < nbucket; ++n)
+            if (start[n + 1] - start[n] == max_size)
+                order[k++] = n;
+        --max_size;
+    }
+
+    for (n = 0; n < nword; ++n)
+        table[n] = -1;
+    for (n = 0; n < nbucket; ++n)
+        disp[n] = 0;
+
+    /* Find a displacement for each non-empty bucket */
+    size_t b;
+    for (b = 0; ok && b < k; ++b)
+    {
+        size_t bucket = order[b], size = start[bucket + 1] - start[bucket];
+        const size_t *words_in_bucket = members + start[bucket];
+        unsigned d;
+
+        for (d = 0; d < MAX_WORD_DISP; ++d)
+        {
+            for (n = 0; n < size; ++n)
+            {
+                slots[n] = hash_displace(hashes[words_in_bucket[n]], d)%nword;
+                if (table[slots[n]] >= 0)
+                    break;
+                for (m = 0; m < n; ++m)
+                    if (slots[m] == slots[n])
+                        break;
+                if (m < n)
+                    break;
+            }
+            if (n == size)
+                break;
+        }
+
+        if (d == MAX_WORD_DISP)
+        {
+            ok = false;
+            break;
+        }
+
+        disp[bucket] = d;
+        for (n = 0; n < size; ++n)
+            table[slots[n]] = (int)words_in_bucket[n];
+    }
+
+    free(hashes);
+    free(members);
+    free(slots);
+    free(start);
+    free(order);
+
+    if (!ok)
+    {
+        warn("Could not create perfect hash table for word table.");
+        AR_clear(&ar_word_disp);
+        AR_clear(&ar_word_slots);
+    }
+    return ok;
+}
+
+static size_t get_WIX_chunk_size()
+{
+    return 4 + 4*AR_size(&ar_word_disp) + 4*AR_size(&ar_word_slots);
+}
+
+static bool write_WIX_chunk(IOStream *ios, size_t chunk_size)
+{
+    if (!chunk_begin(ios, "WIX ", chunk_size) ||
+        !write_int32(ios, (int)AR_size(&ar_word_disp)))
+        return false;
+
+    size_t n;
+    for (n = 0; n < AR_size(&ar_word_disp); ++n)
+        if (!write_int32(ios, (int)*(unsigned*)AR_at(&ar_word_disp, n)))
+            return false;
+    for (n = 0; n < AR_size(&ar_word_slots); ++n)
+        if (!write_int32(ios, *(int*)AR_at(&ar_word_slots, n)))
+            return false;
+
+    return chunk_end(ios, chunk_size);
+}
+
 /* Returns total number of non-terminal symbols. */
 static int get_num_nonterm()
 {
@@ -1281,7 +1739,8 @@ static bool write_GRM_chunk(IOStream *ios, size_t chunk_size)
 
 static size_t get_CMD_chunk_size()
 {
-    return 8 + 12*AR_size(&ar_commands);
+    size_t nset = AR_size(&ar_contexts);
+    return 8 + 8*(nset > 0 ? nset : 1) + 12*AR_size(&ar_commands);
 }
 
 static bool write_CMD_chunk(IOStream *ios, size_t chunk_size)
@@ -1290,60 +1749,135 @@ static bool write_CMD_chunk(IOStream *ios, size_t chunk_size)
         return false;
 
     Command *commands = AR_data(&ar_commands);
+    int *command_sets = AR_data(&ar_command_sets);
     size_t ncommand = AR_size(&ar_commands);
+    size_t nset = AR_size(&ar_contexts);
+
+    /* A module without commands still has one (empty) command set */
+    if (nset == 0)
+        return write_int32(ios, 1) && write_int32(ios, 0) &&
+               write_int32(ios, 0) && write_int32(ios, -1) &&
+               chunk_end(ios, chunk_size);
 
-    if (!write_int32(ios, 1) || !write_int32(ios, (int)ncommand))
+    if (!write_int32(ios, (int)nset))
         return false;
 
-    size_t n;
-    for (n = 0; n < ncommand; ++n)
+    /* Slot symbol (or 0 if there is none) */
+    if (slot_symbol >= 0)
     {
-        if (!write_grammar_symbol(ios, &commands[n].symbol) ||
-            !write_int32(ios, commands[n].guard) ||
-            !write_int32(ios, commands[n].function))
+        SymbolRef slot = { SYM_NONTERMINAL, slot_symbol };
+        if (!write_grammar_symbol(ios, &slot))
             return false;
     }
+    else
+    if (!write_int32(ios, 0))
+        return false;
+
+    size_t set, n;
+    for (set = 0; set < nset; ++set)
+    {
+        int count = 0;
+        for (n = 0; n < ncommand; ++n)
+            if (command_sets[n] == (int)set)
+                ++count;
+
+        if (!write_int32(ios, count) ||
+            !write_int32(ios, *(int*)AR_at(&ar_contexts, set)))
+            return false;
+
+        for (n = 0; n < ncommand; ++n)
+        {
+            if (command_sets[n] != (int)set)
+                continue;
+            if (!write_grammar_symbol(ios, &commands[n].symbol) ||
+                !write_int32(ios, commands[n].guard) ||
+                !write_int32(ios, commands[n].function))
+                return false;
+        }
+    }
 
     return chunk_end(ios, chunk_size);
 }
 
-static bool write_alio(IOStream *ios)
+static size_t get_CRC_chunk_size(size_t nchunk)
 {
-    int MOD_size = get_MOD_chunk_size();
-    int STR_size = get_STR_chunk_size();
-    int FUN_size = get_FUN_chunk_size();
-    int WRD_size = get_WRD_chunk_size();
-    int GRM_size = get_GRM_chunk_size();
-    int CMD_size = get_CMD_chunk_size();
-
-    size_t FRM_size = 4;
-    FRM_size += 8 + MOD_size + (MOD_size&1);
-    FRM_size += 8 + STR_size + (STR_size&1);
-    FRM_size += 8 + FUN_size + (FUN_size&1);
-    FRM_size += 8 + WRD_size + (WRD_size&1);
-    FRM_size += 8 + GRM_size + (GRM_size&1);
-    FRM_size += 8 + CMD_size + (CMD_size&1);
+    return 8*nchunk;
+}
 
-    return
-        chunk_begin(ios, "FORM", FRM_size) &&
-        write_data(ios, "ALI ", 4) &&
-        write_MOD_chunk(ios, MOD_size) &&
-        write_STR_chunk(ios, STR_size) &&
-        write_FUN_chunk(ios, FUN_size) &&
-        write_WRD_chunk(ios, WRD_size) &&
-        write_GRM_chunk(ios, GRM_size) &&
-        write_CMD_chunk(ios, CMD_size) &&
-        chunk_end(ios, FRM_size);
+/* Writes the checksums of all preceding chunks; this must be the last chunk. */
+static bool write_CRC_chunk(IOStream *ios, size_t chunk_size)
+{
+    size_t n;
+
+    assert(chunk_size == 8*AR_size(&ar_chunk_crcs));
+    if (!chunk_begin(ios, "CRC ", chunk_size))
+        return false;
+    for (n = 0; n < AR_size(&ar_chunk_crcs); ++n)
+    {
+        if (!write_data(ios, AR_at(&ar_chunk_ids, n), 4) ||
+            !write_int32(ios, (int)*(uint32_t*)AR_at(&ar_chunk_crcs, n)))
+            return false;
+    }
+    return chunk_end(ios, chunk_size);
+}
+
+/* A chunk to be written inside the form, preceding the CRC chunk */
+typedef struct ChunkWriter
+{
+    size_t  size;
+    bool    (*write)(IOStream *ios, size_t chunk_size);
+} ChunkWriter;
+
+#define ADD_CHUNK(type) \
+    ( chunks[nchunk].size  = get_##type##_chunk_size(), \
+      chunks[nchunk].write = &write_##type##_chunk, ++nchunk )
+
+static bool write_alio(IOStream *ios)
+{
+    ChunkWriter chunks[8];
+    size_t nchunk = 0, n, CRC_size, FRM_size = 4;
+
+    ADD_CHUNK(MOD);
+    ADD_CHUNK(STR);
+    ADD_CHUNK(FUN);
+    ADD_CHUNK(FIX);
+    ADD_CHUNK(WRD);
+    if (build_word_index())
+        ADD_CHUNK(WIX);
+    ADD_CHUNK(GRM);
+    ADD_CHUNK(CMD);
+    assert(nchunk <= sizeof(chunks)/sizeof(*chunks));
+
+    /* Every chunk written before the CRC chunk is checksummed */
+    CRC_size = get_CRC_chunk_size(nchunk);
+    for (n = 0; n < nchunk; ++n)
+        FRM_size += 8 + chunks[n].size + (chunks[n].size&1);
+    FRM_size += 8 + CRC_size + (CRC_size&1);
+
+    if (!chunk_begin(ios, "FORM", FRM_size) || !write_data(ios, "ALI ", 4))
+        return false;
+    for (n = 0; n < nchunk; ++n)
+    {
+        if (!(*chunks[n].write)(ios, chunks[n].size))
+            return false;
+    }
+    return write_CRC_chunk(ios, CRC_size) && chunk_end(ios, FRM_size);
 }
 
+#undef ADD_CHUNK
+
 void create_object_file()
 {
     IOStream ios;
-    if (!ios_open(&ios, output_path, IOM_WRONLY, IOC_COPY))
+    resolve_slot_commands();
+    if (!ios_open( &ios, output_path, IOM_WRONLY,
+                   compression_level < 0 ? IOC_COPY :
+                   compress_blocks ? IOC_LZMA_BLOCKS : IOC_LZMA ))
         fatal("Unable to open output file \"%s\".", output_path);
-    if (!write_alio(&ios))
+    if (compression_level >= 0)
+        ios_set_compression(&ios, compression_level, 0);
+    if (!write_alio(&ios) || !ios_close(&ios))
         fatal("Unable to write output file \"%s\".", output_path);
-    ios_close(&ios);
 }
 
 void parser_create()
@@ -1396,24 +1930,65 @@ void parser_destroy()
     }
     AR_destroy(&ar_functions);
     ST_destroy(&st_functions);
+    ST_destroy(&st_guards);
     AR_destroy(&ar_commands);
+    AR_destroy(&ar_command_sets);
+    AR_destroy(&ar_command_patterns);
+    AR_destroy(&cmd_slots);
+    AR_destroy(&ar_contexts);
+    AR_destroy(&ar_word_disp);
+    AR_destroy(&ar_word_slots);
     AR_destroy(&func_body);
     AR_destroy(&inv_stack);
 }
 
 int main(int argc, char *argv[])
 {
+    const char *source;
+
+    /* Parse options */
+    while (argc > 2 && argv[1][0] == '-' && argv[1][1] != '\0')
+    {
+        if (argv[1][1] == 'z')
+        {
+            compression_level = 5;
+            if (argv[1][2] != '\0')
+            {
+                if (argv[1][2] < '0' || argv[1][2] > '9' || argv[1][3] != '\0')
+                    fatal("Invalid compression level: \"%s\".", argv[1] + 2);
+                compression_level = argv[1][2] - '0';
+            }
+        }
+        else
+        if (strcmp(argv[1], "-b") == 0)
+        {
+            compress_blocks = true;
+            if (compression_level < 0)
+                compression_level = 5;
+        }
+        else
+        {
+            fatal("Invalid option: \"%s\".", argv[1]);
+        }
+        --argc;
+        ++argv;
+    }
+
     if (argc != 2)
     {
-        printf("Usage: alic <source>\n");
+        printf("Usage: alic [-z[<level>]] [-b] <source>\n"
+               "  -z  compress the output with LZMA (level 0-9, default 5)\n"
+               "  -b  compress blocks independently, so they can be\n"
+               "      decompressed in parallel (implies -z)\n");
         return 0;
     }
+    source = argv[1];
 
-    if (strcmp(argv[1], "-") != 0)
+    if (strcmp(source, "-") != 0)
     {
         /* Open source file */
-        if (freopen(argv[1], "rt", stdin) == NULL)
-            fatal("Unable to open file \"%s\" for reading.");
+        if (freopen(source, "rt", stdin) == NULL)
+            fatal("Unable to open file \"%s\" for reading.", source);
     }
 
     parser_create();
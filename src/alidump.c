@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "crc32c.h"
+#include "strings.h"
 
 #define NOPCODE 16
 static const char *opcodes[NOPCODE] = {
@@ -13,6 +15,10 @@ static const char *all_opts = "msfiwgc";   /* all possible options */
 static const char *opts = "msfwgc";        /* default options */
 static const char *path = "module.alo";    /* default module path */
 
+/* Function table */
+static int nfunction, ncode;
+static const char *code;
+
 /* Word table */
 static int nword;
 const char **words;
@@ -21,16 +27,16 @@ static int nnonterm;
 static int get_int32(const char *data)
 {
     const unsigned char *bytes = (const unsigned char*)data;
-    unsigned int i = (bytes[0]<<24)|(bytes[1]<<16)|(bytes[2]<<8)|bytes[3];
-    return (int)i;
+    uint32_t i = ((uint32_t)bytes[0]<<24)|((uint32_t)bytes[1]<<16)|
+                 ((uint32_t)bytes[2]<<8)|bytes[3];
+    return (int32_t)i;
 }
 
 static int get_int24(const char *data)
 {
     const unsigned char *bytes = (const unsigned char*)data;
-    unsigned int i = (bytes[0]<<16)|(bytes[1]<<8)|bytes[2];
-    if (i & 0x00800000) i |= -1&~0xffffff;
-    return (int)i;
+    uint32_t i = ((uint32_t)bytes[0]<<16)|((uint32_t)bytes[1]<<8)|bytes[2];
+    return (int)(i ^ 0x800000) - 0x800000;
 }
 
 static int get_int16(const char *data)
@@ -41,6 +47,9 @@ static int get_int16(const char *data)
     return (int)i;
 }
 
+/* Module file version (from the module header) */
+static int module_version = 0x0100;
+
 static void dump_header(const char *data, size_t size)
 {
     int version;
@@ -146,6 +155,10 @@ static void dump_function_table(const char *data, size_t size, int instrs)
     }
     printf("--------- --------- --------- -----------\n");
 
+    nfunction = entries;
+    ncode     = size/4;
+    code      = data;
+
     if (instrs)
         printf("\nInstructions data follows.\n");
 
@@ -188,6 +201,33 @@ static void dump_function_table(const char *data, size_t size, int instrs)
 
 }
 
+static void dump_function_index(const char *data, size_t size)
+{
+    printf("\n--- function index (%d bytes) ---\n", (int)size);
+    if (size != 8*(size_t)nfunction)
+    {
+        printf("Invalid function index size (expected %d entries)!\n",
+               nfunction);
+        return;
+    }
+
+    int n, errors = 0, next = 0;
+    for (n = 0; n < nfunction; ++n, data += 8)
+    {
+        int offset = get_int32(data), length = get_int32(data + 4);
+        if (offset != next || length < 0 || length >= ncode - offset ||
+            get_int32(code + 4*(offset + length)) != 0)
+        {
+            printf("Function %d has invalid offset %d or length %d!\n",
+                   n, offset, length);
+            ++errors;
+        }
+        next = offset + length + 1;
+    }
+    if (errors == 0)
+        printf("All %d functions indexed correctly.\n", nfunction);
+}
+
 static void dump_word_table(const char *data, size_t size)
 {
     printf("\n--- word table (%d bytes) ---\n", (int)size);
@@ -333,30 +373,46 @@ static void dump_command_table(const char *data, size_t size)
     }
 
     int command_sets = get_int32(data);
+    int header_size = module_version >= 0x0101 ? 8 : 4;
     data += 4;
     size -= 4;
 
-    printf("Number of command sets: %d\n\n", command_sets);
+    printf("Number of command sets: %d\n", command_sets);
     if (command_sets < 1)
     {
         printf("Too few command sets! (Should be at least 1)\n");
         return;
     }
 
+    if (module_version >= 0x0102)
+    {
+        if (size < 4)
+        {
+            printf("Command table truncated! (Slot symbol expected.)");
+            return;
+        }
+        printf("Slot symbol: %d\n", get_int32(data));
+        data += 4;
+        size -= 4;
+    }
+    printf("\n");
+
     int cs;
     for (cs = 0; cs < command_sets; ++cs)
     {
-        if (size < 4)
+        if (size < (size_t)header_size)
         {
-            printf("Command table truncated! (Command set size expected.)");
+            printf("Command table truncated! (Command set header expected.)");
             break;
         }
 
         int num_commands = get_int32(data);
-        data += 4;
-        size -= 4;
+        int context = header_size > 4 ? get_int32(data + 4) : -1;
+        data += header_size;
+        size -= header_size;
 
-        printf("Command set %d with %d commands follows.\n\n", cs, num_commands);
+        printf("Command set %d (context %d) with %d commands follows.\n\n",
+               cs, context, num_commands);
 
         printf("Command     Symbol      Guard       Function\n");
         printf("----------- ----------- ----------- -----------\n");
@@ -384,32 +440,63 @@ static void dump_command_table(const char *data, size_t size)
     }
 }
 
+static void dump_word_index(const char *data, size_t size)
+{
+    printf("\n--- word index (%d bytes) ---\n", (int)size);
+    if (size < 4)
+    {
+        printf("Word index too short! (Should be at least 4 bytes.)\n");
+        return;
+    }
+
+    int nbucket = get_int32(data);
+    printf("Number of buckets: %d\n", nbucket);
+    if (nbucket < 1 || (size - 4)/4 != (size_t)nbucket + nword)
+    {
+        printf("Invalid word index size (expected %d buckets and %d slots)!\n",
+               nbucket, nword);
+        return;
+    }
+
+    const char *disp  = data + 4;
+    const char *slots = disp + 4*nbucket;
+    int n, errors = 0;
+    for (n = 0; n < nword; ++n)
+    {
+        unsigned h = hash_word(words[n]);
+        unsigned d = (unsigned)get_int32(disp + 4*(h%nbucket));
+        int slot = (int)(hash_displace(h, d)%nword);
+        if (get_int32(slots + 4*slot) != n)
+        {
+            printf("Word %d (\"%s\") not found in slot %d!\n", n, words[n], slot);
+            ++errors;
+        }
+    }
+    if (errors == 0)
+        printf("All %d words indexed correctly.\n", nword);
+}
+
 static size_t pad_chunk_size(size_t chunk_size)
 {
     return chunk_size + (chunk_size&1);
 }
 
-static int start_chunk(const char *id, const char **data, size_t *size,
-                        size_t *chunk_size)
+static int start_chunk(char *id, const char **data, size_t *size,
+                       size_t *chunk_size)
 {
     if (*size < 8)
     {
-        printf("File truncated (expected '%s' chunk).\n", id);
-        return 0;
-    }
-
-    if (memcmp(*data, id, 4) != 0)
-    {
-        printf("Unexpected chunk identifier '%.4s' (expected '%s').\n",
-               *data, id);
+        printf("File truncated (expected chunk header).\n");
         return 0;
     }
 
+    memcpy(id, *data, 4);
     *chunk_size = get_int32(*data + 4);
     if (pad_chunk_size(*chunk_size) > *size - 8)
     {
-        printf("Invalid chunk size %d for '%s' chunk.\n",
+        printf("Invalid chunk size %d for '%.4s' chunk.\n",
                (int)*chunk_size, id);
+        return 0;
     }
 
     *data += 8;
@@ -418,6 +505,45 @@ static int start_chunk(const char *id, const char **data, size_t *size,
     return 1;
 }
 
+/* Checks the checksums in the CRC chunk (`data', of `size' bytes) against
+   the chunks preceding it, which start at `form'. */
+static void dump_checksums(const char *form, const char *data, size_t size)
+{
+    printf("\n--- checksums (%d bytes) ---\n", (int)size);
+    if (size%8 != 0)
+    {
+        printf("Invalid checksum table size!\n");
+        return;
+    }
+
+    const char *chunk = form;
+    int n, errors = 0;
+    for (n = 0; n < (int)(size/8); ++n)
+    {
+        size_t chunk_size = (unsigned)get_int32(chunk + 4);
+        unsigned crc = crc32c(0, chunk + 8, chunk_size);
+        if (chunk + 8 + chunk_size > data - 8 ||
+            memcmp(chunk, data + 8*n, 4) != 0)
+        {
+            printf("Checksum %d does not belong to chunk '%.4s'!\n",
+                   n, chunk);
+            return;
+        }
+        if ((unsigned)get_int32(data + 8*n + 4) != crc)
+        {
+            printf("Checksum mismatch in '%.4s' chunk (%08x; expected %08x)!\n",
+                   chunk, crc, (unsigned)get_int32(data + 8*n + 4));
+            ++errors;
+        }
+        chunk += 8 + pad_chunk_size(chunk_size);
+    }
+    if (chunk != data - 8)
+        printf("Not all chunks have checksums!\n");
+    else
+    if (errors == 0)
+        printf("All %d chunks verified.\n", n);
+}
+
 static void end_chunk(const char **data, size_t *size, size_t chunk_size)
 {
     chunk_size = pad_chunk_size(chunk_size);
@@ -427,7 +553,11 @@ static void end_chunk(const char **data, size_t *size, size_t chunk_size)
 
 static void dump(const char *opts, const char *data, size_t size)
 {
+    static const char * const mandatory[] = {
+        "MOD ", "STR ", "FUN ", "WRD ", "GRM ", "CMD ", NULL };
+    const char * const *next = mandatory;
     size_t chunk_size;
+    char id[4];
 
     if (size < 12)
     {
@@ -461,56 +591,94 @@ static void dump(const char *opts, const char *data, size_t size)
     data += 4;
     size -= 4;
 
-    if (chunk_size < size)
+    if (chunk_size - 4 < size)
     {
         printf("Warning: extra data at end of file.\n");
-        size = chunk_size;
+        size = chunk_size - 4;
     }
 
-    if (start_chunk("MOD ", &data, &size, &chunk_size))
-    {
-        if (strchr(opts, 'm') != NULL)
-            dump_header(data, chunk_size);
-        end_chunk(&data, &size, chunk_size);
-    }
+    const char *form = data;
 
-    if (start_chunk("STR ", &data, &size, &chunk_size))
+    while (size > 0 && start_chunk(id, &data, &size, &chunk_size))
     {
-        if (strchr(opts, 's') != NULL)
-            dump_string_table(data, chunk_size);
-        end_chunk(&data, &size, chunk_size);
-    }
-
-    if (start_chunk("FUN ", &data, &size, &chunk_size))
-    {
-        if (strchr(opts, 'f') != NULL || strchr(opts, 'i') != NULL)
-            dump_function_table(data, chunk_size, strchr(opts, 'i') != NULL);
-        end_chunk(&data, &size, chunk_size);
-    }
-
-    if (start_chunk("WRD ", &data, &size, &chunk_size))
-    {
-        if (strchr(opts, 'w') != NULL)
-            dump_word_table(data, chunk_size);
-        end_chunk(&data, &size, chunk_size);
-    }
-
-    if (start_chunk("GRM ", &data, &size, &chunk_size))
-    {
-        if (strchr(opts, 'g') != NULL)
-            dump_grammar_table(data, chunk_size);
-        end_chunk(&data, &size, chunk_size);
-    }
+        if (*next != NULL && memcmp(id, *next, 4) == 0)
+        {
+            ++next;
+        }
+        else
+        {
+            const char * const *m;
+            for (m = mandatory; *m != NULL; ++m)
+                if (memcmp(id, *m, 4) == 0)
+                    printf("Unexpected '%.4s' chunk (expected '%s').\n",
+                           id, *next ? *next : "optional chunk");
+        }
 
-    if (start_chunk("CMD ", &data, &size, &chunk_size))
-    {
-        if (strchr(opts, 'c') != NULL)
-            dump_command_table(data, chunk_size);
+        if (memcmp(id, "MOD ", 4) == 0)
+        {
+            if (chunk_size >= 2)
+                module_version = get_int16(data);
+            if (strchr(opts, 'm') != NULL)
+                dump_header(data, chunk_size);
+        }
+        else
+        if (memcmp(id, "STR ", 4) == 0)
+        {
+            if (strchr(opts, 's') != NULL)
+                dump_string_table(data, chunk_size);
+        }
+        else
+        if (memcmp(id, "FUN ", 4) == 0)
+        {
+            if (strchr(opts, 'f') != NULL || strchr(opts, 'i') != NULL)
+                dump_function_table(data, chunk_size, strchr(opts, 'i') != NULL);
+        }
+        else
+        if (memcmp(id, "FIX ", 4) == 0)
+        {
+            if (strchr(opts, 'f') != NULL)
+                dump_function_index(data, chunk_size);
+        }
+        else
+        if (memcmp(id, "WRD ", 4) == 0)
+        {
+            if (strchr(opts, 'w') != NULL)
+                dump_word_table(data, chunk_size);
+        }
+        else
+        if (memcmp(id, "WIX ", 4) == 0)
+        {
+            if (strchr(opts, 'w') != NULL)
+                dump_word_index(data, chunk_size);
+        }
+        else
+        if (memcmp(id, "GRM ", 4) == 0)
+        {
+            if (strchr(opts, 'g') != NULL)
+                dump_grammar_table(data, chunk_size);
+        }
+        else
+        if (memcmp(id, "CMD ", 4) == 0)
+        {
+            if (strchr(opts, 'c') != NULL)
+                dump_command_table(data, chunk_size);
+        }
+        else
+        if (memcmp(id, "CRC ", 4) == 0)
+        {
+            if (strchr(opts, 'm') != NULL)
+                dump_checksums(form, data, chunk_size);
+        }
+        else
+        {
+            printf("\nSkipping unknown '%.4s' chunk (%d bytes).\n",
+                   id, (int)chunk_size);
+        }
         end_chunk(&data, &size, chunk_size);
     }
 
-    if (size > 0)
-        printf("Warning: extra data at end of ALI FORM chunk.\n");
+    if (*next != NULL)
+        printf("Missing '%s' chunk.\n", *next);
 }
 
 int check_opts()
@@ -0,0 +1,332 @@
+#include "completion.h"
+#include "strings.h"
+#include <stdint.h>
+#include <string.h>
+
+/* Prefix parsing uses a bit mask of token positions, so the number of
+   complete words in the input is limited to 63. */
+#if MAX_COMMAND_WORDS > 63
+#error MAX_COMMAND_WORDS too large for completion
+#endif
+
+/* Memoized result of matching a non-terminal symbol at a token position. */
+typedef struct MemoEntry
+{
+    unsigned    generation;     /* entry is valid if equal to c->generation */
+    int         symbol, pos;
+    uint64_t    ends;           /* positions where a match can end */
+} MemoEntry;
+
+struct Completer
+{
+    Module          *mod;
+    int             *rank;      /* position of each word in the word trie */
+
+    /* Hash table of memoized matches for the current query */
+    MemoEntry       *memo;
+    size_t          memo_size, memo_used;
+    unsigned        generation;
+
+    /* Cached guard results (valid if guard_gen[g] == state_gen) */
+    bool            *guard_active;
+    unsigned        *guard_gen, state_gen;
+
+    /* Words that may come next (indexed by rank) */
+    bool            *next;
+
+    /* Results for the complete words of the last query */
+    bool            valid;
+    const CommandSet *set;
+    bool            active_only;
+    int             words[MAX_COMMAND_WORDS], nword;
+    int             *cands;     /* ranks of words that may come next, sorted */
+    int             ncand;
+};
+
+Completer *alloc_completer(Module *mod)
+{
+    Completer *c = calloc(1, sizeof(Completer));
+    if (c == NULL)
+        return NULL;
+
+    c->mod          = mod;
+    c->rank         = malloc(sizeof(int)*(mod->nword + 1));
+    c->next         = calloc(mod->nword + 1, sizeof(bool));
+    c->cands        = malloc(sizeof(int)*(mod->nword + 1));
+    c->guard_active = calloc(mod->nfunction + 1, sizeof(bool));
+    c->guard_gen    = calloc(mod->nfunction + 1, sizeof(unsigned));
+    c->memo_size    = 64;
+    c->memo         = calloc(c->memo_size, sizeof(MemoEntry));
+    c->generation   = 1;
+    c->state_gen    = 1;
+    if ( c->rank == NULL || c->next == NULL || c->cands == NULL ||
+         c->guard_active == NULL || c->guard_gen == NULL || c->memo == NULL )
+    {
+        free_completer(c);
+        return NULL;
+    }
+
+    int n;
+    for (n = 0; n < mod->word_trie->nentry; ++n)
+        c->rank[mod->word_trie->entries[n].word] = n;
+
+    return c;
+}
+
+void free_completer(Completer *c)
+{
+    free(c->rank);
+    free(c->next);
+    free(c->cands);
+    free(c->guard_active);
+    free(c->guard_gen);
+    free(c->memo);
+    free(c);
+}
+
+void reset_completer(Completer *c)
+{
+    c->valid = false;
+    ++c->state_gen;
+}
+
+static size_t memo_slot(const Completer *c, int symbol, int pos)
+{
+    return ((unsigned)symbol*64u + (unsigned)pos)*2654435761u & (c->memo_size - 1);
+}
+
+/* Returns the memo entry for (symbol, pos), creating it if necessary. */
+static MemoEntry *memo_lookup(Completer *c, int symbol, int pos, bool *found)
+{
+    if (2*(c->memo_used + 1) > c->memo_size)
+    {
+        /* Grow the table, keeping only entries of the current query */
+        MemoEntry *old = c->memo;
+        size_t old_size = c->memo_size, n;
+        MemoEntry *memo = calloc(2*old_size, sizeof(MemoEntry));
+        if (memo == NULL)
+            return NULL;
+        c->memo      = memo;
+        c->memo_size = 2*old_size;
+        for (n = 0; n < old_size; ++n)
+        {
+            if (old[n].generation != c->generation)
+                continue;
+            size_t i = memo_slot(c, old[n].symbol, old[n].pos);
+            while (memo[i].generation == c->generation)
+                i = (i + 1) & (c->memo_size - 1);
+            memo[i] = old[n];
+        }
+        free(old);
+    }
+
+    size_t i = memo_slot(c, symbol, pos);
+    while (c->memo[i].generation == c->generation)
+    {
+        if (c->memo[i].symbol == symbol && c->memo[i].pos == pos)
+        {
+            *found = true;
+            return &c->memo[i];
+        }
+        i = (i + 1) & (c->memo_size - 1);
+    }
+    c->memo[i].generation = c->generation;
+    c->memo[i].symbol     = symbol;
+    c->memo[i].pos        = pos;
+    c->memo[i].ends       = 0;
+    ++c->memo_used;
+    *found = false;
+    return &c->memo[i];
+}
+
+/* Returns the set of positions j such that `sym' derives words[pos..j).
+   Also marks every word that `sym' can derive at position c->nword (after
+   deriving words[pos..nword)) as a possible next word. */
+static uint64_t match_prefix(Completer *c, const SymbolRef *sym, int pos)
+{
+    if (sym->type == SYM_TERMINAL)
+    {
+        if (pos < c->nword)
+            return c->words[pos] == sym->index ? (uint64_t)1 << (pos + 1) : 0;
+        c->next[c->rank[sym->index]] = true;
+        return 0;
+    }
+
+    bool found;
+    MemoEntry *entry = memo_lookup(c, sym->index, pos, &found);
+    if (entry == NULL)
+        return 0;
+    if (found)
+        return entry->ends;
+
+    const GrammarRuleSet *rules = &c->mod->symbol_rules[sym->index];
+    uint64_t ends = 0;
+    size_t r, s;
+    for (r = 0; r < rules->nrule; ++r)
+    {
+        const SymbolRefList *rule = rules->rules[r];
+        uint64_t cur = (uint64_t)1 << pos;
+        for (s = 0; s < rule->nref && cur != 0; ++s)
+        {
+            uint64_t next = 0;
+            int p;
+            for (p = 0; p <= c->nword; ++p)
+                if (cur & ((uint64_t)1 << p))
+                    next |= match_prefix(c, &rule->refs[s], p);
+            cur = next;
+        }
+        ends |= cur;
+    }
+
+    /* The entry may have moved if the table was resized */
+    entry = memo_lookup(c, sym->index, pos, &found);
+    if (entry != NULL)
+        entry->ends = ends;
+    return ends;
+}
+
+/* Evaluates a command guard, discarding any output it produces (so
+   completion never affects the output of the next command). */
+static bool evaluate_guard_quietly(Interpreter *I, int guard)
+{
+    Array *output = I->output, discarded = AR_INIT(sizeof(char));
+    bool active;
+
+    I->output = &discarded;
+    active = evaluate_guard(I, guard, NULL, 0);
+    I->output = output;
+    AR_destroy(&discarded);
+    return active;
+}
+
+/* Returns whether a command guard is active. Guards of commands with slots
+   depend on the entities matched, which are not known yet, so these are
+   assumed to be active. */
+static bool guard_active(Completer *c, Interpreter *I, int guard)
+{
+    if (guard < 0 || guard >= c->mod->nfunction)
+        return evaluate_guard_quietly(I, guard);
+    if (c->mod->functions[guard].nparam > 0)
+        return true;
+    if (c->guard_gen[guard] != c->state_gen)
+    {
+        c->guard_active[guard] = evaluate_guard_quietly(I, guard);
+        c->guard_gen[guard]    = c->state_gen;
+    }
+    return c->guard_active[guard];
+}
+
+/* Computes the candidate next words for c->words[0..nword). */
+static void find_candidates(Completer *c, Interpreter *I)
+{
+    const CommandSet *set = c->set;
+    const int *commands;
+    int ncommand, n;
+
+    /* Only commands that start with the first word can match */
+    if (c->nword > 0)
+    {
+        commands = set->first_commands + set->first_start[c->words[0]];
+        ncommand = set->first_start[c->words[0] + 1] -
+                   set->first_start[c->words[0]];
+    }
+    else
+    {
+        commands = NULL;
+        ncommand = set->ncommand;
+    }
+
+    ++c->generation;
+    c->memo_used = 0;
+    memset(c->next, 0, sizeof(bool)*c->mod->nword);
+    for (n = 0; n < ncommand; ++n)
+    {
+        const Command *command = &set->commands[commands ? commands[n] : n];
+        if (!c->active_only || guard_active(c, I, command->guard))
+            match_prefix(c, &command->symbol, 0);
+    }
+
+    c->ncand = 0;
+    for (n = 0; n < c->mod->nword; ++n)
+        if (c->next[n])
+            c->cands[c->ncand++] = n;
+    c->valid = true;
+}
+
+/* Returns the first element in the sorted range [first, last) that is not
+   less than `value'. */
+static const int *lower_bound(const int *first, const int *last, int value)
+{
+    while (first < last)
+    {
+        const int *mid = first + (last - first)/2;
+        if (*mid < value)
+            first = mid + 1;
+        else
+            last = mid;
+    }
+    return first;
+}
+
+int complete_command( Completer *c, Interpreter *I, const char *input,
+                      bool active_only, int *words, int max_words )
+{
+    WordRef refs[MAX_COMMAND_WORDS + 1];
+    char *line = strdup(input);
+    size_t len = strlen(input), nref;
+    int nword, n, found = 0;
+
+    if (line == NULL)
+        return 0;
+
+    /* Split the input into complete words and a (possibly empty) partial
+       word. */
+    nref = tokenize(line, refs, MAX_COMMAND_WORDS + 1);
+    bool partial = nref > 0 && ends_in_word(input, len);
+    nword = (int)nref - partial;
+    if (nword > MAX_COMMAND_WORDS)
+        goto done;
+
+    /* Look up complete words, and reuse the previous results if they are
+       unchanged (which is the case while the player types the next word) */
+    int ids[MAX_COMMAND_WORDS];
+    for (n = 0; n < nword; ++n)
+        if ((ids[n] = find_word(c->mod, refs[n].text)) < 0)
+            goto done;
+
+    const CommandSet *set = active_command_set(I);
+    if ( !c->valid || c->set != set || c->active_only != active_only ||
+         c->nword != nword || memcmp(c->words, ids, sizeof(int)*nword) != 0 )
+    {
+        c->set         = set;
+        c->active_only = active_only;
+        c->nword       = nword;
+        memcpy(c->words, ids, sizeof(int)*nword);
+        find_candidates(c, I);
+    }
+
+    /* Select candidates that start with the partial word */
+    const int *first = c->cands, *last = c->cands + c->ncand;
+    if (partial)
+    {
+        const char *text = refs[nword].text;
+        size_t text_len = 0;
+        int lo, hi;
+        while (text[text_len] != '\0' && text[text_len] != ' ')
+            ++text_len;
+        if (!WT_prefix(c->mod->word_trie, text, text_len, &lo, &hi))
+            goto done;
+        first = lower_bound(first, last, lo);
+        last  = lower_bound(first, last, hi);
+    }
+    for ( ; first < last; ++first)
+    {
+        if (found < max_words)
+            words[found] = c->mod->word_trie->entries[*first].word;
+        ++found;
+    }
+
+done:
+    free(line);
+    return found;
+}
@@ -0,0 +1,37 @@
+#ifndef COMPLETION_H_INCLUDED
+#define COMPLETION_H_INCLUDED
+
+/* Command completion: given a partially typed command, determines which
+   words may come next according to the command grammar.
+
+   A completer keeps the results for the words typed so far, so that calls
+   made while the player is typing the next word only need to filter the
+   cached results by the partial word.
+*/
+
+#include <stdbool.h>
+#include "interpreter.h"
+
+typedef struct Completer Completer;
+
+/* Allocates a completer for the given module. */
+Completer *alloc_completer(Module *mod);
+void free_completer(Completer *c);
+
+/* Discards cached results. Must be called whenever the game state may have
+   changed (e.g. after a command was processed), since the active context and
+   the results of command guards depend on it. */
+void reset_completer(Completer *c);
+
+/* Finds words that may follow the given (unnormalized) input. If the input
+   does not end with white space, its last word is considered incomplete and
+   only words starting with it are returned. If `active_only' is set, only
+   commands with active guards are considered (commands with entity slots are
+   always considered, since their guards depend on the entities matched).
+
+   Up to `max_words' indices into the word table are stored in `words', in
+   alphabetical order. Returns the total number of words found. */
+int complete_command( Completer *c, Interpreter *I, const char *input,
+                      bool active_only, int *words, int max_words );
+
+#endif /* ndef COMPLETION_H_INCLUDED */
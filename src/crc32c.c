@@ -0,0 +1,109 @@
+#include "crc32c.h"
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define WITH_SSE42
+#include <nmmintrin.h>
+#endif
+
+#ifdef WITH_THREADS
+#include <pthread.h>
+#endif
+
+/* CRC-32C polynomial (in reversed bit order) */
+#define POLYNOMIAL 0x82f63b78u
+
+/* Lookup tables for slicing-by-8: table[k][b] is the CRC of byte b followed
+   by k zero bytes. */
+static uint32_t table[8][256];
+
+static void init_table(void)
+{
+    uint32_t crc;
+    int b, k;
+
+    for (b = 0; b < 256; ++b)
+    {
+        crc = b;
+        for (k = 0; k < 8; ++k)
+            crc = (crc >> 1) ^ (POLYNOMIAL & -(crc & 1));
+        table[0][b] = crc;
+    }
+    for (b = 0; b < 256; ++b)
+    {
+        crc = table[0][b];
+        for (k = 1; k < 8; ++k)
+        {
+            crc = (crc >> 8) ^ table[0][crc & 0xff];
+            table[k][b] = crc;
+        }
+    }
+}
+
+static uint32_t crc32c_table(uint32_t crc, const unsigned char *p, size_t size)
+{
+#ifdef WITH_THREADS
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, init_table);
+#else
+    static bool initialized = false;
+    if (!initialized)
+    {
+        init_table();
+        initialized = true;
+    }
+#endif
+
+    /* Process 8 bytes at a time; the first four are combined with the CRC.
+       Bytes are combined explicitly so this works in either byte order. */
+    for ( ; size >= 8; size -= 8, p += 8)
+    {
+        uint32_t lo = crc ^ ( (uint32_t)p[0] | (uint32_t)p[1] << 8 |
+                              (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24 );
+        crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^
+              table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24] ^
+              table[3][p[4]] ^ table[2][p[5]] ^
+              table[1][p[6]] ^ table[0][p[7]];
+    }
+    for ( ; size > 0; --size, ++p)
+        crc = (crc >> 8) ^ table[0][(crc ^ *p) & 0xff];
+    return crc;
+}
+
+#ifdef WITH_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, size_t size)
+{
+#ifdef __x86_64__
+    uint64_t crc64 = crc, word;
+
+    for ( ; size >= 8; size -= 8, p += 8)
+    {
+        memcpy(&word, p, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = (uint32_t)crc64;
+#else
+    uint32_t word;
+
+    for ( ; size >= 4; size -= 4, p += 4)
+    {
+        memcpy(&word, p, 4);
+        crc = _mm_crc32_u32(crc, word);
+    }
+#endif
+    for ( ; size > 0; --size, ++p)
+        crc = _mm_crc32_u8(crc, *p);
+    return crc;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t size)
+{
+#ifdef WITH_SSE42
+    if (__builtin_cpu_supports("sse4.2"))
+        return ~crc32c_sse42(~crc, data, size);
+#endif
+    return ~crc32c_table(~crc, data, size);
+}
@@ -0,0 +1,13 @@
+#ifndef CRC32C_H_INCLUDED
+#define CRC32C_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Computes the CRC-32C (Castagnoli) checksum of `size' bytes of `data',
+   continuing from the checksum `crc' of preceding data (which is 0 for the
+   start of the data). Uses the SSE4.2 CRC32 instruction if the processor
+   supports it, or a table-driven implementation (slicing-by-8) otherwise. */
+uint32_t crc32c(uint32_t crc, const void *data, size_t size);
+
+#endif /* ndef CRC32C_H_INCLUDED */
@@ -14,9 +14,11 @@ int yylex();
 void yyerror(const char *str);
 
 /* Functions defined in alic.c */
+void begin_context(const char *str);
 void begin_command(const char *str);
 void end_guard(void);
 void end_command(void);
+void add_slot_parameters(void);
 void begin_function(const char *id, int nret);
 void add_parameter(const char *id);
 void emit(int opcode, int arg);
@@ -47,7 +49,7 @@ void add_synonyms(void);
 
 %token FRAGMENT
 %token IF THEN ELSE SET
-%token VERB ENTITY PREPOSITION FUNCTION PROCEDURE COMMAND
+%token VERB ENTITY PREPOSITION FUNCTION PROCEDURE COMMAND CONTEXT
 %token EQUAL INEQUAL AND OR NOT TRUE FALSE NIL
 %token LPAREN RPAREN LCURBR RCURBR LSQRBR RSQRBR
 %token PERIOD COMMA SEMICOLON SLASH
@@ -67,6 +69,7 @@ decl            : declverb
                 | declpreposition
                 | declfunction
                 | declprocedure
+                | declcontext
                 | declcommand;
 
 declverb        : VERB { begin_verb(); } synonyms PERIOD;
@@ -88,16 +91,19 @@ declprocedure   : PROCEDURE
                   LPAREN optparameters RPAREN
                   block { end_function(); };
 
+declcontext     : CONTEXT SYMBOL { begin_context(yytext); } PERIOD;
+
 declcommand     : optcmdtok
                   cmdfrags { begin_function(NULL, 1); /* guard */ }
-                  guard { begin_function(NULL, 0); /* body */ }
+                  guard { begin_function(NULL, 0); /* body */
+                          add_slot_parameters(); }
                   block { end_command(); };
 optcmdtok       : COMMAND
                 | ;
 cmdfrags        : cmdfrags COMMA cmdfrag
                 | cmdfrag;
 cmdfrag         : FRAGMENT { begin_command(yytext); };
-guard           : expression { end_guard(); }
+guard           : { add_slot_parameters(); } expression { end_guard(); }
                 | ;
 
 optparameters   : parameters
@@ -0,0 +1,766 @@
+#include "debug.h"
+#include "image.h"
+#include "io.h"
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef WITH_MMAP
+#include <dirent.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <utime.h>
+
+/* Temporary files left in a cache directory (by processes that did not get
+   to publish their image) are removed after this many seconds. */
+#define STALE_TEMP_AGE  3600
+#endif
+
+#define IMAGE_MAGIC     "ALIIMAGE"
+#define IMAGE_VERSION   1
+
+/* Alignment of tables in the image (sufficient for any type used) */
+#define IMAGE_ALIGN     16
+
+/* Preferred base address of images; chosen far away from where the heap,
+   shared libraries and stack are normally placed. */
+#if UINTPTR_MAX > 0xffffffffu
+#define IMAGE_BASE      ((uintptr_t)0x3a0000000000)
+#else
+#define IMAGE_BASE      ((uintptr_t)0x50000000)
+#endif
+
+/* Offset used to represent a null pointer while writing an image */
+#define NO_DATA         ((size_t)-1)
+
+typedef struct ImageHeader
+{
+    char        magic[8];       /* IMAGE_MAGIC */
+    unsigned    abi;            /* ABI fingerprint (see image_abi()) */
+    unsigned    reserved;
+    uint64_t    module_hash;    /* hash of the module file (see hash_file()) */
+    uintptr_t   base;           /* address the image is linked at */
+    size_t      size;           /* total size of the image (in bytes) */
+    size_t      module;         /* offset of the Module structure */
+    size_t      relocs;         /* offset of the relocation table */
+    size_t      nreloc;         /* number of relocations (pointers) */
+} ImageHeader;
+
+typedef struct ImageWriter
+{
+    Array       data;           /* image contents (bytes) */
+    Array       relocs;         /* offsets of pointers in the image (size_t) */
+} ImageWriter;
+
+
+/* Returns a fingerprint of the data layout used by images, which depends on
+   the sizes of the module structures and the host's byte order. */
+static unsigned image_abi(void)
+{
+    const size_t layout[] = {
+        IMAGE_VERSION, MODULE_VERSION, sizeof(void*), sizeof(size_t),
+        sizeof(int), sizeof(bool), sizeof(ImageHeader), sizeof(Module),
+        offsetof(Module, command_sets), sizeof(Instruction), sizeof(Function),
+        sizeof(Command), sizeof(CommandSet), sizeof(SymbolRef),
+        sizeof(SymbolRefList), sizeof(GrammarRuleSet), sizeof(CaptureIndex),
+        sizeof(WordTrie), sizeof(WTEntry) };
+    const unsigned char *p = (const unsigned char*)layout;
+    unsigned hash = 2166136261u;
+    size_t n;
+
+    for (n = 0; n < sizeof(layout); ++n)
+        hash = (hash ^ p[n])*16777619u;
+    return hash;
+}
+
+/* Computes a 64-bit hash of the contents of a file. The data is hashed as
+   8-byte words in four independent lanes, which is much faster than hashing
+   it byte by byte. */
+static bool hash_file(const char *path, uint64_t *hash)
+{
+    const uint64_t k = 0x9e3779b97f4a7c15ull;
+    uint64_t lanes[4] = { 1, 2, 3, 4 }, word, total = 0;
+    unsigned char buf[65536 + 32];
+    size_t nread, n, i;
+    FILE *fp;
+
+    fp = fopen(path, "rb");
+    if (fp == NULL)
+        return false;
+    while ((nread = fread(buf, 1, 65536, fp)) > 0)
+    {
+        /* Only the last block can be partial; it is padded with zeroes */
+        memset(buf + nread, 0, (32 - nread%32)%32);
+        for (n = 0; n < nread; n += 32)
+        {
+            for (i = 0; i < 4; ++i)
+            {
+                memcpy(&word, buf + n + 8*i, 8);
+                lanes[i] = (lanes[i] ^ word)*k;
+                lanes[i] ^= lanes[i] >> 29;
+            }
+        }
+        total += nread;
+    }
+    *hash = total;
+    for (i = 0; i < 4; ++i)
+    {
+        *hash = (*hash ^ lanes[i])*k;
+        *hash ^= *hash >> 32;
+    }
+    nread = ferror(fp);
+    fclose(fp);
+    return nread == 0;
+}
+
+/* Appends `size' bytes (copied from `src', or zero if `src' is NULL) to the
+   image, at the given alignment. Returns the offset of the data. */
+static size_t put_data(ImageWriter *w, const void *src, size_t size,
+                       size_t align)
+{
+    size_t old_size = AR_size(&w->data), pos;
+
+    pos = old_size + (align - old_size%align)%align;
+    AR_resize(&w->data, pos + size);
+    memset(AR_at(&w->data, old_size), 0, pos - old_size);
+    if (src != NULL && size > 0)
+        memcpy(AR_at(&w->data, pos), src, size);
+    else
+        memset(AR_at(&w->data, pos), 0, size);
+    return pos;
+}
+
+/* Appends an array of `n' elements, or returns NO_DATA if `src' is NULL. */
+static size_t put_array(ImageWriter *w, const void *src, size_t n,
+                        size_t el_size)
+{
+    if (src == NULL)
+        return NO_DATA;
+    return put_data(w, src, n*el_size, IMAGE_ALIGN);
+}
+
+/* Stores a pointer to the data at offset `target' (or a null pointer, if
+   `target' is NO_DATA) at offset `pos' of the image. */
+static void put_ptr(ImageWriter *w, size_t pos, size_t target)
+{
+    uintptr_t p = 0;
+
+    if (target != NO_DATA)
+    {
+        p = IMAGE_BASE + target;
+        AR_push(&w->relocs, &pos);
+    }
+    memcpy(AR_at(&w->data, pos), &p, sizeof(p));
+}
+
+/* Appends a table of strings. If `offsets' is not NULL, the offsets of the
+   individual strings are stored in it. */
+static size_t put_strings( ImageWriter *w, char * const *strings, int n,
+                           size_t *offsets )
+{
+    size_t table, pos;
+    int i;
+
+    if (strings == NULL)
+        return NO_DATA;
+    table = put_data(w, NULL, n*sizeof(char*), IMAGE_ALIGN);
+    for (i = 0; i < n; ++i)
+    {
+        pos = put_data(w, strings[i], strlen(strings[i]) + 1, 1);
+        put_ptr(w, table + i*sizeof(char*), pos);
+        if (offsets != NULL)
+            offsets[i] = pos;
+    }
+    return table;
+}
+
+/* Appends the function table, and stores the offset of the (decoded)
+   instructions, which are copied as a whole, in `instrs'. */
+static size_t put_functions(ImageWriter *w, const Module *mod, size_t *instrs)
+{
+    size_t table, pos;
+    int n;
+
+    *instrs = NO_DATA;
+    if (mod->functions == NULL)
+        return NO_DATA;
+
+    *instrs = put_array(w, mod->instrs, mod->ncode, sizeof(Instruction));
+    table = put_array(w, mod->functions, mod->nfunction, sizeof(Function));
+    for (n = 0; n < mod->nfunction; ++n)
+    {
+        pos = table + n*sizeof(Function);
+        put_ptr( w, pos + offsetof(Function, instrs), *instrs +
+                 (mod->functions[n].instrs - mod->instrs)*sizeof(Instruction) );
+        put_ptr(w, pos + offsetof(Function, code), NO_DATA);
+    }
+    return table;
+}
+
+static size_t put_trie(ImageWriter *w, const WordTrie *trie,
+                       const size_t *word_offsets)
+{
+    size_t entries, pos;
+    int n;
+
+    if (trie == NULL)
+        return NO_DATA;
+    entries = put_array(w, trie->entries, trie->nentry, sizeof(WTEntry));
+    for (n = 0; n < trie->nentry; ++n)
+    {
+        put_ptr( w, entries + n*sizeof(WTEntry) + offsetof(WTEntry, text),
+                 word_offsets[trie->entries[n].word] );
+    }
+    pos = put_data(w, trie, sizeof(WordTrie), IMAGE_ALIGN);
+    put_ptr(w, pos + offsetof(WordTrie, entries), entries);
+    return pos;
+}
+
+static size_t put_grammar(ImageWriter *w, const Module *mod)
+{
+    size_t table, rules, rule, r;
+    int n;
+
+    if (mod->symbol_rules == NULL)
+        return NO_DATA;
+    table = put_array( w, mod->symbol_rules, mod->nsymbol,
+                       sizeof(GrammarRuleSet) );
+    for (n = 0; n < mod->nsymbol; ++n)
+    {
+        const GrammarRuleSet *set = &mod->symbol_rules[n];
+
+        rules = put_data(w, NULL, set->nrule*sizeof(SymbolRefList*), IMAGE_ALIGN);
+        for (r = 0; r < set->nrule; ++r)
+        {
+            const SymbolRefList *list = set->rules[r];
+
+            rule = put_data(w, list, sizeof(SymbolRefList), IMAGE_ALIGN);
+            put_ptr( w, rule + offsetof(SymbolRefList, refs),
+                     put_array(w, list->refs, list->nref, sizeof(SymbolRef)) );
+            put_ptr(w, rules + r*sizeof(SymbolRefList*), rule);
+        }
+        put_ptr( w, table + n*sizeof(GrammarRuleSet) +
+                    offsetof(GrammarRuleSet, rules), rules );
+    }
+    return table;
+}
+
+static size_t put_command_sets(ImageWriter *w, const Module *mod,
+                               size_t commands)
+{
+    size_t table, pos;
+    int cs;
+
+    if (mod->command_sets == NULL)
+        return NO_DATA;
+    table = put_array( w, mod->command_sets, mod->ncommandset,
+                       sizeof(CommandSet) );
+    for (cs = 0; cs < mod->ncommandset; ++cs)
+    {
+        const CommandSet *set = &mod->command_sets[cs];
+
+        pos = table + cs*sizeof(CommandSet);
+        put_ptr( w, pos + offsetof(CommandSet, commands), commands +
+                 (set->commands - mod->commands)*sizeof(Command) );
+        put_ptr( w, pos + offsetof(CommandSet, first_start),
+                 put_array(w, set->first_start, mod->nword + 1, sizeof(int)) );
+        put_ptr( w, pos + offsetof(CommandSet, first_commands),
+                 put_array( w, set->first_commands,
+                            set->first_start[mod->nword], sizeof(int) ) );
+        put_ptr( w, pos + offsetof(CommandSet, nullable_commands),
+                 put_array( w, set->nullable_commands, set->nnullable,
+                            sizeof(int) ) );
+    }
+    return table;
+}
+
+/* Writes an image of `mod' (of which the module file has the given hash)
+   to `fp'. */
+static bool write_image(Module *mod, uint64_t hash, FILE *fp)
+{
+    ImageWriter w = { AR_INIT(1), AR_INIT(sizeof(size_t)) };
+    ImageHeader header;
+    Module copy;
+    Arena arena = AN_INIT;
+    size_t m, slots, commands, functions, instrs, *word_offsets;
+    bool ok;
+
+    /* Functions are stored decoded (so images are not modified in use) */
+    decode_functions(mod, false);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+    header.abi  = image_abi();
+    header.base = IMAGE_BASE;
+    header.module_hash = hash;
+    word_offsets = malloc(sizeof(size_t)*(mod->nword + 1));
+    if (word_offsets == NULL)
+        return false;
+
+    /* The header is filled in when the image is complete */
+    put_data(&w, NULL, sizeof(ImageHeader), IMAGE_ALIGN);
+
+    /* Module structure; all pointers in it are replaced below */
+    copy = *mod;
+    copy.arena      = arena;
+    copy.image      = NULL;
+    copy.image_size = 0;
+    copy.decoder    = NULL;
+    m = put_data(&w, &copy, sizeof(Module), IMAGE_ALIGN);
+
+    put_ptr( &w, m + offsetof(Module, strings),
+             put_strings(&w, mod->strings, mod->nstring, NULL) );
+    functions = put_functions(&w, mod, &instrs);
+    put_ptr(&w, m + offsetof(Module, functions), functions);
+    put_ptr(&w, m + offsetof(Module, code), NO_DATA);
+    put_ptr(&w, m + offsetof(Module, instrs), instrs);
+    put_ptr( &w, m + offsetof(Module, words),
+             put_strings(&w, mod->words, mod->nword, word_offsets) );
+    put_ptr( &w, m + offsetof(Module, word_index),
+             put_array( &w, mod->word_index, mod->word_index_size,
+                        sizeof(int) ) );
+    put_ptr( &w, m + offsetof(Module, word_disp),
+             put_array( &w, mod->word_disp, mod->word_disp_size,
+                        sizeof(unsigned) ) );
+    put_ptr( &w, m + offsetof(Module, word_trie),
+             put_trie(&w, mod->word_trie, word_offsets) );
+    put_ptr( &w, m + offsetof(Module, symbol_rules), put_grammar(&w, mod) );
+    put_ptr( &w, m + offsetof(Module, symbol_nullable),
+             put_array( &w, mod->symbol_nullable, mod->nsymbol,
+                        sizeof(bool) ) );
+
+    slots = m + offsetof(Module, slots);
+    put_ptr( &w, slots + offsetof(CaptureIndex, has_capture),
+             put_array( &w, mod->slots.has_capture, mod->nsymbol,
+                        sizeof(bool) ) );
+    put_ptr( &w, slots + offsetof(CaptureIndex, last_start),
+             put_array( &w, mod->slots.last_start, mod->nword + 1,
+                        sizeof(int) ) );
+    put_ptr( &w, slots + offsetof(CaptureIndex, last_rules),
+             put_array( &w, mod->slots.last_rules, mod->slots.last_start ?
+                        mod->slots.last_start[mod->nword] : 0, sizeof(int) ) );
+    put_ptr( &w, slots + offsetof(CaptureIndex, nullable_rules),
+             put_array( &w, mod->slots.nullable_rules, mod->slots.nnullable,
+                        sizeof(int) ) );
+
+    commands = put_array(&w, mod->commands, mod->ncommand, sizeof(Command));
+    put_ptr(&w, m + offsetof(Module, commands), commands);
+    put_ptr( &w, m + offsetof(Module, command_sets),
+             put_command_sets(&w, mod, commands) );
+
+    /* Relocation table */
+    header.nreloc = AR_size(&w.relocs);
+    header.relocs = put_data( &w, AR_data(&w.relocs),
+                              header.nreloc*sizeof(size_t), IMAGE_ALIGN );
+    header.module = m;
+    header.size   = AR_size(&w.data);
+    memcpy(AR_data(&w.data), &header, sizeof(header));
+
+    ok = fwrite(AR_data(&w.data), 1, header.size, fp) == header.size;
+
+    free(word_offsets);
+    AR_destroy(&w.data);
+    AR_destroy(&w.relocs);
+    return ok;
+}
+
+bool write_module_image(Module *mod, const char *module_path,
+                        const char *path)
+{
+    uint64_t hash;
+    FILE *fp;
+    bool ok;
+
+    if (!hash_file(module_path, &hash))
+        return false;
+    fp = fopen(path, "wb");
+    if (fp == NULL)
+        return false;
+    ok = write_image(mod, hash, fp);
+    if (fclose(fp) != 0)
+        ok = false;
+    return ok;
+}
+
+static bool read_header(FILE *fp, ImageHeader *header)
+{
+    return fread(header, sizeof(*header), 1, fp) == 1 &&
+           memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) == 0;
+}
+
+bool is_module_image(const char *path)
+{
+    char magic[sizeof(IMAGE_MAGIC) - 1];
+    FILE *fp;
+    bool res;
+
+    fp = fopen(path, "rb");
+    if (fp == NULL)
+        return false;
+    res = fread(magic, sizeof(magic), 1, fp) == 1 &&
+          memcmp(magic, IMAGE_MAGIC, sizeof(magic)) == 0;
+    fclose(fp);
+    return res;
+}
+
+/* Adjusts the pointers of an image that is loaded at `addr' instead of the
+   base address it was linked at. */
+static bool relocate(unsigned char *addr, const ImageHeader *header)
+{
+    uintptr_t delta = (uintptr_t)addr - header->base;
+    const size_t *relocs;
+    size_t n, pos;
+
+    if (header->relocs%sizeof(size_t) != 0 || header->relocs > header->size ||
+        header->nreloc > (header->size - header->relocs)/sizeof(size_t))
+        return false;
+
+    relocs = (const size_t*)(addr + header->relocs);
+    for (n = 0; n < header->nreloc; ++n)
+    {
+        pos = relocs[n];
+        if (pos%sizeof(uintptr_t) != 0 || pos > header->size - sizeof(uintptr_t))
+            return false;
+        *(uintptr_t*)(addr + pos) += delta;
+    }
+    return true;
+}
+
+/* Loads an image. If `hash' is not NULL, the image is a shared image (see
+   load_shared_module()), which is only accepted if it was built from a module
+   file with the given hash and can only be modified by the current user;
+   otherwise, NULL is returned without reporting an error. */
+static Module *load_image(const char *path, const uint64_t *hash)
+{
+    ImageHeader header;
+    unsigned char *addr = NULL;
+    const char *problem = NULL;
+    Module *mod;
+    FILE *fp;
+
+    fp = fopen(path, "rb");
+    if (fp == NULL)
+    {
+        problem = "Unable to open file \"%s\" for reading.";
+        goto failed;
+    }
+    if (!read_header(fp, &header))
+    {
+        problem = "File \"%s\" is not a module image.";
+        goto failed;
+    }
+    if (header.abi != image_abi())
+    {
+        problem = "Module image \"%s\" was built for a different platform or "
+                  "interpreter version.";
+        goto failed;
+    }
+    if ( fseek(fp, 0, SEEK_END) != 0 || ftell(fp) < 0 ||
+         (size_t)ftell(fp) != header.size || header.module > header.size ||
+         header.size - header.module < sizeof(Module) )
+    {
+        problem = "Module image \"%s\" is truncated or corrupt.";
+        goto failed;
+    }
+    if (hash != NULL)
+    {
+        if (header.module_hash != *hash)
+            goto failed;
+
+        /* Images are trusted, so only accept our own (with or without
+           WITH_MMAP, since anyone may write to a shared directory) */
+        struct stat st;
+        if (fstat(fileno(fp), &st) != 0 || st.st_uid != geteuid() ||
+            (st.st_mode & (S_IWGRP|S_IWOTH)) != 0)
+            goto failed;
+    }
+
+#ifdef WITH_MMAP
+    addr = mmap( (void*)header.base, header.size, PROT_READ, MAP_PRIVATE,
+                 fileno(fp), 0 );
+    if (addr == MAP_FAILED)
+    {
+        addr = NULL;
+        problem = "Unable to map module image \"%s\".";
+        goto failed;
+    }
+    if ((uintptr_t)addr != header.base)
+    {
+        /* Mapped elsewhere: relocate pointers (in private copies of the pages
+           that contain them), then make the image read-only again. */
+        if (mprotect(addr, header.size, PROT_READ|PROT_WRITE) != 0 ||
+            !relocate(addr, &header) ||
+            mprotect(addr, header.size, PROT_READ) != 0)
+        {
+            problem = "Unable to relocate module image \"%s\".";
+            goto failed;
+        }
+    }
+#else
+    addr = malloc(header.size);
+    if (addr == NULL || fseek(fp, 0, SEEK_SET) != 0 ||
+        fread(addr, 1, header.size, fp) != header.size ||
+        !relocate(addr, &header))
+    {
+        problem = "Unable to read module image \"%s\".";
+        goto failed;
+    }
+#endif
+    fclose(fp);
+    fp = NULL;
+
+    mod = malloc(sizeof(Module));
+    if (mod == NULL)
+        goto failed;
+    memcpy(mod, addr + header.module, sizeof(Module));
+    mod->image      = addr;
+    mod->image_size = header.size;
+    mod->from_image = true;
+    return mod;
+
+failed:
+    if (problem != NULL && hash == NULL)
+        error(problem, path);
+    if (addr != NULL)
+        ios_unmap(addr, header.size);
+    if (fp != NULL)
+        fclose(fp);
+    return NULL;
+}
+
+Module *load_module_image(const char *path)
+{
+    return load_image(path, NULL);
+}
+
+/* Loads a module file into private memory. */
+static Module *load_module_file(const char *path)
+{
+    IOStream ios;
+    Module *mod;
+
+    if (!ios_open(&ios, path, IOM_RDONLY, IOC_AUTO))
+    {
+        error("Unable to open file \"%s\" for reading.", path);
+        return NULL;
+    }
+    mod = load_module(&ios);
+    ios_close(&ios);
+    return mod;
+}
+
+/* Writes an image of `mod' to `path' atomically: the image is written to a
+   temporary file in the same directory first, which is then renamed. */
+static bool publish_image(Module *mod, uint64_t hash, const char *path)
+{
+#ifdef WITH_MMAP
+    char *temp_path;
+    FILE *fp = NULL;
+    bool ok = false;
+    int fd;
+
+    temp_path = malloc(strlen(path) + 8);
+    if (temp_path == NULL)
+        return false;
+    sprintf(temp_path, "%s.XXXXXX", path);
+    fd = mkstemp(temp_path);
+    if (fd >= 0)
+    {
+        /* Readable by everyone (load_image() checks the owner) */
+        fp = fdopen(fd, "wb");
+        ok = fp != NULL && fchmod(fd, 0644) == 0 &&
+             write_image(mod, hash, fp);
+        if (fp != NULL ? fclose(fp) != 0 : close(fd) != 0)
+            ok = false;
+        if (ok)
+            ok = rename(temp_path, path) == 0;
+        if (!ok)
+            unlink(temp_path);
+    }
+    free(temp_path);
+    return ok;
+#else
+    (void)mod;
+    (void)hash;
+    (void)path;
+    return false;
+#endif
+}
+
+#ifdef WITH_MMAP
+/* Creates directory `dir' and its parents, if they do not exist yet. */
+static bool make_dirs(const char *dir)
+{
+    char *path, *p;
+    bool ok = true;
+
+    path = strdup(dir);
+    if (path == NULL)
+        return false;
+    for (p = path + 1; ok; ++p)
+    {
+        if (*p == '/' || *p == '\0')
+        {
+            char c = *p;
+            *p = '\0';
+            ok = mkdir(path, 0700) == 0 || errno == EEXIST;
+            *p = c;
+            if (c == '\0')
+                break;
+        }
+    }
+    free(path);
+    return ok;
+}
+
+typedef struct CacheEntry
+{
+    char        *path;
+    struct timespec mtime;
+    size_t      size;
+} CacheEntry;
+
+static int cmp_cache_entry(const void *a, const void *b)
+{
+    const struct timespec *x = &((const CacheEntry*)a)->mtime,
+                          *y = &((const CacheEntry*)b)->mtime;
+    if (x->tv_sec != y->tv_sec)
+        return x->tv_sec < y->tv_sec ? -1 : 1;
+    return x->tv_nsec < y->tv_nsec ? -1 : x->tv_nsec > y->tv_nsec ? 1 : 0;
+}
+
+/* Removes the least recently used images from the cache directory `dir',
+   until the images in it take up at most `max_size' bytes. Images are
+   touched when they are used (see load_image_via()), so their modification
+   time tells when they were last used. Stale temporary files are removed
+   too. */
+static void evict_images(const char *dir, size_t max_size)
+{
+    Array entries = AR_INIT(sizeof(CacheEntry));
+    size_t total = 0, n, len;
+    struct dirent *de;
+    struct stat st;
+    CacheEntry entry;
+    DIR *dp;
+
+    dp = opendir(dir);
+    if (dp == NULL)
+        return;
+    while ((de = readdir(dp)) != NULL)
+    {
+        len = strlen(de->d_name);
+        if (strncmp(de->d_name, "ali-", 4) != 0)
+            continue;
+        entry.path = malloc(strlen(dir) + len + 2);
+        if (entry.path == NULL)
+            break;
+        sprintf(entry.path, "%s/%s", dir, de->d_name);
+        if (lstat(entry.path, &st) != 0 || !S_ISREG(st.st_mode))
+        {
+            free(entry.path);
+            continue;
+        }
+        if (len > 4 && strcmp(de->d_name + len - 4, ".img") == 0)
+        {
+            entry.mtime = st.st_mtim;
+            entry.size  = st.st_size;
+            total += entry.size;
+            AR_push(&entries, &entry);
+            continue;
+        }
+        if (strstr(de->d_name, ".img.") != NULL &&
+            time(NULL) - st.st_mtime > STALE_TEMP_AGE)
+            unlink(entry.path);
+        free(entry.path);
+    }
+    closedir(dp);
+
+    qsort( AR_data(&entries), AR_size(&entries), sizeof(CacheEntry),
+           cmp_cache_entry );
+    for (n = 0; n < AR_size(&entries); ++n)
+    {
+        CacheEntry *e = AR_at(&entries, n);
+        if (total > max_size && unlink(e->path) == 0)
+            total -= e->size;
+        free(e->path);
+    }
+    AR_destroy(&entries);
+}
+#endif
+
+/* Loads the module file at `path' through an image in directory `dir' (see
+   load_shared_module()). If `cache' is set, `dir' is treated as a cache of
+   at most `max_size' bytes (see load_cached_module()). */
+static Module *load_image_via( const char *path, const char *dir,
+                               bool cache, size_t max_size )
+{
+    uint64_t hash;
+    char *image_path;
+    Module *mod, *shared;
+
+#ifndef WITH_MMAP
+    (void)cache;     /* images are neither touched nor evicted */
+    (void)max_size;
+#endif
+    if (!hash_file(path, &hash))
+    {
+        error("Unable to open file \"%s\" for reading.", path);
+        return NULL;
+    }
+    image_path = malloc(strlen(dir) + 64);
+    if (image_path == NULL)
+        return NULL;
+    sprintf( image_path, "%s/ali-%08x-%016llx.img", dir, image_abi(),
+             (unsigned long long)hash );
+
+    /* Attach to an existing image */
+    shared = load_image(image_path, &hash);
+#ifdef WITH_MMAP
+    if (shared != NULL && cache)
+        utime(image_path, NULL);    /* mark as recently used */
+#endif
+    if (shared == NULL)
+    {
+        /* Load the module privately, then publish an image for others.
+           Concurrent loaders may replace each other's images, which is
+           harmless: the images are equivalent, and a mapping remains valid
+           after its file is replaced. */
+        mod = load_module_file(path);
+        if (mod != NULL && publish_image(mod, hash, image_path))
+        {
+            shared = load_image(image_path, &hash);
+#ifdef WITH_MMAP
+            if (cache && max_size > 0)
+                evict_images(dir, max_size);
+#endif
+        }
+        if (shared == NULL)
+            shared = mod;
+        else
+        if (mod != NULL)
+        {
+            free_module(mod);
+            free(mod);
+        }
+    }
+    free(image_path);
+    return shared;
+}
+
+Module *load_shared_module(const char *path, const char *dir)
+{
+    return load_image_via(path, dir, false, 0);
+}
+
+Module *load_cached_module(const char *path, const char *dir, size_t max_size)
+{
+#ifdef WITH_MMAP
+    if (!make_dirs(dir))
+        warn("Unable to create cache directory \"%s\".", dir);
+#endif
+    return load_image_via(path, dir, true, max_size);
+}
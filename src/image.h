@@ -0,0 +1,57 @@
+#ifndef IMAGE_H_INCLUDED
+#define IMAGE_H_INCLUDED
+
+#include <stdbool.h>
+#include "interpreter.h"
+
+/* Native module images.
+
+   An image is a snapshot of a fully loaded Module, including the indices the
+   interpreter builds at load time, in the host's native data layout. Loading
+   an image requires no decoding: it is mapped into memory read-only and used
+   in place.
+
+   Pointers are stored as offsets relative to a preferred base address, and
+   are listed in a relocation table. If the image can be mapped at its base
+   address (the common case) no pointer needs to be adjusted; otherwise, the
+   pointers are relocated once after mapping.
+
+   The image header identifies the ABI it was built for (pointer size, byte
+   order and structure layout) and contains a hash of the module file it was
+   built from. Images built for a different ABI are rejected. Images are not
+   validated beyond their header and relocation table; they should be treated
+   like executables and only be loaded from trusted sources. */
+
+/* Returns whether the file at `path' is a module image (of any ABI). */
+bool is_module_image(const char *path);
+
+/* Writes an image of `mod', which was loaded from the module file at
+   `module_path', to the file at `path'. All functions are decoded first.
+   Returns false on failure. */
+bool write_module_image(Module *mod, const char *module_path,
+                        const char *path);
+
+/* Loads a module image. Returns NULL (and reports an error) on failure.
+   The module must be released with free_module() (and free()) as usual. */
+Module *load_module_image(const char *path);
+
+/* Loads the module file at `path' through an image that is shared by all
+   processes that load the same module. The image is stored in directory
+   `dir' (e.g. /dev/shm), under a name derived from the ABI and a hash of the
+   module file's contents. If no valid image exists yet, the module is loaded
+   normally and an image of it is published; if that fails, the privately
+   loaded module is returned instead. Images that do not belong to the current
+   user (or can be modified by others) are ignored. Returns NULL (and reports
+   an error) if the module cannot be loaded at all. */
+Module *load_shared_module(const char *path, const char *dir);
+
+/* Loads the module file at `path' through an image in the cache directory
+   `dir' (which is created if necessary), like load_shared_module(). Later
+   loads of the same module are as fast as loading its image, even if the
+   module file is compressed. Whenever an image is added, the least recently
+   used images are removed until the cache takes up at most `max_size' bytes
+   (0 means unlimited); the new image is removed too, if it is larger than
+   that, but the module is still loaded from it. */
+Module *load_cached_module(const char *path, const char *dir, size_t max_size);
+
+#endif /* ndef IMAGE_H_INCLUDED */
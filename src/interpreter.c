@@ -3,8 +3,15 @@
 #include "interpreter.h"
 #include "opcodes.h"
 #include "strings.h"
+#include <ctype.h>
+#include <stdint.h>
 #include <string.h>
 
+#ifdef WITH_THREADS
+#include <pthread.h>
+#include <sched.h>
+#endif
+
 const Value val_true = 1, val_false = 0, val_nil = -1;
 
 /* Limit on the size of the script's execution stack.
@@ -13,9 +20,8 @@ const Value val_true = 1, val_false = 0, val_nil = -1;
    crash the interpreter. */
 #define MAX_STACK_SIZE 1000
 
-/* Limit on the number of words in a command.
-   Useful to keep parsing relatively efficient. */
-#define MAX_COMMAND_WORDS 50
+/* Maximum number of suggestions given for an unknown word. */
+#define MAX_SUGGESTIONS 3
 
 typedef Value (*Builtin)(Interpreter *I, int narg, Value *args);
 
@@ -25,16 +31,19 @@ static Value builtin_writef  (Interpreter *I, int narg, Value *args);
 static Value builtin_pause   (Interpreter *I, int narg, Value *args);
 static Value builtin_quit    (Interpreter *I, int narg, Value *args);
 static Value builtin_reset   (Interpreter *I, int narg, Value *args);
+static Value builtin_set_context(Interpreter *I, int narg, Value *args);
 
 Builtin builtins[NUM_BUILTIN_FUNCS] = {
     builtin_write, builtin_writeln, builtin_writef,
-    builtin_pause, builtin_quit, builtin_reset };
+    builtin_pause, builtin_quit, builtin_reset,
+    builtin_set_context };
 
 const char * const builtin_func_names[NUM_BUILTIN_FUNCS + 1] = {
-    "write", "writeln", "writef", "pause", "quit", "reset", NULL };
+    "write", "writeln", "writef", "pause", "quit", "reset",
+    "set_context", NULL };
 
 const char * const builtin_var_names[NUM_BUILTIN_VARS + 1] = {
-    "title",        "subtitle",     "RESERVED02",   "RESERVED03",
+    "title",        "subtitle",     "context",      "RESERVED03",
     "RESERVED04",   "RESERVED05",   "RESERVED06",   "RESERVED07", NULL };
 
 
@@ -93,24 +102,19 @@ static bool eq_word(const char *a, const char *b)
     return (*a == '\0' || *a == ' ') && (*b == '\0' || *b == ' ');
 }
 
-unsigned hash_word(const char *str)
-{
-    unsigned h = 2166136261u;
-    while (*str != '\0' && *str != ' ')
-    {
-        h *= 16777619u;
-        h ^= *(unsigned char*)str;
-        ++str;
-    }
-    return h;
-}
-
 static bool skip(IOStream *ios, size_t size)
 {
-    while (size-- > 0)
-        if (!read_int8(ios, NULL))
+    char buf[512];
+
+    if (size == 0 || ios_view(ios, size) != NULL)
+        return true;
+    while (size > sizeof(buf))
+    {
+        if (!read_data(ios, buf, sizeof(buf)))
             return false;
-    return true;
+        size -= sizeof(buf);
+    }
+    return read_data(ios, buf, size);
 }
 
 static size_t pad_chunk_size(size_t chunk_size)
@@ -142,12 +146,14 @@ static bool read_header(IOStream *ios, Module *mod, size_t size)
     if (!read_int16(ios, &version))
         return false;
 
-    if ((version&0xff00) != 0x0100)
+    if ((version&0xff00) != 0x0100 || version > MODULE_VERSION)
     {
-        error("Invalid module file version: %d.%d (expected: 1.x)",
-              (version>>8)&0xff, version&0xff);
+        error("Invalid module file version: %d.%d (expected: 1.0 to %d.%d)",
+              (version>>8)&0xff, version&0xff,
+              (MODULE_VERSION>>8)&0xff, MODULE_VERSION&0xff);
         return false;
     }
+    mod->version = version;
 
     return
         read_int16(ios, NULL) && /* skip reserved data */
@@ -159,10 +165,13 @@ static bool read_header(IOStream *ios, Module *mod, size_t size)
         skip(ios, size - 20);
 }
 
-static bool read_strings( IOStream *ios, size_t size,
-                          int *nstring, char ***strings, void **string_data )
+/* Reads a table of zero-terminated strings. If the input is mapped into
+   memory, the strings point directly into the mapping. */
+static bool read_strings( IOStream *ios, Module *mod, size_t size,
+                          int *nstring, char ***strings )
 {
     int entries, e;
+    char *data;
 
     if (size < 4 || !read_int32(ios, &entries) || entries < 0)
         return false;
@@ -172,23 +181,29 @@ static bool read_strings( IOStream *ios, size_t size,
     {
         *nstring     = 0;
         *strings     = NULL;
-        *string_data = NULL;
-        return true;
+        return skip(ios, size);
     }
 
     *nstring     = entries;
-    *strings     = malloc(entries*sizeof(char*));
-    *string_data = malloc(size);
+    *strings     = AN_alloc(&mod->arena, entries*sizeof(char*));
+    if (*strings == NULL || size == 0)
+        return false;
 
     /* Read zero-terminated string data */
-    if (size == 0 || !read_data(ios, *string_data, size) ||
-        ((char*)*string_data)[size - 1] != '\0')
+    data = ios_view(ios, size);
+    if (data == NULL)
+    {
+        data = AN_alloc(&mod->arena, size);
+        if (data == NULL || !read_data(ios, data, size))
+            return false;
+    }
+    if (data[size - 1] != '\0')
         return false;
 
-    char *p = *string_data;
+    char *p = data;
     for (e = 0; e < entries; ++e)
     {
-        if ((size_t)(p - (char*)*string_data) > size)
+        if ((size_t)(p - data) >= size)
             return false;   /* no more string data */
         (*strings)[e] = p;
         p += strlen(p) + 1;
@@ -198,13 +213,57 @@ static bool read_strings( IOStream *ios, size_t size,
 
 static bool read_string_table(IOStream *ios, Module *mod, size_t size)
 {
-    return read_strings(ios, size, &mod->nstring, &mod->strings, &mod->string_data);
+    return read_strings(ios, mod, size, &mod->nstring, &mod->strings);
+}
+
+/* Returns a pointer to the next `size' bytes of input. If the input is mapped
+   into memory, this points directly into the mapping; otherwise, the data is
+   read into a buffer that is stored in `buf' and must be freed by the caller.
+   Returns NULL if the data could not be read. */
+static const unsigned char *get_data(IOStream *ios, size_t size, void **buf)
+{
+    const unsigned char *data = ios_view(ios, size);
+
+    *buf = NULL;
+    if (data == NULL)
+    {
+        *buf = malloc(size > 0 ? size : 1);
+        if (*buf == NULL || !read_data(ios, *buf, size))
+        {
+            free(*buf);
+            *buf = NULL;
+            return NULL;
+        }
+        data = *buf;
+    }
+    return data;
+}
+
+/* Decodes integers in network byte order (like read_int8() etc. in io.h).
+   Bytes are combined unsigned, then sign-extended without shifting negative
+   values (which is undefined behaviour). */
+static int get_int8(const unsigned char *p)
+{
+    return (signed char)p[0];
+}
+
+static int get_int24(const unsigned char *p)
+{
+    uint32_t u = ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+    return (int)(u ^ 0x800000) - 0x800000;
+}
+
+static int get_int32(const unsigned char *p)
+{
+    return (int32_t)( ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+                      ((uint32_t)p[2] << 8) | p[3] );
 }
 
 static bool read_function_table(IOStream *ios, Module *mod, size_t size)
 {
-    int entries, ninstr, n;
-    Instruction *instrs;
+    int entries, n;
+    const unsigned char *data;
+    void *buf;
 
     if (size < 4 || size%4 != 0 || !read_int32(ios, &entries) ||
         entries < 0 || (size - 4)/8 < (size_t)entries)
@@ -215,75 +274,203 @@ static bool read_function_table(IOStream *ios, Module *mod, size_t size)
     {
         mod->nfunction     = 0;
         mod->functions     = NULL;
-        mod->function_data = NULL;
-        return true;
+        return skip(ios, size);
     }
 
-    ninstr = (size - 4*entries)/4;
-    if (ninstr <= 0)
+    mod->ncode = (size - 4*entries)/4;
+    if (mod->ncode <= 0)
         return false;
-    instrs = malloc(ninstr*sizeof(Instruction));
 
     mod->nfunction     = entries;
-    mod->functions     = malloc(entries*sizeof(Function));
-    mod->function_data = (void*)instrs;
+    mod->functions     = AN_alloc(&mod->arena, entries*sizeof(Function));
+    if (mod->functions == NULL)
+        return false;
 
-    for (n = 0; n < entries; ++n)
+    /* Decode function headers (the first two bytes are reserved) */
+    data = get_data(ios, 4*entries, &buf);
+    if (data == NULL)
+        return false;
+    const unsigned char *p = data;
+    bool ok = true;
+    for (n = 0; n < entries; ++n, p += 4)
     {
-        int nret, nparam;
-
-        if (!read_int16(ios, NULL)) /* skip reserved bytes */
-            return false;
-
-        if (!read_int8(ios, &nret) || nret < 0)
-            return false;
-        if (!read_int8(ios, &nparam) || nparam < 0)
-            return false;
-
+        int nret = get_int8(p + 2), nparam = get_int8(p + 3);
+        if (nret < 0 || nparam < 0)
+            ok = false;
         mod->functions[n].id     = n;
-        mod->functions[n].ninstr = 0;  /* this is set to a real value below */
+        mod->functions[n].ninstr = 0;  /* set by locate_functions() */
         mod->functions[n].nparam = nparam;
         mod->functions[n].nret   = nret;
+        mod->functions[n].instrs = NULL;
+        mod->functions[n].code   = NULL;
+        mod->functions[n].state  = FUNC_PACKED;
     }
+    free(buf);
+    if (!ok)
+        return false;
 
-    /* Read instructions */
-    int start = 0, entry = 0;
-    for (n = 0; n < ninstr; ++n)
+    /* Instructions are packed into 4 bytes in the file, and are decoded on
+       demand (see decode_function()). The packed instructions are used in
+       place if the file is mapped into memory, or copied into the arena
+       otherwise. Space for the decoded instructions is allocated up front,
+       but since this is a large block, its pages are not committed until
+       the functions on them are decoded. */
+    mod->code = ios_view(ios, 4*mod->ncode);
+    if (mod->code == NULL)
     {
-        int opcode, argument;
-        if (!read_int8(ios, &opcode) || !read_int24(ios, &argument))
+        unsigned char *code = AN_alloc(&mod->arena, 4*mod->ncode);
+        if (code == NULL || !read_data(ios, code, 4*mod->ncode))
             return false;
-        instrs[n].opcode   = opcode;
-        instrs[n].argument = argument;
-        if (opcode == 0 && argument == 0)
+        mod->code = code;
+    }
+    mod->instrs = AN_alloc(&mod->arena, mod->ncode*sizeof(Instruction));
+    return mod->instrs != NULL;
+}
+
+/* Reads the (optional) function index generated by the compiler, which lists
+   the offset and length of the code of each function, so the code need not
+   be scanned for the end of each function. */
+static bool read_function_index(IOStream *ios, Module *mod, size_t size)
+{
+    int n, offset, length;
+    const unsigned char *data, *p;
+    void *buf;
+
+    if (mod->functions == NULL || mod->functions[0].code != NULL)
+        return false;  /* function table missing or index already read */
+
+    if (size/8 != (size_t)mod->nfunction || size%8 != 0)
+        return false;
+
+    data = get_data(ios, size, &buf);
+    if (data == NULL)
+        return false;
+
+    for (n = 0, p = data; n < mod->nfunction; ++n, p += 8)
+    {
+        offset = get_int32(p);
+        length = get_int32(p + 4);
+        if (offset < 0 || length < 0 || length > mod->ncode - offset)
+            break;
+        mod->functions[n].ninstr = length;
+        mod->functions[n].instrs = mod->instrs + offset;
+        mod->functions[n].code   = mod->code + 4*offset;
+    }
+
+    free(buf);
+    return n == mod->nfunction;
+}
+
+/* Finds the code of each function by scanning for the terminating (all zero)
+   instruction, if the module did not contain a function index. */
+static bool locate_functions(Module *mod)
+{
+    int n, start = 0, entry = 0;
+    const unsigned char *p = mod->code;
+
+    for (n = 0; n < mod->ncode; ++n, p += 4)
+    {
+        if (p[0] == 0 && p[1] == 0 && p[2] == 0 && p[3] == 0)
         {
-            if (entry >= entries)
+            if (entry >= mod->nfunction)
                 return false;
-            fflush(stdout);
             mod->functions[entry].ninstr = n - start;
-            mod->functions[entry].instrs = &instrs[start];
+            mod->functions[entry].instrs = mod->instrs + start;
+            mod->functions[entry].code   = mod->code + 4*start;
             entry += 1;
             start = n + 1;
         }
     }
-
-    return entry == entries;
+    return entry == mod->nfunction;
 }
 
 static bool read_word_table(IOStream *ios, Module *mod, size_t size)
 {
-    if (!read_strings(ios, size, &mod->nword, &mod->words, &mod->word_data))
+    return read_strings(ios, mod, size, &mod->nword, &mod->words);
+}
+
+/* Reads the (optional) perfect hash table generated by the compiler. */
+static bool read_word_index(IOStream *ios, Module *mod, size_t size)
+{
+    int nbucket, n, i;
+    const unsigned char *data;
+    void *buf;
+
+    if (mod->words == NULL || mod->word_index != NULL)
+        return false;  /* word table missing or word index already read */
+
+    if (size < 4 || !read_int32(ios, &nbucket) || nbucket < 1 ||
+        (size - 4)/4 != (size_t)nbucket + mod->nword)
         return false;
 
-    /* ensure all words are non-empty and in canonical form */
+    mod->word_disp_size  = nbucket;
+    mod->word_disp       = AN_alloc(&mod->arena, sizeof(unsigned)*nbucket);
+    mod->word_index_size = mod->nword;
+    mod->word_index      = AN_alloc(&mod->arena, sizeof(int)*mod->nword);
+    if (mod->word_disp == NULL || mod->word_index == NULL)
+        return false;
+
+    data = get_data(ios, size - 4, &buf);
+    if (data == NULL)
+        return false;
+
+    for (n = 0; n < nbucket; ++n, data += 4)
+        mod->word_disp[n] = (unsigned)get_int32(data);
+
+    for (n = 0; n < mod->nword; ++n, data += 4)
+    {
+        i = get_int32(data);
+        if (i < 0 || i >= mod->nword)
+            break;
+        mod->word_index[n] = i;
+    }
+
+    free(buf);
+    return n == mod->nword;
+}
+
+/* Ensures all words are non-empty and in canonical form. Words are normalized
+   in place, unless the module contains a precomputed word index, which
+   requires them to be canonical already. */
+static bool validate_word_table(Module *mod)
+{
+    char *buf = NULL, *p;
+    size_t len;
     int n;
+
     for (n = 0; n < mod->nword; ++n)
-        if (normalize(mod->words[n])[0] == '\0')
-            return false;
+    {
+        if (mod->word_disp == NULL)
+        {
+            if (normalize(mod->words[n])[0] == '\0')
+                break;
+            continue;
+        }
+        len = strlen(mod->words[n]);
+        p = realloc(buf, len + 1);
+        if (p == NULL)
+            break;
+        buf = p;
+        memcpy(buf, mod->words[n], len + 1);
+        if (len == 0 || strcmp(normalize(buf), mod->words[n]) != 0)
+            break;
+    }
+    free(buf);
+    return n == mod->nword;
+}
+
+/* Creates a hash-table index for the word table, if the module did not
+   contain a precomputed one. */
+static bool build_word_index(Module *mod)
+{
+    int n;
 
     /* create hash-table index */
     mod->word_index_size = 2*mod->nword + 1;  /* FIXME: possible overflow here */
-    mod->word_index      = malloc(sizeof(int)*mod->word_index_size);
+    mod->word_index      = AN_alloc( &mod->arena,
+                                     sizeof(int)*mod->word_index_size );
+    if (mod->word_index == NULL)
+        return false;
     size_t i;
     for (i = 0; i < mod->word_index_size; ++i)
         mod->word_index[i] = -1;
@@ -335,7 +522,7 @@ static bool read_grammar_table(IOStream *ios, Module *mod, size_t size)
                        sizeof(SymbolRefList*)*tot_rules +
                        sizeof(SymbolRefList)*tot_rules +
                        sizeof(SymbolRef)*tot_symrefs;
-    char *data = malloc(data_size);
+    char *data = AN_alloc(&mod->arena, data_size);
     if (data == NULL)
         return false;
 
@@ -358,7 +545,8 @@ static bool read_grammar_table(IOStream *ios, Module *mod, size_t size)
     for (n = 0; n < nnonterm; ++n)
     {
         int nrule;
-        if (!read_int32(ios, &nrule) || nrule < 0 || nrule > tot_rules)
+        if ( !read_int32(ios, &nrule) ||
+             nrule < 0 || nrule > tot_rules )
             return false;
         mod->symbol_rules[n].sym.type  = SYM_NONTERMINAL;
         mod->symbol_rules[n].sym.index = n;
@@ -370,7 +558,8 @@ static bool read_grammar_table(IOStream *ios, Module *mod, size_t size)
         for (r = 0; r < nrule; ++r)
         {
             int nref;
-            if (!read_int32(ios, &nref) || nref < 0 || nref > tot_symrefs)
+            if ( !read_int32(ios, &nref) ||
+                 nref < 0 || nref > tot_symrefs )
                 return false;
 
             mod->symbol_rules[n].rules[r]->nref = nref;
@@ -392,7 +581,7 @@ static bool read_grammar_table(IOStream *ios, Module *mod, size_t size)
     }
 
     /* Compute nullability */
-    mod->symbol_nullable = malloc(mod->nsymbol * sizeof(bool));
+    mod->symbol_nullable = AN_alloc(&mod->arena, mod->nsymbol * sizeof(bool));
     if (mod->symbol_nullable == NULL)
         return false;
 
@@ -426,158 +615,681 @@ static bool read_grammar_table(IOStream *ios, Module *mod, size_t size)
 
 static bool read_command_table(IOStream *ios, Module *mod, size_t size)
 {
-    int command_sets;
+    int command_sets, header_size = mod->version >= 0x0101 ? 8 : 4;
     if (size < 4 || !read_int32(ios, &command_sets) || command_sets < 1)
         return false;
     size -= 4;
 
-    if (size/4 < (size_t)command_sets)
-        return false;
+    /* Since version 1.2, the command sets are preceded by the slot symbol,
+       which has one rule per entity. */
+    mod->slots.symbol = -1;
+    if (mod->version >= 0x0102)
+    {
+        SymbolRef slot;
+        int i;
+        if (size < 4 || !read_int32(ios, &i))
+            return false;
+        size -= 4;
+        if (i != 0)
+        {
+            if (!parse_symref(mod, i, &slot) || slot.type != SYM_NONTERMINAL ||
+                (int)mod->symbol_rules[slot.index].nrule != mod->num_entities)
+                return false;
+            mod->slots.symbol = slot.index;
+        }
+    }
 
-    /* Parse only first command set for now: */
-    if (size < 4 || !read_int32(ios, &mod->ncommand))
-        return false;
-    size -= 4;
-    if (size/12 < (size_t)mod->ncommand)
+    if (size/header_size < (size_t)command_sets)
         return false;
 
-    mod->commands = malloc(mod->ncommand * sizeof(Command));
-    if (mod->commands == NULL)
+    mod->ncommandset  = command_sets;
+    mod->command_sets = AN_calloc(&mod->arena, command_sets*sizeof(CommandSet));
+    mod->commands     = AN_alloc(&mod->arena, (size/12 + 1)*sizeof(Command));
+    if (mod->command_sets == NULL || mod->commands == NULL)
         return false;
 
-    int n;
-    for (n = 0; n < mod->ncommand; ++n)
+    /* Each command set consists of a header followed by its commands */
+    int cs, n, total = 0;
+    for (cs = 0; cs < command_sets; ++cs)
     {
-        int i;
-        if (!read_int32(ios, &i) ||
-            !parse_symref(mod, i, &mod->commands[n].symbol) ||
-            !read_int32(ios, &mod->commands[n].guard) ||
-            !read_int32(ios, &mod->commands[n].function))
+        CommandSet *set = &mod->command_sets[cs];
+
+        if (size < (size_t)header_size || !read_int32(ios, &set->ncommand) ||
+            set->ncommand < 0)
             return false;
+        set->context = val_nil;
+        if (header_size > 4 && !read_int32(ios, &set->context))
+            return false;
+        size -= header_size;
+        if (size/12 < (size_t)set->ncommand)
+            return false;
+        size -= 12*set->ncommand;
+
+        const unsigned char *data;
+        void *buf;
+        data = get_data(ios, 12*set->ncommand, &buf);
+        if (data == NULL)
+            return false;
+        for (n = 0; n < set->ncommand; ++n, data += 12)
+        {
+            Command *command = &mod->commands[total++];
+            if (!parse_symref(mod, get_int32(data), &command->symbol))
+                break;
+            command->guard    = get_int32(data + 4);
+            command->function = get_int32(data + 8);
+        }
+        free(buf);
+        if (n < set->ncommand)
+            return false;
+    }
+    mod->ncommand = total;
+
+    for (cs = 0, total = 0; cs < command_sets; ++cs)
+    {
+        mod->command_sets[cs].commands = mod->commands + total;
+        total += mod->command_sets[cs].ncommand;
+    }
+
+    return size == 0;
+}
+
+/* Adds the indices of all words that can start (or end, if `last' is set) a
+   string derived from `sym' to `words' (once each). `sym_mark' and `word_mark'
+   record which symbols and words have been visited for the command with index
+   `mark'. */
+static void collect_first_words(Module *mod, const SymbolRef *sym, bool last,
+                                int mark, int *sym_mark, int *word_mark,
+                                Array *words)
+{
+    if (sym->type == SYM_TERMINAL)
+    {
+        if (word_mark[sym->index] != mark)
+        {
+            word_mark[sym->index] = mark;
+            AR_push(words, &sym->index);
+        }
+        return;
+    }
+
+    if (sym_mark[sym->index] == mark)
+        return;
+    sym_mark[sym->index] = mark;
+
+    const GrammarRuleSet *rules = &mod->symbol_rules[sym->index];
+    size_t r, s;
+    for (r = 0; r < rules->nrule; ++r)
+    {
+        const SymbolRefList *rule = rules->rules[r];
+        for (s = 0; s < rule->nref; ++s)
+        {
+            const SymbolRef *ref = &rule->refs[last ? rule->nref - 1 - s : s];
+            collect_first_words(mod, ref, last, mark,
+                                sym_mark, word_mark, words);
+            if (ref->type == SYM_TERMINAL || !mod->symbol_nullable[ref->index])
+                break;
+        }
+    }
+}
+
+static bool is_nullable(Module *mod, const SymbolRef *sym)
+{
+    return sym->type == SYM_NONTERMINAL && mod->symbol_nullable[sym->index];
+}
+
+/* Determines which symbols can derive the slot symbol, and indexes the rules
+   of the slot symbol (i.e. the entities) by the last word they can match. */
+static bool build_slot_index(Module *mod)
+{
+    CaptureIndex *slots = &mod->slots;
+    bool ok = true;
+    int *sym_mark  = malloc(sizeof(int)*(mod->nsymbol + 1));
+    int *word_mark = malloc(sizeof(int)*(mod->nword + 1));
+    Array words = AR_INIT(sizeof(int));
+    Array pairs = AR_INIT(2*sizeof(int));  /* (word, rule) */
+    int n, w;
+    size_t r, s, i;
+
+    slots->has_capture = malloc(sizeof(bool)*(mod->nsymbol + 1));
+    if (slots->has_capture == NULL || sym_mark == NULL || word_mark == NULL)
+    {
+        ok = false;
+        goto done;
+    }
+
+    /* NB: this relies on symbols only referring to symbols before them. */
+    for (n = 0; n < mod->nsymbol; ++n)
+    {
+        const GrammarRuleSet *rules = &mod->symbol_rules[n];
+        slots->has_capture[n] = (n == slots->symbol);
+        for (r = 0; r < rules->nrule && !slots->has_capture[n]; ++r)
+        {
+            for (s = 0; s < rules->rules[r]->nref; ++s)
+            {
+                const SymbolRef *ref = &rules->rules[r]->refs[s];
+                if (ref->type == SYM_NONTERMINAL &&
+                    slots->has_capture[ref->index])
+                {
+                    slots->has_capture[n] = true;
+                    break;
+                }
+            }
+        }
+    }
+
+    if (slots->symbol < 0)
+        goto done;
+
+    for (n = 0; n < mod->nsymbol; ++n)
+        sym_mark[n] = -1;
+    for (n = 0; n < mod->nword; ++n)
+        word_mark[n] = -1;
+
+    const GrammarRuleSet *rules = &mod->symbol_rules[slots->symbol];
+    slots->nnullable = 0;
+    for (r = 0; r < rules->nrule; ++r)
+    {
+        const SymbolRef *sym = &rules->rules[r]->refs[0];
+        if (rules->rules[r]->nref != 1)
+        {
+            ok = false;
+            goto done;
+        }
+        if (is_nullable(mod, sym))
+            ++slots->nnullable;
+
+        AR_clear(&words);
+        collect_first_words(mod, sym, true, (int)r, sym_mark, word_mark, &words);
+        for (i = 0; i < AR_size(&words); ++i)
+        {
+            int pair[2] = { *(int*)AR_at(&words, i), (int)r };
+            AR_push(&pairs, pair);
+        }
     }
+
+    slots->last_start     = calloc(mod->nword + 1, sizeof(int));
+    slots->last_rules     = malloc(sizeof(int)*(AR_size(&pairs) + 1));
+    slots->nullable_rules = malloc(sizeof(int)*(slots->nnullable + 1));
+    if (slots->last_start == NULL || slots->last_rules == NULL ||
+        slots->nullable_rules == NULL)
+    {
+        ok = false;
+        goto done;
+    }
+
+    /* Counting sort of (word, rule) pairs by word */
+    for (i = 0; i < AR_size(&pairs); ++i)
+        ++slots->last_start[((int*)AR_at(&pairs, i))[0] + 1];
+    for (w = 0; w < mod->nword; ++w)
+        slots->last_start[w + 1] += slots->last_start[w];
+    for (w = 0; w < mod->nword; ++w)
+        word_mark[w] = slots->last_start[w];
+    for (i = 0; i < AR_size(&pairs); ++i)
+    {
+        const int *pair = AR_at(&pairs, i);
+        slots->last_rules[word_mark[pair[0]]++] = pair[1];
+    }
+
+    slots->nnullable = 0;
+    for (r = 0; r < rules->nrule; ++r)
+        if (is_nullable(mod, &rules->rules[r]->refs[0]))
+            slots->nullable_rules[slots->nnullable++] = (int)r;
+
+done:
+    AR_destroy(&words);
+    AR_destroy(&pairs);
+    free(sym_mark);
+    free(word_mark);
+    return ok;
+}
+
+
+/* Creates the dispatch index of each command set, which lists for every word
+   the commands that can match a command starting with that word. Within each
+   list, commands occur in the same order as in the command table. */
+static bool build_command_index(Module *mod)
+{
+    bool ok = true;
+    int *sym_mark  = malloc(sizeof(int)*(mod->nsymbol + 1));
+    int *word_mark = malloc(sizeof(int)*(mod->nword + 1));
+    Array words = AR_INIT(sizeof(int));
+    Array pairs = AR_INIT(2*sizeof(int));  /* (word, command) */
+    int cs, n, w;
+
+    if (sym_mark == NULL || word_mark == NULL)
+    {
+        ok = false;
+        goto done;
+    }
+    for (n = 0; n < mod->nsymbol; ++n)
+        sym_mark[n] = -1;
+    for (n = 0; n < mod->nword; ++n)
+        word_mark[n] = -1;
+
+    for (cs = 0; cs < mod->ncommandset; ++cs)
+    {
+        CommandSet *set = &mod->command_sets[cs];
+
+        AR_clear(&pairs);
+        set->nnullable = 0;
+        for (n = 0; n < set->ncommand; ++n)
+        {
+            const SymbolRef *sym = &set->commands[n].symbol;
+            int mark = (int)(set->commands - mod->commands) + n;
+
+            if (is_nullable(mod, sym))
+                ++set->nnullable;
+
+            AR_clear(&words);
+            collect_first_words( mod, sym, false, mark,
+                                 sym_mark, word_mark, &words );
+            size_t i;
+            for (i = 0; i < AR_size(&words); ++i)
+            {
+                int pair[2] = { *(int*)AR_at(&words, i), n };
+                AR_push(&pairs, pair);
+            }
+        }
+
+        set->first_start       = calloc(mod->nword + 1, sizeof(int));
+        set->first_commands    = malloc(sizeof(int)*(AR_size(&pairs) + 1));
+        set->nullable_commands = malloc(sizeof(int)*(set->nnullable + 1));
+        if (set->first_start == NULL || set->first_commands == NULL ||
+            set->nullable_commands == NULL)
+        {
+            ok = false;
+            goto done;
+        }
+
+        /* Counting sort of (word, command) pairs by word; stable, so command
+           order is preserved within each word's list. */
+        size_t i;
+        for (i = 0; i < AR_size(&pairs); ++i)
+            ++set->first_start[((int*)AR_at(&pairs, i))[0] + 1];
+        for (w = 0; w < mod->nword; ++w)
+            set->first_start[w + 1] += set->first_start[w];
+        for (w = 0; w < mod->nword; ++w)
+            word_mark[w] = set->first_start[w];
+        for (i = 0; i < AR_size(&pairs); ++i)
+        {
+            const int *pair = AR_at(&pairs, i);
+            set->first_commands[word_mark[pair[0]]++] = pair[1];
+        }
+        for (w = 0; w < mod->nword; ++w)
+            word_mark[w] = -1;
+
+        set->nnullable = 0;
+        for (n = 0; n < set->ncommand; ++n)
+            if (is_nullable(mod, &set->commands[n].symbol))
+                set->nullable_commands[set->nnullable++] = n;
+    }
+
+done:
+    AR_destroy(&words);
+    AR_destroy(&pairs);
+    free(sym_mark);
+    free(word_mark);
+    return ok;
+}
+
+/* Functions may be decoded by a background thread (see decode_functions())
+   while the interpreter runs. Each function is decoded by the thread that
+   first claims it, by changing its state from FUNC_PACKED to FUNC_DECODING;
+   other threads wait until its state becomes FUNC_DECODED. */
+#ifdef WITH_THREADS
+struct FunctionDecoder
+{
+    pthread_t   thread;
+    int         cancel;         /* set to stop decoding */
+};
+
+static int get_state(const Function *f)
+{
+    return __atomic_load_n(&f->state, __ATOMIC_ACQUIRE);
+}
+
+static void set_state(Function *f, int state)
+{
+    __atomic_store_n(&f->state, state, __ATOMIC_RELEASE);
+}
+
+static bool claim_function(Function *f)
+{
+    int state = FUNC_PACKED;
+
+    /* Functions in images are decoded and read-only, so check first */
+    return get_state(f) == FUNC_PACKED &&
+           __atomic_compare_exchange_n( &f->state, &state, FUNC_DECODING,
+                                        false, __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED );
+}
+#else
+static int get_state(const Function *f)
+{
+    return f->state;
+}
+
+static void set_state(Function *f, int state)
+{
+    f->state = state;
+}
+
+static bool claim_function(Function *f)
+{
+    if (f->state != FUNC_PACKED)
+        return false;
+    f->state = FUNC_DECODING;
     return true;
 }
+#endif
+
+/* Decodes the instructions of a function, unless this has been done already.
+   If another thread is decoding the function, waits for it to finish. */
+static void decode_function(Function *f)
+{
+    const unsigned char *p;
+    int n;
+
+    if (claim_function(f))
+    {
+        for (n = 0, p = f->code; n < f->ninstr; ++n, p += 4)
+        {
+            f->instrs[n].opcode   = get_int8(p);
+            f->instrs[n].argument = get_int24(p + 1);
+        }
+        set_state(f, FUNC_DECODED);
+    }
+    else
+    {
+        while (get_state(f) != FUNC_DECODED)
+        {
+#ifdef WITH_THREADS
+            sched_yield();
+#endif
+        }
+    }
+}
+
+#ifdef WITH_THREADS
+static void *decoder_main(void *arg)
+{
+    Module *mod = arg;
+    int n;
+
+    for (n = 0; n < mod->nfunction; ++n)
+    {
+        if (__atomic_load_n(&mod->decoder->cancel, __ATOMIC_RELAXED))
+            break;
+        decode_function(&mod->functions[n]);
+    }
+    return NULL;
+}
+#endif
+
+void decode_functions(Module *mod, bool background)
+{
+    int n;
+
+#ifdef WITH_THREADS
+    if (background && mod->decoder == NULL)
+    {
+        mod->decoder = malloc(sizeof(struct FunctionDecoder));
+        if (mod->decoder != NULL)
+        {
+            mod->decoder->cancel = 0;
+            if (pthread_create( &mod->decoder->thread, NULL,
+                                decoder_main, mod ) == 0)
+                return;
+            free(mod->decoder);
+            mod->decoder = NULL;
+        }
+    }
+#else
+    (void)background;
+#endif
+
+    /* Decode on the calling thread */
+    for (n = 0; n < mod->nfunction; ++n)
+        decode_function(&mod->functions[n]);
+}
+
+/* Stops the background decoder (if any). Functions that were not decoded
+   yet remain packed. */
+static void stop_decoder(Module *mod)
+{
+#ifdef WITH_THREADS
+    if (mod->decoder != NULL)
+    {
+        __atomic_store_n(&mod->decoder->cancel, 1, __ATOMIC_RELAXED);
+        pthread_join(mod->decoder->thread, NULL);
+        free(mod->decoder);
+        mod->decoder = NULL;
+    }
+#else
+    (void)mod;
+#endif
+}
 
 void free_module(Module *mod)
 {
-    /* Free string table */
-    free(mod->strings);
-    mod->strings = NULL;
-    free(mod->string_data);
-    mod->string_data = NULL;
+    /* The background decoder uses the function table */
+    stop_decoder(mod);
 
-    /* Function table */
-    free(mod->functions);
+    /* Tables are freed with the arena and module image below */
+    mod->strings = NULL;
     mod->functions = NULL;
-    free(mod->function_data);
-    mod->function_data = NULL;
-
-    /* Free word table */
-    free(mod->words);
+    mod->code = NULL;
+    mod->instrs = NULL;
     mod->words = NULL;
-    free(mod->word_data);
-    mod->word_data = NULL;
-    free(mod->word_index);
     mod->word_index = NULL;
-
-    /* Free grammar table */
-    free(mod->symbol_rules);
+    mod->word_disp = NULL;
     mod->symbol_rules = NULL;
-    free(mod->symbol_nullable);
     mod->symbol_nullable = NULL;
-
-    /* Free command table */
-    free(mod->commands);
     mod->commands = NULL;
+    if (mod->from_image)
+    {
+        /* Indices are part of the image too */
+        mod->word_trie = NULL;
+        memset(&mod->slots, 0, sizeof(mod->slots));
+        mod->command_sets = NULL;
+    }
+
+    /* Free word index */
+    if (mod->word_trie != NULL)
+    {
+        WT_destroy(mod->word_trie);
+        free(mod->word_trie);
+        mod->word_trie = NULL;
+    }
+
+    /* Free grammar indices */
+    free(mod->slots.has_capture);
+    mod->slots.has_capture = NULL;
+    free(mod->slots.last_start);
+    mod->slots.last_start = NULL;
+    free(mod->slots.last_rules);
+    mod->slots.last_rules = NULL;
+    free(mod->slots.nullable_rules);
+    mod->slots.nullable_rules = NULL;
+
+    /* Free command indices */
+    if (mod->command_sets != NULL)
+    {
+        int n;
+        for (n = 0; n < mod->ncommandset; ++n)
+        {
+            free(mod->command_sets[n].first_start);
+            free(mod->command_sets[n].first_commands);
+            free(mod->command_sets[n].nullable_commands);
+        }
+        mod->command_sets = NULL;
+    }
+
+    /* Free module data */
+    AN_destroy(&mod->arena);
+    if (mod->image != NULL)
+    {
+        ios_unmap(mod->image, mod->image_size);
+        mod->image = NULL;
+    }
+}
+
+/* Module chunk types. Mandatory chunks must occur in the order listed here;
+   optional chunks may occur anywhere after the module header. */
+static const struct ChunkType
+{
+    char        id[5];
+    bool        mandatory;
+    bool        (*read)(IOStream *ios, Module *mod, size_t size);
+    const char  *description;
+} chunk_types[] = {
+    { "MOD ", true,  read_header,           "header" },
+    { "STR ", true,  read_string_table,     "string table" },
+    { "FUN ", true,  read_function_table,   "function table" },
+    { "WRD ", true,  read_word_table,       "word table" },
+    { "GRM ", true,  read_grammar_table,    "grammar table" },
+    { "CMD ", true,  read_command_table,    "command table" },
+    { "FIX ", false, read_function_index,   "function index" },
+    { "WIX ", false, read_word_index,       "word index" },
+    { "",     false, NULL,                  NULL } };
+
+/* Checksum of a module chunk (see read_checksums()) */
+typedef struct ChunkChecksum
+{
+    char        id[4];
+    uint32_t    crc;
+} ChunkChecksum;
+
+/* Reads the CRC chunk, which lists the checksum of each preceding chunk, and
+   compares it to the checksums computed while reading those chunks. */
+static bool read_checksums(IOStream *ios, size_t size, const Array *checksums)
+{
+    const unsigned char *data;
+    void *buf;
+    size_t n;
+
+    if (size != 8*AR_size(checksums))
+        return false;
+    data = get_data(ios, size, &buf);
+    if (data == NULL)
+        return false;
+    for (n = 0; n < AR_size(checksums); ++n, data += 8)
+    {
+        const ChunkChecksum *cc = AR_at(checksums, n);
+        if (memcmp(data, cc->id, 4) != 0)
+            break;
+        if ((uint32_t)get_int32(data + 4) != cc->crc)
+        {
+            error("Checksum mismatch in %.4s chunk.", cc->id);
+            break;
+        }
+    }
+    free(buf);
+    return n == AR_size(checksums);
 }
 
 Module *load_module(IOStream *ios)
 {
+    Array checksums = AR_INIT(sizeof(ChunkChecksum));
+    bool checked = false;   /* CRC chunk read? */
     Module *mod = malloc(sizeof(Module));
     if (mod == NULL)
         return NULL;
     memset(mod, 0, sizeof(Module));
 
-    const char *chunk_types[7] = {
-        "FORM", "MOD ", "STR ", "FUN ", "WRD ", "GRM ", "CMD " };
+    char chunk_type[4];
+    size_t chunk_size, form_size;
 
-    int chunk;
-    for (chunk = 0; chunk < 7; ++chunk)
+    /* Read IFF header */
+    if (!begin_chunk(ios, chunk_type, &form_size))
     {
-        char chunk_type[4];
-        size_t chunk_size;
-
-        if (!begin_chunk(ios, chunk_type, &chunk_size))
+        error("Unable to read chunk header.");
+        goto failed;
+    }
+    if (memcmp(chunk_type, "FORM", 4) != 0)
+    {
+        error("Expected FORM chunk!");
+        goto failed;
+    }
+    {
+        char id[4];
+        if (form_size < 4 || !read_data(ios, id, 4) ||
+            memcmp(id, "ALI ", 4) != 0)
         {
-            error("Unable to read chunk header.");
+            error("Unsupported FORM type (%.4s); expected ALI.", id);
             goto failed;
         }
+        form_size -= 4;
+    }
 
-        if (memcmp(chunk_type, chunk_types[chunk], 4) != 0)
+    /* Read module chunks */
+    const struct ChunkType *next = &chunk_types[0];
+    while (form_size > 0)
+    {
+        if (form_size < 8 || !begin_chunk(ios, chunk_type, &chunk_size) ||
+            pad_chunk_size(chunk_size) > form_size - 8)
         {
-            error("Expected %.4s chunk!", chunk_types[chunk]);
+            error("Unable to read chunk header.");
             goto failed;
         }
+        form_size -= 8 + pad_chunk_size(chunk_size);
 
-        switch (chunk)
+        if (checked)
         {
-        case 0: /* FORM */
-            {
-                char id[4];
-                if (!read_data(ios, id, 4) || memcmp(id, "ALI ", 4) != 0)
-                {
-                    error("Unsupported FORM type (%.4s); expected ALI.", id);
-                    goto failed;
-                }
-            } break;
-
-        case 1: /* MOD  */
-            if (!read_header(ios, mod, chunk_size))
-            {
-                error("Failed to load module header.");
-                goto failed;
-            }
-            break;
-
-        case 2: /* STR  */
-            if (!read_string_table(ios, mod, chunk_size))
-            {
-                error("Failed to read module string table.");
-                goto failed;
-            }
-            break;
+            error("Unexpected %.4s chunk after checksums!", chunk_type);
+            goto failed;
+        }
+        ios_begin_checksum(ios);
 
-        case 3: /* FUN  */
-            if (!read_function_table(ios, mod, chunk_size))
-            {
-                error("Failed to read module function table.");
-                goto failed;
-            }
-            break;
+        const struct ChunkType *type = chunk_types;
+        while (type->read != NULL && memcmp(chunk_type, type->id, 4) != 0)
+            ++type;
 
-        case 4: /* WRD  */
-            if (!read_word_table(ios, mod, chunk_size))
-            {
-                error("Failed to read module word table.");
-                goto failed;
-            }
-            break;
+        if (type->mandatory ? type != next : next == &chunk_types[0])
+        {
+            if (next->mandatory)
+                error("Expected %.4s chunk!", next->id);
+            else
+                error("Unexpected %.4s chunk!", chunk_type);
+            goto failed;
+        }
 
-        case 5: /* GRM  */
-            if (!read_grammar_table(ios, mod, chunk_size))
+        if (memcmp(chunk_type, "CRC ", 4) == 0)
+        {
+            /* Chunk checksums; these must follow all other chunks */
+            ios_end_checksum(ios);
+            if (!read_checksums(ios, chunk_size, &checksums))
             {
-                error("Failed to read module grammar table.");
+                error("Failed to verify module checksums.");
                 goto failed;
             }
-            break;
-
-        case 6: /* CMD  */
-            if (!read_command_table(ios, mod, chunk_size))
+            checked = true;
+        }
+        else
+        if (type->read == NULL)
+        {
+            /* Skip unknown optional chunk */
+            if (!skip(ios, chunk_size))
             {
-                error("Failed to read module command table.");
+                error("Unable to read %.4s chunk.", chunk_type);
                 goto failed;
             }
-            break;
+        }
+        else
+        if (!type->read(ios, mod, chunk_size))
+        {
+            error("Failed to read module %s.", type->description);
+            goto failed;
+        }
+
+        if (type->mandatory)
+            ++next;
+
+        if (!checked)
+        {
+            ChunkChecksum cc;
+            memcpy(cc.id, chunk_type, 4);
+            cc.crc = ios_end_checksum(ios);
+            AR_push(&checksums, &cc);
         }
 
         if (!end_chunk(ios, chunk_size))
@@ -587,30 +1299,106 @@ Module *load_module(IOStream *ios)
         }
     }
 
+    if (next->mandatory)
+    {
+        error("Expected %.4s chunk!", next->id);
+        goto failed;
+    }
+
+    /* Create indices not provided by the module */
+    if (mod->nfunction > 0 && mod->functions[0].code == NULL &&
+        !locate_functions(mod))
+    {
+        error("Failed to read module function table.");
+        goto failed;
+    }
+    if ( !validate_word_table(mod) ||
+         (mod->word_index == NULL && !build_word_index(mod)) )
+    {
+        error("Failed to read module word table.");
+        goto failed;
+    }
+    if (!build_slot_index(mod) || !build_command_index(mod))
+    {
+        error("Failed to index module command table.");
+        goto failed;
+    }
+    mod->word_trie = malloc(sizeof(WordTrie));
+    if (mod->word_trie == NULL ||
+        !WT_create(mod->word_trie, (const char * const *)mod->words, mod->nword))
+    {
+        free(mod->word_trie);
+        mod->word_trie = NULL;
+        error("Failed to index module word table.");
+        goto failed;
+    }
+
+    /* Keep the mapped file, since the string and word tables refer to it */
+    ios_detach_map(ios, &mod->image, &mod->image_size);
+
+    AR_destroy(&checksums);
     return mod;
 
 failed:
+    AR_destroy(&checksums);
     free_module(mod);
     return NULL;
 }
 
+/* Returns the size of the memory block holding a set of variables: the
+   Variables structure, dirty list and bitmap, followed by their values (if
+   `with_vals' is set). */
+static size_t vars_size(int nval, bool with_vals)
+{
+    size_t size = sizeof(Variables) + nval*sizeof(int) + (nval + 7)/8;
+
+    size = (size + sizeof(Value) - 1)/sizeof(Value)*sizeof(Value);
+    return with_vals ? size + nval*sizeof(Value) : size;
+}
+
+/* Sets the pointers of a set of variables into its memory block. If `vals'
+   is NULL, the values are stored in the block too. */
+static void init_vars(Variables *vars, int nval, Value *vals)
+{
+    vars->nval      = nval;
+    vars->dirty     = (void*)((char*)vars + sizeof(Variables));
+    vars->dirty_map = (void*)(vars->dirty + nval);
+    vars->vals      = vals != NULL ? vals :
+                      (void*)((char*)vars + vars_size(nval, false));
+    vars->log       = NULL;
+}
+
 Variables *alloc_vars(Module *mod)
 {
     int nval = mod->num_entities*mod->num_properties + mod->num_globals;
 
     /* Allocate memory for variables */
-    Variables *vars = malloc(sizeof(Variables) + nval*sizeof(Value));
+    Variables *vars = malloc(vars_size(nval, true));
     if (vars == NULL)
         return NULL;
 
     /* Initialize */
-    vars->nval = nval;
-    vars->vals = (void*)((char*)vars + sizeof(Variables));
+    init_vars(vars, nval, NULL);
     clear_vars(vars);
 
     return vars;
 }
 
+Variables *alloc_vars_at(Module *mod, Value *vals)
+{
+    int nval = mod->num_entities*mod->num_properties + mod->num_globals;
+
+    Variables *vars = malloc(vars_size(nval, false));
+    if (vars == NULL)
+        return NULL;
+
+    init_vars(vars, nval, vals);
+    vars->ndirty = 0;
+    memset(vars->dirty_map, 0, (nval + 7)/8);
+
+    return vars;
+}
+
 void free_vars(Variables *vars)
 {
     free(vars);
@@ -620,19 +1408,63 @@ void clear_vars(Variables *vars)
 {
     int n;
     for (n = 0; n < vars->nval; ++n)
-        vars->vals[n] = val_nil;
+    {
+        if (vars->log != NULL && vars->vals[n] != val_nil)
+        {
+            VarWrite write = { n, vars->vals[n] };
+            AR_push(vars->log, &write);
+        }
+        vars->vals[n]  = val_nil;
+        vars->dirty[n] = n;
+    }
+    vars->ndirty = vars->nval;
+    memset(vars->dirty_map, 0xff, (vars->nval + 7)/8);
 }
 
 Variables *dup_vars(Variables *vars)
 {
-    Variables *new_vars = malloc(sizeof(Variables) + vars->nval*sizeof(Value));
+    Variables *new_vars = malloc(vars_size(vars->nval, true));
     if (new_vars == NULL)
         return NULL;
 
-    memcpy(new_vars, vars, sizeof(Variables) + vars->nval*sizeof(Value));
+    memcpy(new_vars, vars, vars_size(vars->nval, false));
+    init_vars(new_vars, vars->nval, NULL);
+    memcpy(new_vars->vals, vars->vals, vars->nval*sizeof(Value));
     return new_vars;
 }
 
+void set_var(Variables *vars, int index, Value val)
+{
+    unsigned char bit = 1 << (index&7);
+
+    if (vars->log != NULL)
+    {
+        VarWrite write = { index, vars->vals[index] };
+        AR_push(vars->log, &write);
+    }
+    if (!(vars->dirty_map[index >> 3] & bit))
+    {
+        vars->dirty_map[index >> 3] |= bit;
+        vars->dirty[vars->ndirty++] = index;
+    }
+    vars->vals[index] = val;
+}
+
+void clear_dirty_vars(Variables *vars)
+{
+    int n;
+
+    /* Only clear the bytes of the bitmap that may be set */
+    if (vars->ndirty > vars->nval/8)
+        memset(vars->dirty_map, 0, (vars->nval + 7)/8);
+    else
+    {
+        for (n = 0; n < vars->ndirty; ++n)
+            vars->dirty_map[vars->dirty[n] >> 3] = 0;
+    }
+    vars->ndirty = 0;
+}
+
 int cmp_vars(Variables *vars1, Variables *vars2)
 {
     assert(vars1->nval == vars2->nval);
@@ -707,7 +1539,8 @@ static Value exec_function(Interpreter *I, const Function *f, int stack_base)
         case OP_STG:
             if (argument < 0 || argument >= I->vars->nval)
                 goto invalid;
-            AR_pop(I->stack, &I->vars->vals[argument]);
+            AR_pop(I->stack, &val);
+            set_var(I->vars, argument, val);
             break;
 
         case OP_LDI:
@@ -736,7 +1569,7 @@ static Value exec_function(Interpreter *I, const Function *f, int stack_base)
                       + argument;
                 if (index < 0 || index >= I->vars->nval)
                     goto invalid;
-                I->vars->vals[index] = v[1];
+                set_var(I->vars, index, v[1]);
                 AR_resize(I->stack, AR_size(I->stack) - 2);
             } break;
 
@@ -830,7 +1663,7 @@ static Value exec_function(Interpreter *I, const Function *f, int stack_base)
 invalid:
     fatal("Instruction %d (opcode %d, argument: %d) could not be executed.\n"
           "Stack frame size was %d (%d - %d).",
-        i - (Instruction*)I->mod->function_data - 1,
+        (int)(i - I->mod->instrs - 1),
         (i - 1)->opcode, (i - 1)->argument,
         AR_size(I->stack) - stack_base, AR_size(I->stack), stack_base);
     return val_nil;
@@ -862,7 +1695,7 @@ static void invoke(Interpreter *I, int nargs, int nret)
     if (func_id < 0)
     {
         func_id = -func_id - 1;
-        if (func_id > NUM_BUILTIN_FUNCS)
+        if (func_id >= NUM_BUILTIN_FUNCS)
             fatal("Invalid system call (%d).", func_id);
         result = builtins[func_id](I, nargs,
             (Value*)AR_data(I->stack) + AR_size(I->stack) - nargs);
@@ -875,7 +1708,10 @@ static void invoke(Interpreter *I, int nargs, int nret)
     }
     else
     {
-        const Function *f = &I->mod->functions[func_id];
+        Function *f = &I->mod->functions[func_id];
+
+        if (get_state(f) != FUNC_DECODED)
+            decode_function(f);
 
         /* Check number of arguments and adjust stack frame if necessary */
         if (nargs != f->nparam)
@@ -1058,23 +1894,88 @@ static Value builtin_reset(Interpreter *I, int narg, Value *args)
     return val_nil;
 }
 
-static bool evaluate_function(Interpreter *I, int func)
+static Value builtin_set_context(Interpreter *I, int narg, Value *args)
+{
+    if (narg != 1)
+    {
+        error("set_context() expects exactly one argument");
+        return val_nil;
+    }
+    set_var(I->vars, var_context, args[0]);
+    return val_nil;
+}
+
+static bool evaluate_function( Interpreter *I, int func,
+                               const Value *args, int narg )
 {
     if (func < 0 || func >= I->mod->nfunction)
         return false;
 
     Value val;
+    int n;
     push_stack(I->stack, (Value)func);
-    invoke(I, 1, 1);
+    for (n = 0; n < narg; ++n)
+        push_stack(I->stack, args[n]);
+    invoke(I, 1 + narg, 1);
     AR_pop(I->stack, &val);
     return VAL_TO_BOOL(val);
 }
 
-/* Match the first word of the given line, and return an index into the word
-   table if found, or -1 if not found. */
-static int match_word(Module *mod, const char *line)
+/* A command that matched the player's input, with its guard's cost and the
+   entities matched by its slots (if any). */
+typedef struct MatchedCommand
+{
+    int index, guard, cost;
+    int nslot;
+    Value slots[MAX_COMMAND_SLOTS];
+} MatchedCommand;
+
+/* Compares the entities matched by two commands. */
+static int matched_slots_cmp(const MatchedCommand *p, const MatchedCommand *q)
+{
+    int n;
+    if (p->nslot != q->nslot)
+        return p->nslot - q->nslot;
+    for (n = 0; n < p->nslot; ++n)
+        if (p->slots[n] != q->slots[n])
+            return p->slots[n] - q->slots[n];
+    return 0;
+}
+
+/* Estimates the cost of evaluating a guard by its number of instructions. */
+static int guard_cost(const Module *mod, int guard)
+{
+    if (guard < 0 || guard >= mod->nfunction)
+        return 0;
+    return mod->functions[guard].ninstr;
+}
+
+/* Orders matched commands by guard cost, then guard, then matched entities,
+   then command index. */
+static int matched_command_cmp(const void *a, const void *b)
 {
-    size_t i = hash_word(line)%mod->word_index_size;
+    const MatchedCommand *p = a, *q = b;
+    int d;
+    if (p->cost  != q->cost)  return p->cost  - q->cost;
+    if (p->guard != q->guard) return p->guard - q->guard;
+    if ((d = matched_slots_cmp(p, q)) != 0) return d;
+    return p->index - q->index;
+}
+
+/* Match the first word of the given line, with hash value `h' (as computed by
+   hash_word()), and return an index into the word table if found, or -1 if not
+   found. */
+static int match_word(const Module *mod, const char *line, unsigned h)
+{
+    if (mod->word_disp != NULL)
+    {
+        /* Perfect hash table: the word can only occur in a single slot. */
+        unsigned d = mod->word_disp[h%mod->word_disp_size];
+        int w = mod->word_index[hash_displace(h, d)%mod->word_index_size];
+        return eq_word(line, mod->words[w]) ? w : -1;
+    }
+
+    size_t i = h%mod->word_index_size;
     while (mod->word_index[i] >= 0)
     {
         if (eq_word(line, mod->words[mod->word_index[i]]))
@@ -1085,69 +1986,510 @@ static int match_word(Module *mod, const char *line)
     return -1;
 }
 
-void process_command(Interpreter *I, char *line)
+int suggest_words( const Module *mod, const char *word, size_t len,
+                   WTMatch *matches, int max_matches )
 {
-    AR_clear(I->output);
+    /* Short words are close to too many other words to make useful
+       suggestions, so the maximum distance depends on the word length. */
+    int max_dist = len >= 4 ? 2 : len >= 2 ? 1 : 0, dist, found = 0;
+
+    if (mod->word_trie == NULL)
+        return 0;
+
+    /* Searching at a larger distance is much more expensive, so only do it
+       when there are no closer words. */
+    for (dist = 1; dist <= max_dist && found == 0; ++dist)
+        found = WT_fuzzy(mod->word_trie, word, len, dist, matches, max_matches);
+
+    return found < max_matches ? found : max_matches;
+}
+
+/* Handles a word that does not occur in the word table. If it is a likely typo
+   of a single known word, the player is told and that word's index is
+   returned. Otherwise, the unknown word is reported along with suggestions,
+   and -1 is returned. */
+static int correct_word(Interpreter *I, const char *word)
+{
+    WTMatch matches[MAX_SUGGESTIONS];
+    size_t len = 0;
+    int n, nmatch;
+
+    while (word[len] != '\0' && word[len] != ' ')
+        ++len;
+    nmatch = suggest_words(I->mod, word, len, matches, MAX_SUGGESTIONS);
+
+    if (len >= 3 && nmatch > 0 && matches[0].dist == 1 &&
+        (nmatch == 1 || matches[1].dist > 1))
+    {
+        write_str(I, "(assuming ");
+        write_str(I, I->mod->words[matches[0].word]);
+        write_str(I, ")\n");
+        return matches[0].word;
+    }
+
+    write_str(I, "Unknown word: ");
+    write_buf(I, word, word + len);
+    for (n = 0; n < nmatch; ++n)
+    {
+        write_str(I, n == 0 ? " (did you mean " :
+                     n == nmatch - 1 ? " or " : ", ");
+        write_str(I, I->mod->words[matches[n].word]);
+    }
+    if (nmatch > 0)
+        write_str(I, "?)");
+    return -1;
+}
+
+/* Converts a command line into a list of indices into the word table, after
+   normalizing it in place. Messages for the player are written to I's output.
+   Returns false if the command cannot be processed any further. */
+static bool lookup_words(Interpreter *I, char *line, int *words, int *nword)
+{
+    WordRef refs[MAX_COMMAND_WORDS];
+    size_t nref = tokenize(line, refs, MAX_COMMAND_WORDS);
+
+    for (*nword = 0; *nword < (int)nref && *nword < MAX_COMMAND_WORDS; ++*nword)
+    {
+        int i = match_word(I->mod, refs[*nword].text, refs[*nword].hash);
+        if (i < 0 && (i = correct_word(I, refs[*nword].text)) < 0)
+            return false;
+        words[*nword] = i;
+    }
+    if (nref > MAX_COMMAND_WORDS)
+    {
+        write_str(I, "Too many words in command!\n");
+        return false;
+    }
+    return true;
+}
 
-    /* Tokenize command string, into a list of indices into the word table. */
-    int words[MAX_COMMAND_WORDS], nword = 0;
-    const char *pos;
-    for (pos = line; *pos != '\0'; )
+/* Checks a pre-tokenized command; see lookup_words(). */
+static bool check_words(Interpreter *I, const int *words, int nword)
+{
+    int n;
+    if (nword > MAX_COMMAND_WORDS)
+    {
+        write_str(I, "Too many words in command!\n");
+        return false;
+    }
+    for (n = 0; n < nword; ++n)
     {
-        if (nword == MAX_COMMAND_WORDS)
+        if (words[n] < 0 || words[n] >= I->mod->nword)
         {
-            write_str(I, "Too many words in command!\n");
+            error("Invalid word index %d in command.", words[n]);
+            return false;
+        }
+    }
+    return true;
+}
+
+const CommandSet *active_command_set(const Interpreter *I)
+{
+    int n;
+    for (n = 0; n < I->mod->ncommandset; ++n)
+        if (I->mod->command_sets[n].context == I->vars->vals[var_context])
+            return &I->mod->command_sets[n];
+    return &I->mod->command_sets[0];
+}
+
+/* List of matched commands under construction (see match_commands()). */
+typedef struct MatchList
+{
+    MatchedCommand  *matched;
+    int             num_matched, capacity;
+    int             index, guard, cost;     /* command being matched */
+} MatchList;
+
+static void add_match(MatchList *list, const int *slots, int nslot)
+{
+    MatchedCommand m;
+    int n;
+
+    m.index = list->index;
+    m.guard = list->guard;
+    m.cost  = list->cost;
+    m.nslot = nslot;
+    for (n = 0; n < nslot; ++n)
+        m.slots[n] = slots[n];
+
+    /* Ambiguous grammars may yield the same entities more than once */
+    for (n = list->num_matched - 1; n >= 0; --n)
+    {
+        if (list->matched[n].index != m.index)
+            break;
+        if (matched_slots_cmp(&list->matched[n], &m) == 0)
             return;
+    }
+
+    if (list->num_matched == list->capacity)
+    {
+        list->capacity = 2*list->capacity + 1;
+        list->matched  = realloc( list->matched,
+                                  sizeof(MatchedCommand)*list->capacity );
+        if (list->matched == NULL)
+            fatal("Out of memory.");
+    }
+    list->matched[list->num_matched++] = m;
+}
+
+/* Receives the rules of the slot symbol used to parse a command; the rule
+   index is the entity index. */
+static void add_captured_match(void *arg, const int *captures, int ncapture)
+{
+    add_match(arg, captures, ncapture);
+}
+
+/* Finds the commands in `set' that match the given words, and returns them in
+   the order in which their guards should be evaluated (see execute_command()).
+   A command with slots is returned once for each combination of entities that
+   its slots can match. The result is allocated with malloc() and must be freed
+   by the caller. */
+static MatchedCommand *match_commands( const Module *mod, const CommandSet *set,
+                                       const int *words, int nword,
+                                       int *num_matched )
+{
+    /* Only commands that can start with the first word are candidates. */
+    const int *candidates;
+    int ncandidate, n;
+    if (nword == 0)
+    {
+        candidates = set->nullable_commands;
+        ncandidate = set->nnullable;
+    }
+    else
+    {
+        candidates = set->first_commands + set->first_start[words[0]];
+        ncandidate = set->first_start[words[0] + 1] - set->first_start[words[0]];
+    }
+
+    MatchList list;
+    list.capacity    = ncandidate + 1;
+    list.num_matched = 0;
+    list.matched     = malloc(sizeof(MatchedCommand)*list.capacity);
+    if (list.matched == NULL)
+        fatal("Out of memory.");
+    for (n = 0; n < ncandidate; ++n)
+    {
+        const Command *command = &set->commands[candidates[n]];
+        list.index = candidates[n];
+        list.guard = command->guard;
+        list.cost  = guard_cost(mod, command->guard);
+        if ( command->symbol.type == SYM_NONTERMINAL &&
+             mod->slots.has_capture[command->symbol.index] )
+        {
+            int captures[MAX_COMMAND_SLOTS];
+            parse_captures( mod->symbol_rules, &mod->slots, words, nword,
+                            &command->symbol, captures, MAX_COMMAND_SLOTS,
+                            &add_captured_match, &list );
         }
-        int i = match_word(I->mod, pos);
-        if (i < 0)
+        else
+        if (parse_dumb(mod->symbol_rules, words, nword, &command->symbol))
         {
-            write_str(I, "Unknown word: ");
-            while (*pos != '\0' && *pos != ' ')
-                write_ch(I, *pos++);
-            return;
+            add_match(&list, NULL, 0);
         }
-        while (*pos != ' ' && *pos != '\0') ++pos;
-        if (*pos != '\0') ++pos;
-        words[nword++] = i;
     }
 
-    /* Find matching commands. */
-    const GrammarRuleSet *grammar = I->mod->symbol_rules;
-    int num_matched = 0, num_active = 0, cmd_func = -1, n;
-    for (n = 0; n < I->mod->ncommand; ++n)
+    /* Commands sharing a guard (and entities) are adjacent after sorting, so
+       each guard needs to be evaluated only once. */
+    qsort(list.matched, list.num_matched, sizeof(MatchedCommand),
+          &matched_command_cmp);
+    *num_matched = list.num_matched;
+    return list.matched;
+}
+
+bool evaluate_guard(Interpreter *I, int guard, const Value *args, int narg)
+{
+    return guard < 0 || evaluate_function(I, guard, args, narg);
+}
+
+/* Evaluates the guards of the matched commands, and invokes the command that
+   is active, if there is exactly one. Returns whether a command was invoked. */
+static bool execute_command( Interpreter *I, const CommandSet *set,
+                             const MatchedCommand *matched, int num_matched )
+{
+    /* Evaluate guards, cheapest first, until the outcome is known. Since
+       guards are expressions, which have no side effects, the order does not
+       affect the result. */
+    const MatchedCommand *active = NULL, *last = NULL;
+    int num_active = 0, n;
+    bool last_active = true;
+    for (n = 0; n < num_matched && num_active < 2; ++n)
     {
-        const Command *command = &I->mod->commands[n];
-        if (parse_dumb(grammar, words, nword, &command->symbol))
+        const MatchedCommand *m = &matched[n];
+        if ( m->guard >= 0 && ( last == NULL || m->guard != last->guard ||
+                                matched_slots_cmp(m, last) != 0 ) )
         {
-            ++num_matched;
-            if (command->guard < 0 || evaluate_function(I, command->guard))
-            {
-                if (++num_active == 1)
-                    cmd_func = command->function;
-            }
+            last        = m;
+            last_active = evaluate_function(I, m->guard, m->slots, m->nslot);
+        }
+        if (m->guard < 0 || last_active)
+        {
+            if (++num_active == 1)
+                active = m;
         }
     }
 
     if (num_matched == 0)
     {
         write_str(I, "You can't do that in this game.\n");
-        return;
+        return false;
     }
 
     if (num_active == 0)
     {
         write_str(I, "That's not possible right now.\n");
-        return;
+        return false;
     }
 
     if (num_active > 1)
     {
         write_str(I, "That command is ambiguous.\n");
-        return;
+        return false;
+    }
+
+    /* Invoke the command function, passing the matched entities */
+    push_stack(I->stack, (Value)set->commands[active->index].function);
+    for (n = 0; n < active->nslot; ++n)
+        push_stack(I->stack, active->slots[n]);
+    invoke(I, 1 + active->nslot, 0);
+    return true;
+}
+
+static bool process_words(Interpreter *I, const int *words, int nword)
+{
+    const CommandSet *set = active_command_set(I);
+    int num_matched;
+    MatchedCommand *matched = match_commands(I->mod, set, words, nword,
+                                             &num_matched);
+    bool ok = execute_command(I, set, matched, num_matched);
+    free(matched);
+    return ok;
+}
+
+/* Processes a single command, appending to the current output. */
+static bool process_line(Interpreter *I, char *line)
+{
+    int words[MAX_COMMAND_WORDS], nword;
+
+    return lookup_words(I, line, words, &nword) &&
+           process_words(I, words, nword);
+}
+
+bool process_command(Interpreter *I, char *line)
+{
+    AR_clear(I->output);
+    return process_line(I, line);
+}
+
+bool process_command_words(Interpreter *I, const int *words, int nword)
+{
+    AR_clear(I->output);
+    return check_words(I, words, nword) && process_words(I, words, nword);
+}
+
+/* Returns whether a command contains no words (i.e. no alphanumeric
+   characters; see normalize()). */
+static bool is_blank(const char *line)
+{
+    for ( ; *line != '\0'; ++line)
+        if (isalnum((unsigned char)*line))
+            return false;
+    return true;
+}
+
+bool process_input(Interpreter *I, char *line)
+{
+    char *out = line, *p, *next, sep = '\0';
+    bool ok = true;
+
+    AR_clear(I->output);
+    if (is_blank(line))
+        return process_line(I, line);
+
+    for (p = line; *p != '\0'; p = next)
+    {
+        char *end = p + strcspn(p, COMMAND_SEPARATORS);
+        char next_sep = *end;
+        next = end + (next_sep != '\0');
+        *end = '\0';
+        if (is_blank(p))
+            continue;
+        while (isspace((unsigned char)*p))
+            ++p;
+
+        /* Separate the output of consecutive commands by a line break */
+        if ( out > line && !AR_empty(I->output) &&
+             *(char*)AR_last(I->output) != '\n' )
+        {
+            char ch = '\n';
+            AR_append(I->output, &ch);
+        }
+
+        ok = process_line(I, p);
+
+        /* Move the normalized command to the end of the processed part of
+           the line (this fits, since normalizing doesn't lengthen it). */
+        if (out > line)
+        {
+            *out++ = sep;
+            if (out < p)
+                *out++ = ' ';
+        }
+        size_t len = strlen(p);
+        memmove(out, p, len);
+        out += len;
+        sep = next_sep;
+
+        if (!ok)
+            break;
+    }
+    *out = '\0';
+    return ok;
+}
+
+int find_word(const Module *mod, const char *word)
+{
+    return match_word(mod, word, hash_word(word));
+}
+
+/* State of a single request while processing a batch. */
+typedef struct BatchEntry
+{
+    CommandRequest          *req;
+    bool                    ok;         /* words are valid */
+    int                     words[MAX_COMMAND_WORDS], nword;
+    const CommandSet        *set;
+    const MatchedCommand    *matched;   /* shared between equal commands */
+    int                     num_matched;
+    bool                    owner;      /* this entry must free `matched' */
+} BatchEntry;
+
+/* Orders unrelated pointers (comparing them directly is undefined). */
+static int cmp_ptr(const void *a, const void *b)
+{
+    uintptr_t p = (uintptr_t)a, q = (uintptr_t)b;
+    return p < q ? -1 : p > q ? 1 : 0;
+}
+
+/* Orders batch entries by module and command line. */
+static int batch_line_cmp(const void *a, const void *b)
+{
+    const BatchEntry *p = *(BatchEntry**)a, *q = *(BatchEntry**)b;
+    int d = cmp_ptr(p->req->I->mod, q->req->I->mod);
+    return d != 0 ? d : strcmp(p->req->line, q->req->line);
+}
+
+/* Orders batch entries by module, command set and words. */
+static int batch_words_cmp(const void *a, const void *b)
+{
+    const BatchEntry *p = *(BatchEntry**)a, *q = *(BatchEntry**)b;
+    int d = cmp_ptr(p->req->I->mod, q->req->I->mod), n;
+    if (d == 0)
+        d = cmp_ptr(p->set, q->set);
+    if (d == 0)
+        d = p->nword - q->nword;
+    for (n = 0; d == 0 && n < p->nword; ++n)
+        d = p->words[n] - q->words[n];
+    return d;
+}
+
+void process_batch(CommandRequest *reqs, int nreq)
+{
+    BatchEntry *entries = malloc(sizeof(BatchEntry)*(nreq + 1));
+    BatchEntry **order  = malloc(sizeof(BatchEntry*)*(nreq + 1));
+    int n, m, i, norder = 0;
+
+    if (entries == NULL || order == NULL)
+        fatal("Out of memory.");
+
+    /* Convert pre-tokenized commands, and sort command lines so identical
+       lines (for the same module) are adjacent. */
+    for (n = 0; n < nreq; ++n)
+    {
+        BatchEntry *e = &entries[n];
+        e->req     = &reqs[n];
+        e->ok      = false;
+        e->matched = NULL;
+        e->owner   = false;
+        AR_clear(reqs[n].I->output);
+
+        if (reqs[n].line != NULL)
+        {
+            order[norder++] = e;
+        }
+        else
+        if (check_words(reqs[n].I, reqs[n].words, reqs[n].nword))
+        {
+            e->ok    = true;
+            e->nword = reqs[n].nword;
+            memcpy(e->words, reqs[n].words, sizeof(int)*reqs[n].nword);
+        }
+    }
+    qsort(order, norder, sizeof(BatchEntry*), &batch_line_cmp);
+
+    /* Tokenize each distinct command line once */
+    for (n = 0; n < norder; n = m)
+    {
+        BatchEntry *first = order[n];
+        for (m = n + 1; m < norder && batch_line_cmp(&order[n], &order[m]) == 0; ++m)
+            continue;
+
+        first->ok = lookup_words( first->req->I, first->req->line,
+                                  first->words, &first->nword );
+        for (i = n + 1; i < m; ++i)
+        {
+            BatchEntry *e = order[i];
+            Array *output = first->req->I->output;
+            e->ok    = first->ok;
+            e->nword = first->nword;
+            memcpy(e->words, first->words, sizeof(int)*first->nword);
+            strcpy(e->req->line, first->req->line);
+            AR_resize(e->req->I->output, AR_size(output));
+            if (AR_size(output) > 0)
+                memcpy( AR_data(e->req->I->output), AR_data(output),
+                        AR_size(output) );
+        }
+    }
+
+    /* Match each distinct command against the grammar once */
+    norder = 0;
+    for (n = 0; n < nreq; ++n)
+    {
+        if (entries[n].ok)
+        {
+            entries[n].set = active_command_set(entries[n].req->I);
+            order[norder++] = &entries[n];
+        }
+    }
+    qsort(order, norder, sizeof(BatchEntry*), &batch_words_cmp);
+    for (n = 0; n < norder; n = m)
+    {
+        BatchEntry *first = order[n];
+        for (m = n + 1; m < norder && batch_words_cmp(&order[n], &order[m]) == 0; ++m)
+            continue;
+
+        first->owner   = true;
+        first->matched = match_commands( first->req->I->mod, first->set,
+                                         first->words, first->nword,
+                                         &first->num_matched );
+        for (i = n + 1; i < m; ++i)
+        {
+            order[i]->matched     = first->matched;
+            order[i]->num_matched = first->num_matched;
+        }
+    }
+
+    /* Evaluate guards and run commands for each session, in request order */
+    for (n = 0; n < nreq; ++n)
+    {
+        if (entries[n].ok)
+            execute_command( entries[n].req->I, entries[n].set,
+                             entries[n].matched, entries[n].num_matched );
     }
 
-    /* Invoke the command function */
-    push_stack(I->stack, (Value)cmd_func);
-    invoke(I, 1, 0);
+    for (n = 0; n < nreq; ++n)
+        if (entries[n].owner)
+            free((void*)entries[n].matched);
+    free(order);
+    free(entries);
 }
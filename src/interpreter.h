@@ -3,8 +3,10 @@
 
 #include <stdbool.h>
 #include <stdio.h>
+#include "Arena.h"
 #include "Array.h"
 #include "parser.h"
+#include "WordTrie.h"
 
 typedef struct Instruction
 {
@@ -12,10 +14,15 @@ typedef struct Instruction
 } Instruction;
 
 
+/* Decoding state of a function's instructions (see decode_functions()) */
+enum FunctionState { FUNC_PACKED, FUNC_DECODING, FUNC_DECODED };
+
 typedef struct Function
 {
     int id, nparam, nret, ninstr;
     Instruction *instrs;
+    const unsigned char *code;  /* packed instructions (in the module file) */
+    int state;                  /* one of enum FunctionState */
 } Function;
 
 typedef struct Command
@@ -25,6 +32,20 @@ typedef struct Command
     int         function;
 } Command;
 
+/* A set of commands that is active in a particular context. Commands are
+   indexed by the first word they can match, so only a fraction of the set
+   needs to be considered when parsing a command. */
+typedef struct CommandSet
+{
+    int         context;        /* context symbol (or nil for the default) */
+    int         ncommand;
+    Command     *commands;      /* points into Module.commands */
+    int         *first_start;   /* per word: offset into first_commands */
+    int         *first_commands;/* command indices, grouped by first word */
+    int         nnullable;
+    int         *nullable_commands; /* commands matching the empty string */
+} CommandSet;
+
 
 /* Values */
 typedef int Value;
@@ -32,52 +53,95 @@ extern const Value val_true, val_false, val_nil;
 #define VAL_TO_BOOL(v)  ((v) > 0 ? true : false)
 #define BOOL_TO_VAL(b)  ((b) ? val_true: val_false)
 
+/* Limit on the number of words in a command.
+   Useful to keep parsing relatively efficient. */
+#define MAX_COMMAND_WORDS 50
+
+/* Limit on the number of entity slots in a command (e.g. "PUT $obj IN $box"
+   has two slots). */
+#define MAX_COMMAND_SLOTS 4
+
+/* Module file version written by the compiler (major*256 + minor).
+   The interpreter accepts all versions from 1.0 up to this one. */
+#define MODULE_VERSION (0x0102)
+
 /* List of built-in function names (terminated by NULL) */
-#define NUM_BUILTIN_FUNCS (6)
+#define NUM_BUILTIN_FUNCS (7)
 extern const char * const builtin_func_names[NUM_BUILTIN_FUNCS + 1];
 
 /* List of built-in variable names (terminated by NULL) */
 #define NUM_BUILTIN_VARS (8)
 extern const char * const builtin_var_names[NUM_BUILTIN_VARS + 1];
-enum builtin_var_ids { var_title, var_subtitle };
+enum builtin_var_ids { var_title, var_subtitle, var_context };
 
 typedef struct Module
 {
+    int version;  /* module file version (major*256 + minor) */
     int num_entities, num_properties, num_globals, init_func;
 
+    /* Tables read from the module file are allocated from the arena. String
+       and word data is not copied if the file was mapped into memory; in that
+       case, `image' is the mapping that holds the data. */
+    Arena           arena;
+    void            *image;
+    size_t          image_size;
+    bool            from_image;        /* loaded from a native image? (then
+                                          all tables are part of `image') */
+
     /* String table */
     int             nstring;
     char            **strings;
-    void            *string_data;
 
-    /* Function table */
+    /* Function table. Instructions are kept packed, as in the module file,
+       until a function is first invoked. Decoded instructions are stored in
+       a single array, at the same offsets as in the file. */
     int             nfunction;
     Function        *functions;
-    void            **function_data;
+    const unsigned char *code;         /* packed instructions */
+    int             ncode;             /* number of packed instructions */
+    Instruction     *instrs;           /* decoded instructions */
+    struct FunctionDecoder *decoder;   /* background decoder (or NULL) */
 
     /* Word table */
     int             nword;
     char            **words;
-    void            *word_data;
     int             *word_index;       /* closed hash table of word indices */
     size_t          word_index_size;   /* size of hash table */
+    unsigned        *word_disp;        /* perfect hash displacements (or NULL) */
+    size_t          word_disp_size;    /* number of displacement buckets */
+    WordTrie        *word_trie;        /* fuzzy index (see suggest_words()) */
 
     /* Grammar table */
     int             nsymbol;
     GrammarRuleSet  *symbol_rules;
     bool            *symbol_nullable;
+    CaptureIndex    slots;             /* slot symbol (matches any entity;
+                                          slots.symbol is -1 if absent) */
 
     /* Command table */
     int             ncommand;
     Command         *commands;
+    int             ncommandset;
+    CommandSet      *command_sets;
 
 } Module;
 
 
+/* A store to a variable, as recorded in a write log. */
+typedef struct VarWrite
+{
+    int     index;              /* index of the variable */
+    Value   old;                /* value before the store */
+} VarWrite;
+
 typedef struct Variables
 {
     int nval;
     Value *vals;
+    int ndirty;                 /* number of modified variables */
+    int *dirty;                 /* indices of modified variables */
+    unsigned char *dirty_map;   /* bitmap of modified variables */
+    Array *log;                 /* write log (array of VarWrite) or NULL */
 } Variables;
 
 
@@ -97,6 +161,9 @@ typedef struct Interpreter
     Array       *output;        /* array of chars */
     Callbacks   *callbacks;     /* optional callback functions */
     void        *aux;           /* auxiliary data (useful for callbacks) */
+    struct UndoHistory *undo;   /* undo history (see undo.h) or NULL */
+    struct Transaction *transaction;    /* innermost open transaction (see
+                                           transaction.h) or NULL */
 } Interpreter;
 
 
@@ -105,15 +172,89 @@ struct IOStream;
 Module *load_module(struct IOStream *ios);
 void free_module(Module *mod);
 
+/* Functions are decoded the first time they are invoked. decode_functions()
+   decodes all functions that have not been decoded yet. If `background' is
+   set (and threads are supported; see WITH_THREADS) this happens on a
+   separate thread, and the call returns immediately. */
+void decode_functions(Module *mod, bool background);
+
+/* Finds up to `max_matches' words in the module's word table that are closest
+   to `word' (which is `len' characters long and need not be zero-terminated),
+   and stores them in `matches', ordered by increasing edit distance. Returns
+   the number of matches stored. */
+int suggest_words( const Module *mod, const char *word, size_t len,
+                   WTMatch *matches, int max_matches );
+
 /* Variables allocation (variables are cleared on allocation) */
 Variables *alloc_vars(Module *mod);
+
+/* Allocates variables whose values are stored at `vals' (e.g. a mapping of a
+   saved game; see map_save_file()) instead, which are left unchanged. The
+   values are not freed by free_vars(). */
+Variables *alloc_vars_at(Module *mod, Value *vals);
 void free_vars(Variables *vars);
 void clear_vars(Variables *vars);
 Variables *dup_vars(Variables *vars);
 int cmp_vars(Variables *vars1, Variables *vars2);
 
+/* Modified variables are tracked, so saved games can be updated
+   incrementally: set_var() (which the interpreter uses for all stores) and
+   clear_vars() mark variables as dirty, and their indices are listed in
+   vars->dirty (in order of first modification) until clear_dirty_vars() is
+   called. If vars->log is set, set_var() also appends each store to it (see
+   undo.h and transaction.h), as does clear_vars() for each variable that was
+   not nil. Writing to vars->vals directly bypasses both. */
+void set_var(Variables *vars, int index, Value val);
+void clear_dirty_vars(Variables *vars);
+
 /* Interpreter functions */
-void process_command(Interpreter *I, char *command);
+
+/* Processes a command entered by the player. The command string is
+   normalized in place (see normalize() in strings.h). Returns whether a
+   command was executed (i.e. false if the command was not understood, or
+   none of the matching commands was active). */
+bool process_command(Interpreter *I, char *command);
+
+/* Processes a command given as a list of indices into the word table (e.g.
+   for commands selected by clicking instead of typing). */
+bool process_command_words(Interpreter *I, const int *words, int nword);
+
+/* Characters that separate commands on a single input line. */
+#define COMMAND_SEPARATORS ".,;!?"
+
+/* Processes a line of input that may contain several commands separated by
+   any of the COMMAND_SEPARATORS (e.g. "TAKE LAMP. N, N, E"). Commands are
+   executed in order until one fails, and their output is collected in a
+   single buffer. Afterwards, `line' contains the normalized commands that
+   were processed. Returns whether all commands were executed. */
+bool process_input(Interpreter *I, char *line);
+
+/* Returns the index of a (normalized) word in the word table, or -1. */
+int find_word(const Module *mod, const char *word);
+
+/* Returns the command set for the active context. If there is none, the first
+   command set is used. */
+const CommandSet *active_command_set(const Interpreter *I);
+
+/* Evaluates a command guard (an index into the function table, or -1 for
+   commands without a guard) for the given entity arguments. */
+bool evaluate_guard(Interpreter *I, int guard, const Value *args, int narg);
+
+/* A command to be processed as part of a batch. */
+typedef struct CommandRequest
+{
+    Interpreter *I;
+    char        *line;      /* command line, or NULL to use `words' */
+    const int   *words;     /* pre-tokenized command (if line is NULL) */
+    int         nword;
+} CommandRequest;
+
+/* Processes a batch of commands, with the same effect as calling
+   process_command() or process_command_words() for each request in turn.
+   Identical commands are tokenized and parsed only once, after which guards
+   and command bodies are evaluated separately for each interpreter.
+   An interpreter may occur in at most one request per batch. */
+void process_batch(CommandRequest *reqs, int nreq);
 void reinitialize(Interpreter *I);
 
 #endif /* ndef INTERPRETER_H_INCLUDED */
@@ -1,9 +1,28 @@
 #include "io.h"
+#include "crc32c.h"
 #include <assert.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 
+#ifdef WITH_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Smaller files are read normally, since mapping them costs more time than
+   copying their contents. */
+#define MIN_MAP_SIZE 65536
+#endif
+
+#ifdef WITH_THREADS
+#include <pthread.h>
+#include <unistd.h>
+
+/* Maximum number of threads used to (de)compress blocks */
+#define MAX_THREADS 16
+#endif
+
 #ifdef WITH_LZMA
 static void *lzma_alloc(void *p, size_t size)
 {
@@ -54,141 +73,943 @@ static bool autodetect_lzma(IOStream *ios)
 #endif
 }
 
+/* Maps the (uncompressed) input file into memory. Returns false if this is
+   not possible, in which case the stream is left unchanged. */
+static bool map_input(IOStream *ios)
+{
+#ifndef WITH_MMAP
+    (void)ios;
+    return false;
+#else
+    struct stat st;
+    void *addr;
+
+    if (fstat(fileno((FILE*)ios->fp), &st) != 0 || !S_ISREG(st.st_mode) ||
+        st.st_size < MIN_MAP_SIZE || (size_t)st.st_size != (unsigned long long)st.st_size)
+        return false;
+
+    /* Mapped writable (but private) so the loader can normalize words in
+       place; pages are only copied when they are actually modified. */
+    addr = mmap( NULL, (size_t)st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE,
+                 fileno((FILE*)ios->fp), 0 );
+    if (addr == MAP_FAILED)
+        return false;
+
+    ios->map       = addr;
+    ios->map_size  = (size_t)st.st_size;
+    ios->map_pos   = 0;
+    ios->map_ready = ios->map_size;
+    ios->pos_out  = ios->len_out = 0;
+    return true;
+#endif
+}
+
+#ifdef WITH_LZMA
+/* A block of an IOC_LZMA_BLOCKS stream. When writing, `src' points to the
+   uncompressed data and `dst' to the compressed data; when reading, it is the
+   other way around. */
+typedef struct Block
+{
+    unsigned char   *src, *dst;         /* input/output data */
+    size_t          src_size, dst_size; /* input/output size */
+    size_t          capacity;           /* allocated output size (writing) */
+    bool            done;               /* has the block been processed? */
+} Block;
+
+/* A set of blocks to be compressed or decompressed by worker threads. Blocks
+   are handed out in order; `nready' counts the leading blocks that have been
+   processed successfully, and `ready_size' their total output size. */
+struct BlockSet
+{
+    bool            encode;             /* compressing (or decompressing)? */
+    CLzmaEncProps   props;              /* encoder properties */
+    Byte            header[LZMA_PROPS_SIZE];  /* encoded properties */
+    unsigned char   *data;              /* compressed file data (reading) */
+    size_t          nblock;             /* number of blocks */
+    Block           *blocks;            /* blocks (nblock elements) */
+    size_t          next;               /* index of the next block to process */
+    size_t          nready;             /* number of leading blocks done */
+    size_t          ready_size;         /* output size of leading blocks */
+    bool            failed;             /* did processing any block fail? */
+    bool            cancel;             /* stop processing remaining blocks? */
+#ifdef WITH_THREADS
+    pthread_mutex_t lock;               /* protects all fields above */
+    pthread_cond_t  cond;               /* signalled when a block is done */
+    int             nthread;            /* number of worker threads running */
+    pthread_t       threads[MAX_THREADS];
+#endif
+};
+
+static unsigned get_uint32(const unsigned char *p)
+{
+    return ((unsigned)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void put_uint32(unsigned char *p, unsigned i)
+{
+    p[0] = (i >> 24)&255;
+    p[1] = (i >> 16)&255;
+    p[2] = (i >>  8)&255;
+    p[3] = (i >>  0)&255;
+}
+
+static void lock_blocks(struct BlockSet *bs)
+{
+#ifdef WITH_THREADS
+    pthread_mutex_lock(&bs->lock);
+#else
+    (void)bs;
+#endif
+}
+
+static void unlock_blocks(struct BlockSet *bs)
+{
+#ifdef WITH_THREADS
+    pthread_mutex_unlock(&bs->lock);
+#else
+    (void)bs;
+#endif
+}
+
+static struct BlockSet *alloc_blocks(size_t nblock, bool encode)
+{
+    struct BlockSet *bs;
+
+    bs = calloc(1, sizeof(struct BlockSet));
+    if (bs == NULL)
+        return NULL;
+    bs->blocks = calloc(nblock, sizeof(Block));
+    if (bs->blocks == NULL)
+    {
+        free(bs);
+        return NULL;
+    }
+    bs->nblock = nblock;
+    bs->encode = encode;
+#ifdef WITH_THREADS
+    pthread_mutex_init(&bs->lock, NULL);
+    pthread_cond_init(&bs->cond, NULL);
+#endif
+    return bs;
+}
+
+static void free_blocks(struct BlockSet *bs)
+{
+    size_t n;
+
+#ifdef WITH_THREADS
+    pthread_mutex_destroy(&bs->lock);
+    pthread_cond_destroy(&bs->cond);
+#endif
+    if (bs->encode)
+    {
+        for (n = 0; n < bs->nblock; ++n)
+            free(bs->blocks[n].dst);
+    }
+    free(bs->blocks);
+    free(bs->data);
+    free(bs);
+}
+
+/* Output callback used to collect the compressed data of a block. */
+typedef struct BlockOutput
+{
+    ISeqOutStream   out;
+    Block           *block;
+} BlockOutput;
+
+static size_t block_write(void *p, const void *buf, size_t size)
+{
+    Block *b = ((BlockOutput*)p)->block;
+
+    if (size > b->capacity - b->dst_size)
+    {
+        size_t new_capacity = b->capacity > 0 ? b->capacity : 4096;
+        unsigned char *new_dst;
+        while (new_capacity - b->dst_size < size)
+            new_capacity *= 2;
+        new_dst = realloc(b->dst, new_capacity);
+        if (new_dst == NULL)
+            return 0;
+        b->dst      = new_dst;
+        b->capacity = new_capacity;
+    }
+    memcpy(b->dst + b->dst_size, buf, size);
+    b->dst_size += size;
+    return size;
+}
+
+static bool encode_block(struct BlockSet *bs, Block *b)
+{
+    BlockOutput output = { { block_write }, b };
+
+    return LzmaEncode( &output.out, b->src, b->src_size,
+                       &bs->props, &szalloc ) == SZ_OK;
+}
+
+static bool decode_block(struct BlockSet *bs, Block *b)
+{
+    SizeT dst_size = b->dst_size, src_size = b->src_size;
+    ELzmaStatus status;
+
+    return LzmaDecode( b->dst, &dst_size, b->src, &src_size,
+                       bs->header, LZMA_PROPS_SIZE, LZMA_FINISH_END,
+                       &status, &szalloc ) == SZ_OK &&
+           status == LZMA_STATUS_FINISHED_WITH_MARK &&
+           dst_size == b->dst_size && src_size == b->src_size;
+}
+
+/* Processes blocks until none are left (or processing is cancelled). This is
+   the main function of the worker threads. */
+static void *process_blocks(void *arg)
+{
+    struct BlockSet *bs = arg;
+    Block *b;
+    bool ok;
+
+    for (;;)
+    {
+        lock_blocks(bs);
+        if (bs->cancel || bs->failed || bs->next == bs->nblock)
+        {
+            unlock_blocks(bs);
+            break;
+        }
+        b = &bs->blocks[bs->next++];
+        unlock_blocks(bs);
+
+        ok = bs->encode ? encode_block(bs, b) : decode_block(bs, b);
+
+        lock_blocks(bs);
+        if (!ok)
+            bs->failed = true;
+        b->done = ok;
+        while (bs->nready < bs->nblock && bs->blocks[bs->nready].done)
+            bs->ready_size += bs->blocks[bs->nready++].dst_size;
+#ifdef WITH_THREADS
+        pthread_cond_broadcast(&bs->cond);
+#endif
+        unlock_blocks(bs);
+    }
+
+    return NULL;
+}
+
+/* Starts processing blocks on up to one worker thread per processor. Without
+   thread support (or if no thread can be created) all blocks are processed
+   before this function returns. */
+static void start_blocks(struct BlockSet *bs)
+{
+#ifdef WITH_THREADS
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+    while ( bs->nthread < MAX_THREADS && (bs->nthread < ncpu || bs->nthread == 0)
+            && (size_t)bs->nthread < bs->nblock )
+    {
+        if (pthread_create( &bs->threads[bs->nthread], NULL,
+                            process_blocks, bs ) != 0)
+            break;
+        ++bs->nthread;
+    }
+    if (bs->nthread > 0)
+        return;
+#endif
+    process_blocks(bs);
+}
+
+/* Waits for the worker threads to exit. If `cancel' is true, blocks that have
+   not been started yet are left unprocessed. Returns false if processing any
+   block failed. */
+static bool finish_blocks(struct BlockSet *bs, bool cancel)
+{
+#ifdef WITH_THREADS
+    lock_blocks(bs);
+    bs->cancel = cancel;
+    unlock_blocks(bs);
+    while (bs->nthread > 0)
+        pthread_join(bs->threads[--bs->nthread], NULL);
+#else
+    (void)cancel;
+#endif
+    return !bs->failed;
+}
+
+/* Waits until the first `size' bytes of the stream's image have been
+   decompressed. Returns false if this is not possible. */
+static bool wait_blocks(IOStream *ios, size_t size)
+{
+    struct BlockSet *bs = ios->blocks;
+
+    if (size <= ios->map_ready)
+        return true;
+    if (bs == NULL)
+        return false;
+    lock_blocks(bs);
+#ifdef WITH_THREADS
+    while (bs->ready_size < size && !bs->failed && bs->nthread > 0)
+        pthread_cond_wait(&bs->cond, &bs->lock);
+#endif
+    ios->map_ready = bs->ready_size;
+    unlock_blocks(bs);
+    return size <= ios->map_ready;
+}
+
+/* Returns the offset of the end of the chunk of an IFF file containing
+   position `pos'. The FORM header is considered part of the first chunk.
+   If `data' is not an IFF file, a single chunk spans all data. */
+static size_t iff_chunk_end(const unsigned char *data, size_t size, size_t pos)
+{
+    size_t chunk_size;
+
+    if (size < 12 || memcmp(data, "FORM", 4) != 0)
+        return size;
+    if (pos < 12)
+        pos = 12;
+    if (size - pos < 8)
+        return size;
+    chunk_size = get_uint32(data + pos + 4);
+    chunk_size += chunk_size&1;
+    if (chunk_size > size - pos - 8)
+        return size;
+    return pos + 8 + chunk_size;
+}
+
+/* Divides `size' bytes of `data' into blocks of at most `block_size' bytes,
+   starting a new block at the start of each chunk. Returns the number of
+   blocks, which are stored in `blocks' if it is not NULL. */
+static size_t split_blocks( unsigned char *data, size_t size,
+                            size_t block_size, Block *blocks )
+{
+    size_t nblock = 0, pos = 0, end = 0, next;
+
+    while (pos < size)
+    {
+        if (end <= pos)
+            end = iff_chunk_end(data, size, pos);
+        next = end - pos > block_size ? pos + block_size : end;
+        if (blocks != NULL)
+        {
+            blocks[nblock].src      = data + pos;
+            blocks[nblock].src_size = next - pos;
+        }
+        ++nblock;
+        pos = next;
+    }
+
+    return nblock;
+}
+
+/* Compresses all data written to the stream in blocks, and writes the
+   result. The file is an IFF FORM of type ZBLK, containing a table of
+   contents (TOC chunk) followed by the compressed blocks (LZMA chunk). */
+static bool write_blocks(IOStream *ios)
+{
+    struct BlockSet *bs;
+    unsigned char header[12 + 8 + 16], entry[8];
+    size_t nblock, data_size, toc_size, n;
+    bool ok;
+
+    if (ios->len_out == 0 || ios->len_out > 0x7fffffff)
+        return false;
+    nblock = split_blocks(ios->buf_out, ios->len_out, IOS_BLOCK_SIZE, NULL);
+    bs = alloc_blocks(nblock, true);
+    if (bs == NULL)
+        return false;
+    split_blocks(ios->buf_out, ios->len_out, IOS_BLOCK_SIZE, bs->blocks);
+
+    /* Dictionaries larger than a block are of no use */
+    bs->props = ios->lzma_props;
+    if (bs->props.dictSize == 0 || bs->props.dictSize > IOS_BLOCK_SIZE)
+        bs->props.dictSize = IOS_BLOCK_SIZE;
+    LzmaEncProps_Normalize(&bs->props);
+
+    start_blocks(bs);
+    ok = finish_blocks(bs, false);
+
+    data_size = 0;
+    for (n = 0; ok && n < nblock; ++n)
+    {
+        data_size += bs->blocks[n].dst_size;
+        if (data_size > 0x7fffffff)
+            ok = false;
+    }
+    toc_size = 16 + 8*nblock;
+    if (ok && (toc_size > 0x7fffffff ||
+               4 + 8 + toc_size + 8 + data_size + 1 > 0x7fffffff))
+        ok = false;
+
+    if (ok)
+    {
+        memcpy(header, "FORM", 4);
+        put_uint32(header + 4, 4 + 8 + toc_size + 8 + data_size + (data_size&1));
+        memcpy(header + 8, "ZBLK", 4);
+        memcpy(header + 12, "TOC ", 4);
+        put_uint32(header + 16, toc_size);
+        put_uint32(header + 20, nblock);
+        put_uint32(header + 24, ios->len_out);
+        memset(header + 28, 0, 8);
+        LzmaEncProps_Encode(&bs->props, header + 28);
+        ok = fwrite(header, 1, sizeof(header), ios->fp) == sizeof(header);
+    }
+    for (n = 0; ok && n < nblock; ++n)
+    {
+        put_uint32(entry, bs->blocks[n].src_size);
+        put_uint32(entry + 4, bs->blocks[n].dst_size);
+        ok = fwrite(entry, 1, sizeof(entry), ios->fp) == sizeof(entry);
+    }
+    if (ok)
+    {
+        memcpy(entry, "LZMA", 4);
+        put_uint32(entry + 4, data_size);
+        ok = fwrite(entry, 1, sizeof(entry), ios->fp) == sizeof(entry);
+    }
+    for (n = 0; ok && n < nblock; ++n)
+    {
+        ok = fwrite( bs->blocks[n].dst, 1, bs->blocks[n].dst_size,
+                     ios->fp ) == bs->blocks[n].dst_size;
+    }
+    if (ok && (data_size&1))
+        ok = fputc(0, ios->fp) != EOF;
+
+    free_blocks(bs);
+    return ok;
+}
+
+static bool is_block_file(IOStream *ios)
+{
+    return ios->len_in >= 12 && memcmp(ios->buf_in, "FORM", 4) == 0 &&
+           memcmp(ios->buf_in + 8, "ZBLK", 4) == 0;
+}
+
+/* Allocates memory for a decompressed image. */
+static void *alloc_image(size_t size)
+{
+#ifdef WITH_MMAP
+    void *addr = mmap( NULL, size, PROT_READ|PROT_WRITE,
+                       MAP_PRIVATE|MAP_ANONYMOUS, -1, 0 );
+    return addr == MAP_FAILED ? NULL : addr;
+#else
+    return malloc(size);
+#endif
+}
+
+/* Reads the table of contents and compressed data of a block compressed file
+   (of which the first part is in the input buffer) and starts decompressing
+   its blocks into a new image, which is used as the stream's mapping. */
+static bool open_blocks(IOStream *ios)
+{
+    struct BlockSet *bs = NULL;
+    unsigned char *data, *toc, *image;
+    size_t size, toc_size, data_size, total, nblock, n, src_pos, dst_pos;
+    size_t data_pos;
+
+    /* Read the entire file */
+    size = (size_t)get_uint32(ios->buf_in + 4) + 8;
+    if (size < ios->len_in)
+        size = ios->len_in;
+    data = malloc(size);
+    if (data == NULL)
+        return false;
+    memcpy(data, ios->buf_in, ios->len_in);
+    if (fread(data + ios->len_in, 1, size - ios->len_in, ios->fp)
+        != size - ios->len_in)
+        goto failed;
+
+    /* Parse table of contents */
+    toc = data + 12;
+    if (size - 12 < 8 + 16 || memcmp(toc, "TOC ", 4) != 0)
+        goto failed;
+    toc_size = get_uint32(toc + 4);
+    if (toc_size < 16 || toc_size > size - 12 - 8)
+        goto failed;
+    toc += 8;
+    nblock = get_uint32(toc);
+    total  = get_uint32(toc + 4);
+    if (nblock == 0 || total == 0 || nblock != (toc_size - 16)/8 ||
+        toc_size != 16 + 8*nblock)
+        goto failed;
+    src_pos = 12 + 8 + toc_size + 8;
+    if (src_pos > size || memcmp(data + src_pos - 8, "LZMA", 4) != 0)
+        goto failed;
+    data_pos  = src_pos;
+    data_size = get_uint32(data + src_pos - 4);
+    if (data_size > size - src_pos)
+        goto failed;
+
+    bs = alloc_blocks(nblock, false);
+    if (bs == NULL)
+        goto failed;
+    memcpy(bs->header, toc + 8, LZMA_PROPS_SIZE);
+    image = alloc_image(total);
+    if (image == NULL)
+        goto failed;
+
+    dst_pos = 0;
+    for (n = 0; n < nblock; ++n)
+    {
+        Block *b = &bs->blocks[n];
+        b->dst_size = get_uint32(toc + 16 + 8*n);
+        b->src_size = get_uint32(toc + 16 + 8*n + 4);
+        if ( b->dst_size > total - dst_pos ||
+             b->src_size > data_size - (src_pos - data_pos) )
+            break;
+        b->dst = image + dst_pos;
+        b->src = data + src_pos;
+        dst_pos += b->dst_size;
+        src_pos += b->src_size;
+    }
+    if (n < nblock || dst_pos != total || src_pos - data_pos != data_size)
+    {
+        ios_unmap(image, total);
+        goto failed;
+    }
+
+    bs->data       = data;
+    ios->blocks    = bs;
+    ios->map       = image;
+    ios->map_size  = total;
+    ios->map_pos   = 0;
+    ios->map_ready = 0;
+    ios->pos_in    = ios->len_in = 0;
+    ios->ioc       = IOC_LZMA_BLOCKS;
+    start_blocks(bs);
+    return true;
+
+failed:
+    if (bs != NULL)
+        free_blocks(bs);
+    free(data);
+    return false;
+}
+#else /* ndef WITH_LZMA */
+static bool wait_blocks(IOStream *ios, size_t size)
+{
+    return size <= ios->map_ready;
+}
+#endif /* def WITH_LZMA */
+
 bool ios_open(IOStream *ios, const char *path, IOMode iom, IOCompression ioc)
 {
-    if (iom == IOM_RDONLY)
+    return ios_open_buffered(ios, path, iom, ioc, IOS_DEFAULT_BUFFER_SIZE);
+}
+
+/* Resets all fields of a stream that is being opened. */
+static void init_stream(IOStream *ios)
+{
+    ios->fp = NULL;
+    ios->map = NULL;
+    ios->map_size = ios->map_pos = ios->map_ready = 0;
+    ios->map_borrowed = false;
+    ios->blocks = NULL;
+    ios->buf_in = ios->buf_out = NULL;
+    ios->buf_size = 0;
+    ios->pos_in  = ios->len_in  = 0;
+    ios->pos_out = ios->len_out = 0;
+    ios->checksum = false;
+    ios->crc = 0;
+}
+
+/* Sets up a stream for reading from the file `fp', which is closed if this
+   fails. */
+static bool open_input( IOStream *ios, FILE *fp, IOCompression ioc,
+                        size_t buf_size )
+{
+    if (buf_size < IOS_MIN_BUFFER_SIZE)
+        buf_size = IOS_MIN_BUFFER_SIZE;
+    ios->buf_in = malloc(2*buf_size);
+    if (ios->buf_in == NULL)
     {
-        ios->fp  = fopen(path, "rb");
-        if (ios->fp == NULL)
-            return false;
-        ios->iom = IOM_RDONLY;
-        ios->ioc = IOC_COPY;
-        ios->pos_in  = ios->len_in  = 0;
-        ios->pos_out = ios->len_out = 0;
+        fclose(fp);
+        return false;
+    }
+    ios->buf_out  = ios->buf_in + buf_size;
+    ios->buf_size = buf_size;
+
+    ios->fp  = fp;
+    ios->iom = IOM_RDONLY;
+    ios->ioc = IOC_COPY;
 
-        if (ioc == IOC_LZMA || ioc == IOC_AUTO)
+    if (ioc != IOC_COPY)
+    {
+        ios->len_in = fread(ios->buf_in, 1, ios->buf_size, ios->fp);
+#ifdef WITH_LZMA
+        if ( (ioc == IOC_AUTO || ioc == IOC_LZMA_BLOCKS) &&
+             is_block_file(ios) )
         {
-            ios->len_in = fread(ios->buf_in, 1, sizeof(ios->buf_in), ios->fp);
-            if (!autodetect_lzma(ios))
+            if (open_blocks(ios))
+                return true;
+            ioc = IOC_LZMA_BLOCKS;  /* corrupt file; fail below */
+        }
+#endif
+        if (ioc == IOC_LZMA_BLOCKS || !autodetect_lzma(ios))
+        {
+            if (ioc != IOC_AUTO)
             {
-                if (ioc != IOC_AUTO)
-                    return false;
-
-                /* Falling back to copy mode; move data to output buffer. */
-                memcpy(ios->buf_out, ios->buf_in, ios->len_in);
-                ios->len_out = ios->len_in;
-                ios->len_in  = 0;
+                fclose(ios->fp);
+                free(ios->buf_in);
+                return false;
             }
+
+            /* Falling back to copy mode; move data to output buffer. */
+            memcpy(ios->buf_out, ios->buf_in, ios->len_in);
+            ios->len_out = ios->len_in;
+            ios->len_in  = 0;
         }
-        return true;
+    }
+    if (ios->ioc == IOC_COPY)
+        map_input(ios);
+    return true;
+}
+
+bool ios_open_buffered( IOStream *ios, const char *path, IOMode iom,
+                        IOCompression ioc, size_t buf_size )
+{
+    init_stream(ios);
+
+    if (iom == IOM_RDONLY)
+    {
+        FILE *fp = fopen(path, "rb");
+        if (fp == NULL)
+            return false;
+        return open_input(ios, fp, ioc, buf_size);
     }
 
     if (iom == IOM_WRONLY)
     {
+#ifdef WITH_LZMA
+        if (!( ioc == IOC_COPY || ioc == IOC_AUTO || ioc == IOC_LZMA ||
+               ioc == IOC_LZMA_BLOCKS ))
+            return false;
+        LzmaEncProps_Init(&ios->lzma_props);
+#else
         if (!(ioc == IOC_COPY || ioc == IOC_AUTO))
             return false;
+#endif
         ios->fp  = fopen(path, "wb");
         if (ios->fp == NULL)
             return false;
         ios->iom = IOM_WRONLY;
-        ios->ioc = IOC_COPY;
-        ios->pos_in  = ios->len_in  = 0;
-        ios->pos_out = ios->len_out = 0;
+        ios->ioc = (ioc == IOC_AUTO) ? IOC_COPY : ioc;
+        return true;
+    }
+
+    return false;
+}
+
+bool ios_open_memory(IOStream *ios, void *data, size_t size)
+{
+    const unsigned char *p = data;
+
+    init_stream(ios);
+
+    /* Uncompressed modules are used in place */
+    if ( size >= 12 && memcmp(p, "FORM", 4) == 0 &&
+         memcmp(p + 8, "ZBLK", 4) != 0 )
+    {
+        ios->iom          = IOM_RDONLY;
+        ios->ioc          = IOC_COPY;
+        ios->map          = data;
+        ios->map_size     = size;
+        ios->map_ready    = size;
+        ios->map_borrowed = true;
         return true;
     }
 
+#ifdef WIN32
     return false;
+#else
+    /* Compressed data is decompressed as if read from a file */
+    {
+        FILE *fp = fmemopen(data, size, "rb");
+        if (fp == NULL)
+            return false;
+        return open_input(ios, fp, IOC_AUTO, IOS_DEFAULT_BUFFER_SIZE);
+    }
+#endif
 }
 
 bool ios_eof(IOStream *ios)
 {
+    if (ios->map != NULL)
+        return ios->map_pos == ios->map_size;
     return ios->pos_in  == ios->len_in &&
            ios->pos_out == ios->len_out && feof((FILE*)ios->fp);
 }
 
-void ios_close(IOStream *ios)
+#ifdef WITH_LZMA
+static size_t lzma_write(void *p, const void *buf, size_t size)
+{
+    IOStream *ios = (IOStream*)((char*)p - offsetof(IOStream, lzma_out));
+    return fwrite(buf, 1, size, ios->fp);
+}
+
+/* Compresses all data written to the stream, and writes the result. */
+static bool write_lzma(IOStream *ios)
+{
+    unsigned char header[LZMA_PROPS_SIZE + 8];
+
+    /* The uncompressed size is written as unknown (all ones); the stream is
+       terminated with an end marker instead, as read_data() expects. */
+    LzmaEncProps_Normalize(&ios->lzma_props);
+    LzmaEncProps_Encode(&ios->lzma_props, header);
+    memset(header + LZMA_PROPS_SIZE, 0xff, 8);
+    if (fwrite(header, 1, sizeof(header), ios->fp) != sizeof(header))
+        return false;
+
+    ios->lzma_out.Write = lzma_write;
+    return LzmaEncode( &ios->lzma_out, ios->buf_out, ios->len_out,
+                       &ios->lzma_props, &szalloc ) == SZ_OK;
+}
+#endif
+
+bool ios_close(IOStream *ios)
 {
+    bool ok = true;
+
 #ifdef WITH_LZMA
     if (ios->iom == IOM_RDONLY && ios->ioc == IOC_LZMA)
         LzmaDec_Free(&ios->lzma_dec, &szalloc);
+    if (ios->iom == IOM_WRONLY && ios->ioc == IOC_LZMA)
+        ok = write_lzma(ios);
+    if (ios->iom == IOM_WRONLY && ios->ioc == IOC_LZMA_BLOCKS)
+        ok = write_blocks(ios);
+    if (ios->blocks != NULL)
+    {
+        finish_blocks(ios->blocks, true);
+        free_blocks(ios->blocks);
+        ios->blocks = NULL;
+    }
 #endif
-    fclose(ios->fp);
+    if (ios->map != NULL)
+    {
+        if (!ios->map_borrowed)
+            ios_unmap(ios->map, ios->map_size);
+        ios->map = NULL;
+    }
+    if (ios->fp != NULL && fclose(ios->fp) != 0)
+        ok = false;
     ios->fp = NULL;
+    if (ios->iom == IOM_WRONLY)
+        free(ios->buf_out);
+    else
+        free(ios->buf_in);
+    ios->buf_in = ios->buf_out = NULL;
+    ios->iom = IOM_CLOSED;
+    return ok;
 }
 
-static bool refill_input(IOStream *ios)
+void ios_set_compression(IOStream *ios, int level, size_t dict_size)
 {
-    /* when called, buf_out is empty and must be refilled */
+#ifdef WITH_LZMA
+    ios->lzma_props.level    = level;
+    ios->lzma_props.dictSize = dict_size > ((UInt32)1 << 27) ?
+                               ((UInt32)1 << 27) : (UInt32)dict_size;
+#else
+    (void)ios;
+    (void)level;
+    (void)dict_size;
+#endif
+}
 
-    if (ios->ioc == IOC_COPY)
+void *ios_view(IOStream *ios, size_t size)
+{
+    void *res = ios_peek(ios, size);
+
+    if (res != NULL)
     {
-        /* Read directly into output buffer */
-        size_t nread = fread(ios->buf_out, 1, sizeof(ios->buf_out), ios->fp);
-        if (nread == 0)
-            return false;
-        ios->pos_out = 0;
-        ios->len_out = (int)nread;
-        return true;
+        if (ios->checksum)
+            ios->crc = crc32c(ios->crc, res, size);
+        ios->map_pos += size;
     }
-    else
+    return res;
+}
+
+void *ios_peek(IOStream *ios, size_t size)
+{
+    if (ios->map == NULL || size > ios->map_size - ios->map_pos ||
+        !wait_blocks(ios, ios->map_pos + size))
+        return NULL;
+    return ios->map + ios->map_pos;
+}
+
+void ios_begin_checksum(IOStream *ios)
+{
+    ios->checksum = true;
+    ios->crc = 0;
+}
+
+uint32_t ios_end_checksum(IOStream *ios)
+{
+    ios->checksum = false;
+    return ios->crc;
+}
+
+bool ios_detach_map(IOStream *ios, void **addr, size_t *size)
+{
+    if (ios->map == NULL || ios->map_borrowed)
+        return false;
 #ifdef WITH_LZMA
-    if (ios->ioc == IOC_LZMA)
+    if (ios->blocks != NULL)
     {
-        ios->pos_out = ios->len_out = 0;
+        finish_blocks(ios->blocks, false);
+        free_blocks(ios->blocks);
+        ios->blocks = NULL;
+    }
+#endif
+    *addr = ios->map;
+    *size = ios->map_size;
+    ios->map = NULL;
+    ios->map_size = ios->map_pos = ios->map_ready = 0;
+    return true;
+}
 
-        while ((size_t)ios->len_out < sizeof(ios->buf_out))
-        {
-            if (ios->pos_in == ios->len_in)
-            {
-                /* Need to reed new input data */
-                size_t nread = fread(ios->buf_in, 1, sizeof(ios->buf_in), ios->fp);
-                ios->pos_in = 0;
-                ios->len_in = nread;
-                if (nread == 0)
-                    break;
-            }
+void ios_unmap(void *addr, size_t size)
+{
+#ifdef WITH_MMAP
+    munmap(addr, size);
+#else
+    /* Only block compressed images exist, which are allocated by malloc() */
+    (void)size;
+    free(addr);
+#endif
+}
 
-            /* Decode some input */
-            size_t avail_in  = ios->len_in - ios->pos_in;
-            size_t avail_out = sizeof(ios->buf_out) - ios->len_out;
-            SRes res = LzmaDec_DecodeToBuf( &ios->lzma_dec,
-                ios->buf_out + ios->len_out, &avail_out,
-                ios->buf_in  + ios->pos_in,  &avail_in,
-                LZMA_FINISH_ANY, &ios->lzma_status );
-            ios->len_out += avail_out;
-            ios->pos_in  += avail_in;
-            if (res != SZ_OK)
-                return false;
+#ifdef WITH_LZMA
+/* Decodes up to `size' bytes of LZMA compressed input into `dest', refilling
+   the input buffer as necessary. Returns the number of bytes decoded, which
+   is less than `size' only at the end of the stream or if an error occurs. */
+static size_t decode_lzma(IOStream *ios, unsigned char *dest, size_t size)
+{
+    size_t len = 0;
+
+    while (len < size)
+    {
+        if (ios->pos_in == ios->len_in)
+        {
+            /* Need to read new input data */
+            size_t nread = fread(ios->buf_in, 1, ios->buf_size, ios->fp);
+            ios->pos_in = 0;
+            ios->len_in = nread;
+            if (nread == 0)
+                break;
         }
 
-        return ios->len_out > 0;
+        /* Decode some input */
+        size_t avail_in  = ios->len_in - ios->pos_in;
+        size_t avail_out = size - len;
+        SRes res = LzmaDec_DecodeToBuf( &ios->lzma_dec,
+            dest + len, &avail_out, ios->buf_in + ios->pos_in, &avail_in,
+            LZMA_FINISH_ANY, &ios->lzma_status );
+        len         += avail_out;
+        ios->pos_in += avail_in;
+        if (res != SZ_OK || (avail_in == 0 && avail_out == 0))
+            break;
     }
-    else
+
+    return len;
+}
 #endif
-    {
-        return false;
-    }
+
+/* Reads up to `size' bytes into `dest', bypassing the output buffer. Returns
+   the number of bytes read. */
+static size_t read_direct(IOStream *ios, unsigned char *dest, size_t size)
+{
+    if (ios->ioc == IOC_COPY)
+        return fread(dest, 1, size, ios->fp);
+#ifdef WITH_LZMA
+    if (ios->ioc == IOC_LZMA)
+        return decode_lzma(ios, dest, size);
+#endif
+    return 0;
 }
 
-bool read_data(IOStream *ios, void *buf, size_t size)
+static bool refill_input(IOStream *ios)
+{
+    /* when called, buf_out is empty and must be refilled */
+    ios->pos_out = 0;
+    ios->len_out = read_direct(ios, ios->buf_out, ios->buf_size);
+    return ios->len_out > 0;
+}
+
+static bool read_bytes(IOStream *ios, void *buf, size_t size)
 {
-    unsigned char *p = buf, *q = buf + size;
-    while (p != q)
+    unsigned char *p = buf;
+    size_t n;
+
+    if (ios->map != NULL)
     {
-        while (ios->pos_out < ios->len_out && p != q)
-            *p++ = ios->buf_out[ios->pos_out++];
+        if (size > ios->map_size - ios->map_pos ||
+            !wait_blocks(ios, ios->map_pos + size))
+            return false;
+        memcpy(buf, ios->map + ios->map_pos, size);
+        ios->map_pos += size;
+        return true;
+    }
 
-        if (p != q && !refill_input(ios))
+    while (size > 0)
+    {
+        if (ios->pos_out == ios->len_out)
+        {
+            if (size >= ios->buf_size)
+            {
+                /* Large request: read directly into the destination */
+                n = read_direct(ios, p, size);
+                if (n == 0)
+                    return false;
+                p    += n;
+                size -= n;
+                continue;
+            }
+            if (!refill_input(ios))
                 return false;
+        }
+
+        /* Copy buffered data */
+        n = ios->len_out - ios->pos_out;
+        if (n > size)
+            n = size;
+        memcpy(p, ios->buf_out + ios->pos_out, n);
+        ios->pos_out += n;
+        p    += n;
+        size -= n;
     }
 
     return true;
 }
 
+bool read_data(IOStream *ios, void *buf, size_t size)
+{
+    if (!read_bytes(ios, buf, size))
+        return false;
+    if (ios->checksum)
+        ios->crc = crc32c(ios->crc, buf, size);
+    return true;
+}
+
 bool write_data(IOStream *ios, const void *buf, size_t size)
 {
-    /* Only direct copying is supported right now */
-    return fwrite(buf, 1, size, ios->fp) == size;
+    if (ios->checksum)
+        ios->crc = crc32c(ios->crc, buf, size);
+
+    if (ios->ioc == IOC_COPY)
+        return fwrite(buf, 1, size, ios->fp) == size;
+
+    /* Collect data to be compressed when the stream is closed */
+    if (size > ios->buf_size - ios->len_out)
+    {
+        size_t new_size = ios->buf_size > 0 ? ios->buf_size : IOS_DEFAULT_BUFFER_SIZE;
+        unsigned char *new_buf;
+        while (new_size - ios->len_out < size)
+            new_size *= 2;
+        new_buf = realloc(ios->buf_out, new_size);
+        if (new_buf == NULL)
+            return false;
+        ios->buf_out  = new_buf;
+        ios->buf_size = new_size;
+    }
+    memcpy(ios->buf_out + ios->len_out, buf, size);
+    ios->len_out += size;
+    return true;
 }
 
 bool read_int8(IOStream *ios, int *i)
@@ -207,7 +1028,10 @@ bool read_int16(IOStream *ios, int *i)
     if (!read_data(ios, buf, sizeof(buf)))
         return false;
     if (i != NULL)
-        *i = ((signed char)buf[0] << 8) | buf[1];
+    {
+        uint32_t u = ((uint32_t)buf[0] << 8) | buf[1];
+        *i = (int)(u ^ 0x8000) - 0x8000;
+    }
     return true;
 }
 
@@ -217,7 +1041,10 @@ bool read_int24(IOStream *ios, int *i)
     if (!read_data(ios, buf, sizeof(buf)))
         return false;
     if (i != NULL)
-        *i = ((signed char)buf[0] << 16) | (buf[1] << 8) | buf[2];
+    {
+        uint32_t u = ((uint32_t)buf[0] << 16) | ((uint32_t)buf[1] << 8) | buf[2];
+        *i = (int)(u ^ 0x800000) - 0x800000;
+    }
     return true;
 }
 
@@ -228,8 +1055,8 @@ bool read_int32(IOStream *ios, int *i)
         return false;
     if (i != NULL)
     {
-        *i = ((signed char)buf[0] << 24) | (buf[1] << 16) |
-             (buf[2] << 8) | buf[3];
+        *i = (int32_t)( ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) |
+                        ((uint32_t)buf[2] << 8) | buf[3] );
     }
     return true;
 }
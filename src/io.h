@@ -2,16 +2,19 @@
 #define IO_H_INCLUDED
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 #ifdef WITH_LZMA
 #include "lzma/LzmaDec.h"
+#include "lzma/LzmaEnc.h"
 #endif
 
 typedef enum IOCompression {
     IOC_AUTO,       /* auto-detect a suitable (de)compression format */
     IOC_COPY,       /* copy bytes without (de)compression */
-    IOC_LZMA        /* use LZMA (de)compression */
+    IOC_LZMA,       /* use LZMA (de)compression */
+    IOC_LZMA_BLOCKS /* use LZMA on independently compressed blocks */
 } IOCompression;
 
 typedef enum IOMode {
@@ -20,33 +23,112 @@ typedef enum IOMode {
     IOM_WRONLY
 } IOMode;
 
+/* Default size of the input and output buffers of a stream (in bytes) */
+#define IOS_DEFAULT_BUFFER_SIZE 16384
+
+/* Maximum uncompressed size of a block of an IOC_LZMA_BLOCKS stream */
+#define IOS_BLOCK_SIZE (1<<18)
+
+/* Minimum buffer size (large enough to hold an LZMA stream header) */
+#define IOS_MIN_BUFFER_SIZE 64
+
 typedef struct IOStream
 {
     void            *fp;                /* underlying file handle */
     IOMode          iom;                /* access mode (read or write?) */
     IOCompression   ioc;                /* (de)compression */
 
-    int             pos_in,  len_in;    /* input buffer position/length */
-    int             pos_out, len_out;   /* output buffer position/length */
-    unsigned char   buf_in[512];        /* input buffer data */
-    unsigned char   buf_out[512];       /* output buffer data */
+    size_t          buf_size;           /* size of each buffer */
+    size_t          pos_in,  len_in;    /* input buffer position/length */
+    size_t          pos_out, len_out;   /* output buffer position/length */
+    unsigned char   *buf_in;            /* input buffer data */
+    unsigned char   *buf_out;           /* output buffer data */
+
+    unsigned char   *map;               /* memory-mapped file data (or NULL) */
+    size_t          map_size, map_pos;  /* size of/position in mapped data */
+    size_t          map_ready;          /* size of mapped data available */
+    bool            map_borrowed;       /* mapped data owned by the caller? */
+    struct BlockSet *blocks;            /* block decompression state (or NULL) */
+
+    bool            checksum;           /* compute checksum of data? */
+    uint32_t        crc;                /* CRC32C of data read/written */
 
 #ifdef WITH_LZMA
     ELzmaStatus     lzma_status;        /* LZMA (de/en)coder status */
     CLzmaDec        lzma_dec;           /* LZMA decoder */
+    CLzmaEncProps   lzma_props;         /* LZMA encoder properties */
+    ISeqOutStream   lzma_out;           /* LZMA encoder output callback */
 #endif
 } IOStream;
 
 
-/* Opening/closing IO streams */
+/* Opening/closing IO streams. ios_open() uses buffers of the default size;
+   ios_open_buffered() allows a different size to be specified, which is
+   raised to IOS_MIN_BUFFER_SIZE if necessary.
+
+   Output streams opened with IOC_LZMA keep all data written in memory, and
+   compress it when the stream is closed. ios_close() returns false if this
+   (or writing the result) fails.
+
+   IOC_LZMA_BLOCKS output is divided into blocks which are compressed
+   independently; a new block starts at each chunk of an IFF file, and large
+   chunks are split into blocks of IOS_BLOCK_SIZE bytes. When reading, such
+   files are detected automatically (with IOC_AUTO) and decompressed into
+   memory by a pool of worker threads (see WITH_THREADS) while the caller
+   consumes the data; read_data() and ios_view() wait only for the blocks
+   they need. */
 bool ios_open(IOStream *ios, const char *path, IOMode iom, IOCompression ioc);
+bool ios_open_buffered( IOStream *ios, const char *path, IOMode iom,
+                        IOCompression ioc, size_t buf_size );
 bool ios_eof(IOStream *ios);
-void ios_close(IOStream *ios);
+bool ios_close(IOStream *ios);
+
+/* Opens a stream for reading from `size' bytes of memory at `data', such as a
+   module linked into the executable (see WITH_EMBEDDED_MODULE in ali.c).
+   Uncompressed data is used in place as the stream's mapping, without
+   copying; like a mapped file, it may be modified by the module loader, so it
+   must be writable, and must remain valid for as long as the loaded module is
+   in use. ios_detach_map() returns false for such streams. Compressed data is
+   decompressed as usual (where fmemopen() is available). */
+bool ios_open_memory(IOStream *ios, void *data, size_t size);
+
+/* Selects the compression level (0-9, higher is slower but smaller) and
+   dictionary size (rounded up to a power of 2; 0 selects a size based on the
+   level) for an LZMA compressed output stream. Defaults to level 5. */
+void ios_set_compression(IOStream *ios, int level, size_t dict_size);
+
+/* Uncompressed files opened for reading are mapped into memory, if supported
+   by the platform (see WITH_MMAP). The mapping is private, so its contents may
+   be modified without affecting the underlying file. Block compressed files
+   are decompressed into a (modifiable) memory image, which is accessed in the
+   same way.
+
+   ios_view() returns a pointer to the next `size' bytes of the mapped data and
+   advances the stream past them. It returns NULL (without advancing) if the
+   stream is not mapped or fewer than `size' bytes remain. ios_peek() does the
+   same without advancing the stream.
+
+   ios_detach_map() transfers ownership of the mapping to the caller, who must
+   release it with ios_unmap() once all views into it are no longer in use.
+   Returns false if the stream is not mapped. The stream cannot be read after
+   its mapping has been detached. For block compressed files, this waits for
+   all blocks to be decompressed. */
+void *ios_view(IOStream *ios, size_t size);
+void *ios_peek(IOStream *ios, size_t size);
+bool ios_detach_map(IOStream *ios, void **addr, size_t *size);
+void ios_unmap(void *addr, size_t size);
+
+/* Checksums. After ios_begin_checksum(), a CRC32C (see crc32c.h) is computed
+   over all (uncompressed) data read from or written to the stream, including
+   data returned by ios_view(), until ios_end_checksum() returns it. */
+void ios_begin_checksum(IOStream *ios);
+uint32_t ios_end_checksum(IOStream *ios);
 
-/* Read binary data. */
+/* Read binary data. Buffered data is copied first; large reads then bypass
+   the stream's buffers and read (or decompress) directly into `buf'. */
 bool read_data(IOStream *ios, void *buf, size_t size);
 
-/* Write binary data. */
+/* Write binary data. Uncompressed output is not buffered. */
 bool write_data(IOStream *ios, const void *buf, size_t size);
 
 /* Reading integers in network byte order. */
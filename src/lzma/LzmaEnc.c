@@ -0,0 +1,704 @@
+/* LzmaEnc.c -- LZMA Encoder
+   Simple single-call encoder producing streams that LzmaDec can decode.
+
+   Matches are found with hash chains over 3-byte sequences, and chosen
+   greedily with one step of lazy evaluation (at higher levels). This gives
+   worse compression than an optimal parser, but is small and fast. */
+
+#include <string.h>
+
+#include "LzmaEnc.h"
+
+#define kNumTopBits 24
+#define kTopValue ((UInt32)1 << kNumTopBits)
+
+#define kNumBitModelTotalBits 11
+#define kBitModelTotal (1 << kNumBitModelTotalBits)
+#define kNumMoveBits 5
+#define kProbInitValue (kBitModelTotal >> 1)
+
+#define kNumMoveReducingBits 4
+#define kNumBitPriceShiftBits 4
+
+#define kNumStates 12
+#define kNumLitStates 7
+
+#define kNumPosBitsMax 4
+#define kNumPosStatesMax (1 << kNumPosBitsMax)
+
+#define kLenNumLowBits 3
+#define kLenNumLowSymbols (1 << kLenNumLowBits)
+#define kLenNumMidBits 3
+#define kLenNumMidSymbols (1 << kLenNumMidBits)
+#define kLenNumHighBits 8
+#define kLenNumHighSymbols (1 << kLenNumHighBits)
+
+#define kMatchMinLen 2
+#define kMatchMaxLen (kMatchMinLen + kLenNumLowSymbols + kLenNumMidSymbols + kLenNumHighSymbols - 1)
+
+#define kNumLenToPosStates 4
+#define kNumPosSlotBits 6
+#define kStartPosModelIndex 4
+#define kEndPosModelIndex 14
+#define kNumFullDistances (1 << (kEndPosModelIndex >> 1))
+#define kNumAlignBits 4
+#define kAlignTableSize (1 << kNumAlignBits)
+#define kAlignMask (kAlignTableSize - 1)
+
+#define LZMA_NUM_REPS 4
+#define LZMA_LIT_SIZE 0x300
+
+/* Matches of minimal length with distances beyond this cost more to encode
+   than the literals they replace. */
+#define kMaxShortMatchDist (1 << 14)
+
+#define kHashBytes 3
+#define kMaxHashBits 20
+
+#define RC_BUF_SIZE (1 << 16)
+
+typedef UInt16 CProb;
+
+typedef struct
+{
+  CProb choice;
+  CProb choice2;
+  CProb low[kNumPosStatesMax << kLenNumLowBits];
+  CProb mid[kNumPosStatesMax << kLenNumMidBits];
+  CProb high[kLenNumHighSymbols];
+} CLenEnc;
+
+typedef struct
+{
+  UInt32 range;
+  Byte cache;
+  UInt64 low;
+  UInt64 cacheSize;
+  Byte *buf;
+  size_t pos;
+  ISeqOutStream *outStream;
+  SRes res;
+} CRangeEnc;
+
+typedef struct
+{
+  const Byte *src;
+  UInt32 srcLen;
+
+  /* Match finder */
+  UInt32 *hash;      /* most recent position + 1 for each hash value (or 0) */
+  UInt32 *chain;     /* previous position + 1 with the same hash (or 0) */
+  UInt32 hashBits;
+  UInt32 windowMask; /* chain is indexed by position & windowMask */
+  UInt32 cutValue;   /* maximum number of chain entries to check */
+  UInt32 niceLen;    /* stop searching for matches at this length */
+  int lazy;
+
+  unsigned lc, lp, pb;
+  UInt32 lpMask, pbMask;
+
+  unsigned state;
+  UInt32 reps[LZMA_NUM_REPS];  /* recent match distances */
+
+  CProb *litProbs;
+  CProb isMatch[kNumStates][kNumPosStatesMax];
+  CProb isRep[kNumStates];
+  CProb isRepG0[kNumStates];
+  CProb isRepG1[kNumStates];
+  CProb isRepG2[kNumStates];
+  CProb isRep0Long[kNumStates][kNumPosStatesMax];
+  CProb posSlotEncoder[kNumLenToPosStates][1 << kNumPosSlotBits];
+  CProb posEncoders[kNumFullDistances - kEndPosModelIndex];
+  CProb posAlignEncoder[1 << kNumAlignBits];
+  CLenEnc lenEnc;
+  CLenEnc repLenEnc;
+
+  UInt32 ProbPrices[kBitModelTotal >> kNumMoveReducingBits];
+
+  CRangeEnc rc;
+} CLzmaEnc;
+
+#define GET_PRICE(prob, symbol) \
+  p->ProbPrices[((prob) ^ (((-(int)(symbol))) & (kBitModelTotal - 1))) >> kNumMoveReducingBits]
+
+void LzmaEncProps_Init(CLzmaEncProps *p)
+{
+  p->level = 5;
+  p->dictSize = 0;
+  p->lc = p->lp = p->pb = -1;
+}
+
+void LzmaEncProps_Normalize(CLzmaEncProps *p)
+{
+  int level = p->level;
+  UInt32 size;
+  if (level < 0) level = 5;
+  if (level > 9) level = 9;
+  p->level = level;
+  if (p->dictSize == 0)
+    p->dictSize = (level <= 5 ? ((UInt32)1 << (level * 2 + 14)) :
+        (level == 6 ? ((UInt32)1 << 25) : ((UInt32)1 << 26)));
+  if (p->dictSize > ((UInt32)1 << 27))
+    p->dictSize = (UInt32)1 << 27;
+  for (size = (UInt32)1 << 12; size < p->dictSize; size <<= 1);
+  p->dictSize = size;
+  if (p->lc < 0) p->lc = 3;
+  if (p->lp < 0) p->lp = 0;
+  if (p->pb < 0) p->pb = 2;
+}
+
+void LzmaEncProps_Encode(const CLzmaEncProps *p, Byte *props)
+{
+  int i;
+  props[0] = (Byte)((p->pb * 5 + p->lp) * 9 + p->lc);
+  for (i = 0; i < 4; i++)
+    props[1 + i] = (Byte)(p->dictSize >> (8 * i));
+}
+
+/* ---------- Range Encoder ---------- */
+
+static void RangeEnc_Init(CRangeEnc *p)
+{
+  p->low = 0;
+  p->range = 0xFFFFFFFF;
+  p->cacheSize = 1;
+  p->cache = 0;
+  p->pos = 0;
+  p->res = SZ_OK;
+}
+
+static void RangeEnc_FlushStream(CRangeEnc *p)
+{
+  if (p->res == SZ_OK && p->outStream->Write(p->outStream, p->buf, p->pos) != p->pos)
+    p->res = SZ_ERROR_WRITE;
+  p->pos = 0;
+}
+
+static void RangeEnc_ShiftLow(CRangeEnc *p)
+{
+  if ((UInt32)p->low < (UInt32)0xFF000000 || (int)(p->low >> 32) != 0)
+  {
+    Byte temp = p->cache;
+    do
+    {
+      p->buf[p->pos++] = (Byte)(temp + (Byte)(p->low >> 32));
+      if (p->pos == RC_BUF_SIZE)
+        RangeEnc_FlushStream(p);
+      temp = 0xFF;
+    }
+    while (--p->cacheSize != 0);
+    p->cache = (Byte)((UInt32)p->low >> 24);
+  }
+  p->cacheSize++;
+  p->low = (UInt32)p->low << 8;
+}
+
+static void RangeEnc_FlushData(CRangeEnc *p)
+{
+  int i;
+  for (i = 0; i < 5; i++)
+    RangeEnc_ShiftLow(p);
+  RangeEnc_FlushStream(p);
+}
+
+static void RangeEnc_EncodeDirectBits(CRangeEnc *p, UInt32 value, int numBits)
+{
+  do
+  {
+    p->range >>= 1;
+    p->low += p->range & (0 - ((value >> --numBits) & 1));
+    if (p->range < kTopValue)
+    {
+      p->range <<= 8;
+      RangeEnc_ShiftLow(p);
+    }
+  }
+  while (numBits != 0);
+}
+
+static void RangeEnc_EncodeBit(CRangeEnc *p, CProb *prob, UInt32 symbol)
+{
+  UInt32 ttt = *prob;
+  UInt32 newBound = (p->range >> kNumBitModelTotalBits) * ttt;
+  if (symbol == 0)
+  {
+    p->range = newBound;
+    ttt += (kBitModelTotal - ttt) >> kNumMoveBits;
+  }
+  else
+  {
+    p->low += newBound;
+    p->range -= newBound;
+    ttt -= ttt >> kNumMoveBits;
+  }
+  *prob = (CProb)ttt;
+  if (p->range < kTopValue)
+  {
+    p->range <<= 8;
+    RangeEnc_ShiftLow(p);
+  }
+}
+
+static void RcTree_Encode(CRangeEnc *rc, CProb *probs, int numBitLevels, UInt32 symbol)
+{
+  UInt32 m = 1;
+  int i;
+  for (i = numBitLevels; i != 0;)
+  {
+    UInt32 bit;
+    i--;
+    bit = (symbol >> i) & 1;
+    RangeEnc_EncodeBit(rc, probs + m, bit);
+    m = (m << 1) | bit;
+  }
+}
+
+static void RcTree_ReverseEncode(CRangeEnc *rc, CProb *probs, int numBitLevels, UInt32 symbol)
+{
+  UInt32 m = 1;
+  int i;
+  for (i = 0; i < numBitLevels; i++)
+  {
+    UInt32 bit = symbol & 1;
+    RangeEnc_EncodeBit(rc, probs + m, bit);
+    m = (m << 1) | bit;
+    symbol >>= 1;
+  }
+}
+
+/* Encodes a literal. For matched literals (after a match), offs is 0x100 and
+   matchByte is the byte at distance rep0; otherwise offs is 0. */
+static void LitEnc_Encode(CRangeEnc *p, CProb *probs, UInt32 symbol, UInt32 matchByte, UInt32 offs)
+{
+  symbol |= 0x100;
+  do
+  {
+    matchByte <<= 1;
+    RangeEnc_EncodeBit(p, probs + (offs + (matchByte & offs) + (symbol >> 8)), (symbol >> 7) & 1);
+    symbol <<= 1;
+    offs &= ~(matchByte ^ symbol);
+  }
+  while (symbol < 0x10000);
+}
+
+static void LenEnc_Encode(CLenEnc *p, CRangeEnc *rc, UInt32 symbol, UInt32 posState)
+{
+  if (symbol < kLenNumLowSymbols)
+  {
+    RangeEnc_EncodeBit(rc, &p->choice, 0);
+    RcTree_Encode(rc, p->low + (posState << kLenNumLowBits), kLenNumLowBits, symbol);
+  }
+  else
+  {
+    RangeEnc_EncodeBit(rc, &p->choice, 1);
+    if (symbol < kLenNumLowSymbols + kLenNumMidSymbols)
+    {
+      RangeEnc_EncodeBit(rc, &p->choice2, 0);
+      RcTree_Encode(rc, p->mid + (posState << kLenNumMidBits), kLenNumMidBits, symbol - kLenNumLowSymbols);
+    }
+    else
+    {
+      RangeEnc_EncodeBit(rc, &p->choice2, 1);
+      RcTree_Encode(rc, p->high, kLenNumHighBits, symbol - kLenNumLowSymbols - kLenNumMidSymbols);
+    }
+  }
+}
+
+/* ---------- Prices ---------- */
+
+static void LzmaEnc_InitPriceTables(UInt32 *ProbPrices)
+{
+  UInt32 i;
+  for (i = (1 << kNumMoveReducingBits) / 2; i < kBitModelTotal; i += (1 << kNumMoveReducingBits))
+  {
+    const int kCyclesBits = kNumBitPriceShiftBits;
+    UInt32 w = i;
+    UInt32 bitCount = 0;
+    int j;
+    for (j = 0; j < kCyclesBits; j++)
+    {
+      w = w * w;
+      bitCount <<= 1;
+      while (w >= ((UInt32)1 << 16))
+      {
+        w >>= 1;
+        bitCount++;
+      }
+    }
+    ProbPrices[i >> kNumMoveReducingBits] = ((kNumBitModelTotalBits << kCyclesBits) - 15 - bitCount);
+  }
+}
+
+static UInt32 LitEnc_GetPrice(const CLzmaEnc *p, const CProb *probs, UInt32 symbol, UInt32 matchByte, UInt32 offs)
+{
+  UInt32 price = 0;
+  symbol |= 0x100;
+  do
+  {
+    matchByte <<= 1;
+    price += GET_PRICE(probs[offs + (matchByte & offs) + (symbol >> 8)], (symbol >> 7) & 1);
+    symbol <<= 1;
+    offs &= ~(matchByte ^ symbol);
+  }
+  while (symbol < 0x10000);
+  return price;
+}
+
+/* ---------- Match Finder ---------- */
+
+static UInt32 MatchFinder_Hash(const CLzmaEnc *p, const Byte *cur)
+{
+  UInt32 v = ((UInt32)cur[0] << 16) | ((UInt32)cur[1] << 8) | cur[2];
+  return (v * 2654435761U) >> (32 - p->hashBits);
+}
+
+static void MatchFinder_Insert(CLzmaEnc *p, UInt32 pos)
+{
+  if (pos + kHashBytes <= p->srcLen)
+  {
+    UInt32 h = MatchFinder_Hash(p, p->src + pos);
+    p->chain[pos & p->windowMask] = p->hash[h];
+    p->hash[h] = pos + 1;
+  }
+}
+
+static UInt32 GetMatchLen(const Byte *a, const Byte *b, UInt32 limit)
+{
+  UInt32 len = 0;
+  while (len < limit && a[len] == b[len])
+    len++;
+  return len;
+}
+
+/* Finds the longest earlier match (of at least kHashBytes bytes) for the
+   data at pos. Must be called before pos is inserted. */
+static UInt32 MatchFinder_Find(const CLzmaEnc *p, UInt32 pos, UInt32 avail, UInt32 *back)
+{
+  const Byte *cur = p->src + pos;
+  UInt32 bestLen = 0, cutValue = p->cutValue, next;
+
+  if (avail < kHashBytes)
+    return 0;
+
+  next = p->hash[MatchFinder_Hash(p, cur)];
+  while (next != 0 && cutValue-- != 0)
+  {
+    UInt32 cand = next - 1, dist = pos - cand;
+    if (dist > p->windowMask)
+      break;
+    if (cur[bestLen] == p->src[cand + bestLen])
+    {
+      UInt32 len = GetMatchLen(cur, p->src + cand, avail);
+      if (len > bestLen)
+      {
+        bestLen = len;
+        *back = dist;
+        if (len >= p->niceLen || len == avail)
+          break;
+      }
+    }
+    next = p->chain[cand & p->windowMask];
+    if (next - 1 >= cand)
+      break;  /* entry was overwritten by a more recent position */
+  }
+
+  if (bestLen < kHashBytes || (bestLen == kHashBytes && *back > kMaxShortMatchDist))
+    return 0;
+  return bestLen;
+}
+
+/* ---------- Encoder ---------- */
+
+static void LzmaEnc_Init(CLzmaEnc *p)
+{
+  UInt32 i, j;
+  UInt32 numLitProbs = (UInt32)LZMA_LIT_SIZE << (p->lc + p->lp);
+  CProb *probs[] = {
+    p->isRep, p->isRepG0, p->isRepG1, p->isRepG2, p->posEncoders, p->posAlignEncoder };
+  UInt32 sizes[] = {
+    kNumStates, kNumStates, kNumStates, kNumStates,
+    kNumFullDistances - kEndPosModelIndex, 1 << kNumAlignBits };
+
+  p->state = 0;
+  for (i = 0; i < LZMA_NUM_REPS; i++)
+    p->reps[i] = 1;
+  for (i = 0; i < numLitProbs; i++)
+    p->litProbs[i] = kProbInitValue;
+  for (i = 0; i < kNumStates; i++)
+    for (j = 0; j < kNumPosStatesMax; j++)
+      p->isMatch[i][j] = p->isRep0Long[i][j] = kProbInitValue;
+  for (i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++)
+    for (j = 0; j < sizes[i]; j++)
+      probs[i][j] = kProbInitValue;
+  for (i = 0; i < kNumLenToPosStates; i++)
+    for (j = 0; j < (1 << kNumPosSlotBits); j++)
+      p->posSlotEncoder[i][j] = kProbInitValue;
+  {
+    CProb *len = (CProb *)&p->lenEnc, *repLen = (CProb *)&p->repLenEnc;
+    for (i = 0; i < sizeof(CLenEnc) / sizeof(CProb); i++)
+      len[i] = repLen[i] = kProbInitValue;
+  }
+  LzmaEnc_InitPriceTables(p->ProbPrices);
+  RangeEnc_Init(&p->rc);
+}
+
+static UInt32 GetPosSlot(UInt32 dist)
+{
+  UInt32 i;
+  if (dist < kStartPosModelIndex)
+    return dist;
+  for (i = 31; (dist >> i) == 0; i--);
+  return (i << 1) | ((dist >> (i - 1)) & 1);
+}
+
+static CProb *LzmaEnc_LitProbs(CLzmaEnc *p, UInt32 pos)
+{
+  UInt32 prevByte = (pos > 0 ? p->src[pos - 1] : 0);
+  return p->litProbs + LZMA_LIT_SIZE * (((pos & p->lpMask) << p->lc) + (prevByte >> (8 - p->lc)));
+}
+
+static void LzmaEnc_EncodeLiteral(CLzmaEnc *p, UInt32 pos)
+{
+  UInt32 posState = pos & p->pbMask;
+  RangeEnc_EncodeBit(&p->rc, &p->isMatch[p->state][posState], 0);
+  if (p->state < kNumLitStates)
+    LitEnc_Encode(&p->rc, LzmaEnc_LitProbs(p, pos), p->src[pos], 0, 0);
+  else
+    LitEnc_Encode(&p->rc, LzmaEnc_LitProbs(p, pos), p->src[pos], p->src[pos - p->reps[0]], 0x100);
+  p->state = (p->state < 4 ? 0 : (p->state < 10 ? p->state - 3 : p->state - 6));
+}
+
+/* Encodes a match with the given distance (back - 1) and length. */
+static void LzmaEnc_EncodeMatch(CLzmaEnc *p, UInt32 pos, UInt32 dist, UInt32 len)
+{
+  UInt32 posState = pos & p->pbMask;
+  UInt32 posSlot = GetPosSlot(dist);
+  UInt32 lenToPosState = len - kMatchMinLen;
+  if (lenToPosState >= kNumLenToPosStates)
+    lenToPosState = kNumLenToPosStates - 1;
+
+  RangeEnc_EncodeBit(&p->rc, &p->isMatch[p->state][posState], 1);
+  RangeEnc_EncodeBit(&p->rc, &p->isRep[p->state], 0);
+  p->state = (p->state < kNumLitStates ? 7 : 10);
+  LenEnc_Encode(&p->lenEnc, &p->rc, len - kMatchMinLen, posState);
+  RcTree_Encode(&p->rc, p->posSlotEncoder[lenToPosState], kNumPosSlotBits, posSlot);
+  if (posSlot >= kStartPosModelIndex)
+  {
+    UInt32 footerBits = ((posSlot >> 1) - 1);
+    UInt32 base = ((2 | (posSlot & 1)) << footerBits);
+    UInt32 posReduced = dist - base;
+    if (posSlot < kEndPosModelIndex)
+      RcTree_ReverseEncode(&p->rc, p->posEncoders + base - posSlot - 1, footerBits, posReduced);
+    else
+    {
+      RangeEnc_EncodeDirectBits(&p->rc, posReduced >> kNumAlignBits, footerBits - kNumAlignBits);
+      RcTree_ReverseEncode(&p->rc, p->posAlignEncoder, kNumAlignBits, posReduced & kAlignMask);
+    }
+  }
+  p->reps[3] = p->reps[2];
+  p->reps[2] = p->reps[1];
+  p->reps[1] = p->reps[0];
+  p->reps[0] = dist + 1;
+}
+
+/* Encodes a match at recent distance reps[repIndex] (len == 1 encodes a
+   "short rep" of a single byte at distance reps[0]). */
+static void LzmaEnc_EncodeRep(CLzmaEnc *p, UInt32 pos, UInt32 repIndex, UInt32 len)
+{
+  UInt32 posState = pos & p->pbMask;
+  RangeEnc_EncodeBit(&p->rc, &p->isMatch[p->state][posState], 1);
+  RangeEnc_EncodeBit(&p->rc, &p->isRep[p->state], 1);
+  if (repIndex == 0)
+  {
+    RangeEnc_EncodeBit(&p->rc, &p->isRepG0[p->state], 0);
+    RangeEnc_EncodeBit(&p->rc, &p->isRep0Long[p->state][posState], (len == 1) ? 0 : 1);
+  }
+  else
+  {
+    UInt32 distance = p->reps[repIndex];
+    RangeEnc_EncodeBit(&p->rc, &p->isRepG0[p->state], 1);
+    if (repIndex == 1)
+      RangeEnc_EncodeBit(&p->rc, &p->isRepG1[p->state], 0);
+    else
+    {
+      RangeEnc_EncodeBit(&p->rc, &p->isRepG1[p->state], 1);
+      RangeEnc_EncodeBit(&p->rc, &p->isRepG2[p->state], repIndex - 2);
+      if (repIndex == 3)
+        p->reps[3] = p->reps[2];
+      p->reps[2] = p->reps[1];
+    }
+    p->reps[1] = p->reps[0];
+    p->reps[0] = distance;
+  }
+  if (len == 1)
+    p->state = (p->state < kNumLitStates ? 9 : 11);
+  else
+  {
+    LenEnc_Encode(&p->repLenEnc, &p->rc, len - kMatchMinLen, posState);
+    p->state = (p->state < kNumLitStates ? 8 : 11);
+  }
+}
+
+/* Encodes a single byte, as a literal or as a short rep, whichever is
+   cheaper. */
+static void LzmaEnc_EncodeByte(CLzmaEnc *p, UInt32 pos)
+{
+  UInt32 posState = pos & p->pbMask;
+  if (pos >= p->reps[0] && p->src[pos] == p->src[pos - p->reps[0]])
+  {
+    UInt32 offs = (p->state < kNumLitStates ? 0 : 0x100);
+    UInt32 litPrice = GET_PRICE(p->isMatch[p->state][posState], 0);
+    UInt32 repPrice = GET_PRICE(p->isMatch[p->state][posState], 1);
+    litPrice += LitEnc_GetPrice(p, LzmaEnc_LitProbs(p, pos), p->src[pos], p->src[pos - p->reps[0]], offs);
+    repPrice += GET_PRICE(p->isRep[p->state], 1);
+    repPrice += GET_PRICE(p->isRepG0[p->state], 0);
+    repPrice += GET_PRICE(p->isRep0Long[p->state][posState], 0);
+    if (repPrice < litPrice)
+    {
+      LzmaEnc_EncodeRep(p, pos, 0, 1);
+      return;
+    }
+  }
+  LzmaEnc_EncodeLiteral(p, pos);
+}
+
+static void LzmaEnc_Encode(CLzmaEnc *p)
+{
+  UInt32 pos = 0, nextLen = 0, nextBack = 0, i;
+  int haveNext = 0;
+
+  while (pos < p->srcLen)
+  {
+    UInt32 avail = p->srcLen - pos, mainLen, mainBack = 0, repLen = 0, repIndex = 0;
+    if (avail > kMatchMaxLen)
+      avail = kMatchMaxLen;
+
+    if (pos == 0)
+    {
+      LzmaEnc_EncodeLiteral(p, pos);
+      MatchFinder_Insert(p, pos++);
+      continue;
+    }
+
+    /* Longest match at one of the recent distances */
+    for (i = 0; i < LZMA_NUM_REPS; i++)
+    {
+      if (p->reps[i] <= pos)
+      {
+        UInt32 len = GetMatchLen(p->src + pos, p->src + pos - p->reps[i], avail);
+        if (len > repLen)
+        {
+          repLen = len;
+          repIndex = i;
+        }
+      }
+    }
+
+    /* Longest match at any distance */
+    if (haveNext)
+    {
+      mainLen = nextLen;
+      mainBack = nextBack;
+      haveNext = 0;
+    }
+    else
+    {
+      mainLen = MatchFinder_Find(p, pos, avail, &mainBack);
+      MatchFinder_Insert(p, pos);
+    }
+
+    if (repLen >= kMatchMinLen && repLen + 1 >= mainLen)
+    {
+      LzmaEnc_EncodeRep(p, pos, repIndex, repLen);
+      for (i = 1; i < repLen; i++)
+        MatchFinder_Insert(p, pos + i);
+      pos += repLen;
+      continue;
+    }
+
+    if (mainLen != 0)
+    {
+      /* Lazy evaluation: prefer a longer match at the next position */
+      if (p->lazy && mainLen < p->niceLen && pos + 1 < p->srcLen)
+      {
+        UInt32 nextAvail = p->srcLen - pos - 1;
+        if (nextAvail > kMatchMaxLen)
+          nextAvail = kMatchMaxLen;
+        nextLen = MatchFinder_Find(p, pos + 1, nextAvail, &nextBack);
+        MatchFinder_Insert(p, pos + 1);
+        haveNext = 1;
+        if (nextLen > mainLen)
+        {
+          LzmaEnc_EncodeByte(p, pos++);
+          continue;
+        }
+      }
+      LzmaEnc_EncodeMatch(p, pos, mainBack - 1, mainLen);
+      for (i = (haveNext ? 2 : 1); i < mainLen; i++)
+        MatchFinder_Insert(p, pos + i);
+      haveNext = 0;
+      pos += mainLen;
+      continue;
+    }
+
+    LzmaEnc_EncodeByte(p, pos++);
+  }
+
+  /* End marker */
+  LzmaEnc_EncodeMatch(p, pos, 0xFFFFFFFF, kMatchMinLen);
+  RangeEnc_FlushData(&p->rc);
+}
+
+SRes LzmaEncode(ISeqOutStream *outStream, const Byte *src, SizeT srcLen,
+    const CLzmaEncProps *props, ISzAlloc *alloc)
+{
+  CLzmaEncProps pr = *props;
+  CLzmaEnc *p;
+  UInt32 windowSize, hashBits;
+  SRes res;
+
+  LzmaEncProps_Normalize(&pr);
+  if (pr.lc > 8 || pr.lp > 4 || pr.pb > 4 || srcLen >= ((SizeT)1 << 31))
+    return SZ_ERROR_PARAM;
+
+  for (windowSize = 1; windowSize < pr.dictSize && windowSize < srcLen; windowSize <<= 1);
+  for (hashBits = 8; hashBits < kMaxHashBits && ((SizeT)1 << hashBits) < srcLen; hashBits++);
+
+  p = (CLzmaEnc *)alloc->Alloc(alloc, sizeof(CLzmaEnc));
+  if (p == 0)
+    return SZ_ERROR_MEM;
+  p->src = src;
+  p->srcLen = (UInt32)srcLen;
+  p->hashBits = hashBits;
+  p->windowMask = windowSize - 1;
+  p->cutValue = (UInt32)4 << pr.level;
+  p->niceLen = (pr.level < 5 ? 32 : (pr.level < 8 ? 64 : kMatchMaxLen));
+  p->lazy = (pr.level >= 2);
+  p->lc = pr.lc;
+  p->lp = pr.lp;
+  p->pb = pr.pb;
+  p->lpMask = ((UInt32)1 << pr.lp) - 1;
+  p->pbMask = ((UInt32)1 << pr.pb) - 1;
+  p->rc.outStream = outStream;
+  p->hash = (UInt32 *)alloc->Alloc(alloc, sizeof(UInt32) << hashBits);
+  p->chain = (UInt32 *)alloc->Alloc(alloc, sizeof(UInt32) * windowSize);
+  p->litProbs = (CProb *)alloc->Alloc(alloc, (sizeof(CProb) * LZMA_LIT_SIZE) << (pr.lc + pr.lp));
+  p->rc.buf = (Byte *)alloc->Alloc(alloc, RC_BUF_SIZE);
+
+  if (p->hash == 0 || p->chain == 0 || p->litProbs == 0 || p->rc.buf == 0)
+    res = SZ_ERROR_MEM;
+  else
+  {
+    memset(p->hash, 0, sizeof(UInt32) << hashBits);
+    LzmaEnc_Init(p);
+    LzmaEnc_Encode(p);
+    res = p->rc.res;
+  }
+
+  alloc->Free(alloc, p->hash);
+  alloc->Free(alloc, p->chain);
+  alloc->Free(alloc, p->litProbs);
+  alloc->Free(alloc, p->rc.buf);
+  alloc->Free(alloc, p);
+  return res;
+}
@@ -0,0 +1,42 @@
+/* LzmaEnc.h -- LZMA Encoder
+   Simple single-call encoder producing streams that LzmaDec can decode. */
+
+#ifndef __LZMAENC_H
+#define __LZMAENC_H
+
+#include "Types.h"
+
+#define LZMA_PROPS_SIZE 5
+
+typedef struct _CLzmaEncProps
+{
+  int level;       /*  0 <= level <= 9, default = 5 */
+  UInt32 dictSize; /* (1 << 12) <= dictSize <= (1 << 27); rounded up to a power of 2
+                      default = (1 << 24); 0 selects a size based on level */
+  int lc;          /* 0 <= lc <= 8, default = 3 */
+  int lp;          /* 0 <= lp <= 4, default = 0 */
+  int pb;          /* 0 <= pb <= 4, default = 2 */
+} CLzmaEncProps;
+
+void LzmaEncProps_Init(CLzmaEncProps *p);
+void LzmaEncProps_Normalize(CLzmaEncProps *p);
+
+/* LzmaEncProps_Encode - writes the LZMA_PROPS_SIZE bytes of properties that
+   LzmaDec_Allocate expects for streams encoded with the (normalized) props. */
+
+void LzmaEncProps_Encode(const CLzmaEncProps *p, Byte *props);
+
+/* LzmaEncode - encodes src[0..srcLen) as a single LZMA stream followed by an
+   end marker, and writes it to outStream (the properties are not written).
+   Higher levels search harder for matches, making encoding slower.
+Returns:
+  SZ_OK           - OK
+  SZ_ERROR_MEM    - Memory allocation error
+  SZ_ERROR_PARAM  - Incorrect parameter
+  SZ_ERROR_WRITE  - Write callback error
+*/
+
+SRes LzmaEncode(ISeqOutStream *outStream, const Byte *src, SizeT srcLen,
+    const CLzmaEncProps *props, ISzAlloc *alloc);
+
+#endif
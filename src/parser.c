@@ -152,3 +152,109 @@ bool parse_dumb(const GrammarRuleSet *grammar,
 {
     return match_symbol(grammar, symref, tokens, tokens + ntoken);
 }
+
+/* A sequence of symbols that remains to be matched against the tokens up to
+   `end', followed by the sequences in `next'. */
+typedef struct PendingRefs
+{
+    const SymbolRef             *refs;
+    size_t                      nref;
+    const int                   *end;
+    const struct PendingRefs    *next;
+} PendingRefs;
+
+/* State of parse_captures() */
+typedef struct CaptureParse
+{
+    const GrammarRuleSet    *grammar;
+    const CaptureIndex      *index;
+    int                     *captures;
+    int                     ncapture, max_captures;
+    CaptureCallback         callback;
+    void                    *arg;
+} CaptureParse;
+
+/* Matches refs[0..nref) against [i, j) and then the pending sequences,
+   reporting each complete parse. */
+static void parse_refs( CaptureParse *cp, const SymbolRef *refs, size_t nref,
+                        const int *i, const int *j, const PendingRefs *next )
+{
+    if (nref == 0)
+    {
+        if (i != j)
+            return;
+        if (next == NULL)
+            cp->callback(cp->arg, cp->captures, cp->ncapture);
+        else
+            parse_refs(cp, next->refs, next->nref, j, next->end, next->next);
+        return;
+    }
+
+    const SymbolRef *sym = &refs[0];
+    const int *k;
+
+    if (sym->type == SYM_TERMINAL)
+    {
+        if (i < j && *i == sym->index)
+            parse_refs(cp, refs + 1, nref - 1, i + 1, j, next);
+        return;
+    }
+
+    if (sym->type != SYM_NONTERMINAL)
+        return;
+
+    /* The last symbol of a sequence must match the remaining tokens */
+    for (k = (nref == 1) ? j : i; k <= j; ++k)
+    {
+        if (!cp->index->has_capture[sym->index])
+        {
+            if (match_symbol(cp->grammar, sym, i, k))
+                parse_refs(cp, refs + 1, nref - 1, k, j, next);
+            continue;
+        }
+
+        const GrammarRuleSet *rules = cp->grammar + sym->index;
+        PendingRefs rest = { refs + 1, nref - 1, j, next };
+        size_t r;
+        if (sym->index == cp->index->symbol)
+        {
+            /* Only try rules that can end with the last token */
+            const int *first, *last;
+            if (k == i)
+            {
+                first = cp->index->nullable_rules;
+                last  = first + cp->index->nnullable;
+            }
+            else
+            {
+                first = cp->index->last_rules + cp->index->last_start[k[-1]];
+                last  = cp->index->last_rules + cp->index->last_start[k[-1] + 1];
+            }
+            if (cp->ncapture == cp->max_captures)
+                continue;
+            for ( ; first < last; ++first)
+            {
+                const SymbolRefList *rule = rules->rules[*first];
+                cp->captures[cp->ncapture++] = *first;
+                parse_refs(cp, rule->refs, rule->nref, i, k, &rest);
+                --cp->ncapture;
+            }
+        }
+        else
+        {
+            for (r = 0; r < rules->nrule; ++r)
+                parse_refs( cp, rules->rules[r]->refs, rules->rules[r]->nref,
+                            i, k, &rest );
+        }
+    }
+}
+
+void parse_captures( const GrammarRuleSet *grammar, const CaptureIndex *index,
+                     const int *tokens, int ntoken, const SymbolRef *symref,
+                     int *captures, int max_captures,
+                     CaptureCallback callback, void *arg )
+{
+    CaptureParse cp = { grammar, index, captures, 0,
+                        max_captures, callback, arg };
+    parse_refs(&cp, symref, 1, tokens, tokens + ntoken, NULL);
+}
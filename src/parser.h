@@ -52,4 +52,33 @@ void ruleset_sort(GrammarRuleSet *ruleset);
 bool parse_dumb(const GrammarRuleSet *grammar,
                 const int *tokens, int ntoken, const SymbolRef *symref);
 
+/* Called by parse_captures() for each way the tokens can be parsed, with the
+   index of the rule used to derive each occurrence of the capture symbol (in
+   order of occurrence). */
+typedef void (*CaptureCallback)(void *arg, const int *captures, int ncapture);
+
+/* Describes a capture symbol for parse_captures(), with its rules indexed by
+   the last token they can match, so that only a few rules need to be tried
+   for each occurrence. */
+typedef struct CaptureIndex
+{
+    int         symbol;         /* the capture symbol */
+    bool        *has_capture;   /* per symbol: can derive the capture symbol */
+    int         *last_start;    /* per token: offset into last_rules */
+    int         *last_rules;    /* rule indices, grouped by last token */
+    int         nnullable;
+    int         *nullable_rules;/* rules matching the empty string */
+} CaptureIndex;
+
+/* Like parse_dumb(), but enumerates all parse trees, and reports which rules
+   were used to derive the capture symbol in each of them. Parse trees with
+   more than `max_captures' occurrences of the capture symbol are ignored.
+   `captures' must have room for `max_captures' elements; it is used to pass
+   captures to the callback. Note that the same captures may be reported more
+   than once if the grammar is ambiguous. */
+void parse_captures( const GrammarRuleSet *grammar, const CaptureIndex *index,
+                     const int *tokens, int ntoken, const SymbolRef *symref,
+                     int *captures, int max_captures,
+                     CaptureCallback callback, void *arg );
+
 #endif /* ndef PARSER_H_INCLUDED */
@@ -0,0 +1,958 @@
+#include "savegame.h"
+#include "crc32c.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef WITH_LZMA
+#include "lzma/LzmaDec.h"
+#include "lzma/LzmaEnc.h"
+#endif
+
+#ifdef WITH_MMAP
+#include <sys/mman.h>
+#endif
+
+#ifdef WITH_THREADS
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#endif
+
+/* Saved game file format (all integers are big-endian):
+
+   Snapshot header (HEADER_SIZE bytes):
+      0  magic "ALIS"
+      4  version (1 byte; SAVE_VERSION)
+      5  flags (1 byte; SAVE_LZMA)
+      6  reserved (2 bytes; zero)
+      8  module hash (8 bytes; see hash_module())
+     16  number of variables
+     20  number of the last turn included
+     24  size of the snapshot data as stored
+     28  size of the (uncompressed) snapshot data
+     32  CRC-32C of the preceding header fields and the stored data
+
+   The snapshot data lists the variables that are not nil, in order of
+   increasing index. Each is stored as two varints: the number of nil
+   variables preceding it (since the previous one listed), and its value.
+   If SAVE_LZMA is set, the stored data consists of the LZMA properties
+   (LZMA_PROPS_SIZE bytes) followed by the compressed data.
+
+   Journal entries follow the snapshot. Each has a header of three integers
+   (the size of its data, the turn number, and the CRC-32C of the size, turn
+   and data), followed by data listing pairs of varints for the variables
+   changed during the turn: the difference between the variable's index and
+   the index following the previous variable's (signed), and its value.
+
+   Varints are stored in little-endian groups of 7 bits, with the high bit
+   set in every byte except the last. Signed numbers are zigzag-encoded
+   (0, -1, 1, -2, ... as 0, 1, 2, 3, ...) first.
+
+   Native snapshots, as written by map_save_file(), have a different header
+   (NATIVE_HEADER_SIZE bytes):
+      0  magic "ALIN"
+      4  version (1 byte; SAVE_VERSION)
+      5  reserved (3 bytes; zero)
+      8  module hash (8 bytes)
+     16  number of variables
+     20  offset of the values (a multiple of the page size)
+   followed by padding, and the values of all variables in the host's native
+   format, which are mapped into memory. Files written before native
+   snapshots had a header consist of the values only; these are accepted if
+   their size matches the number of variables, but cannot be checked against
+   the module. */
+
+#define SAVE_MAGIC          "ALIS"
+#define NATIVE_MAGIC        "ALIN"
+#define SAVE_VERSION        1
+#define SAVE_LZMA           1       /* snapshot data is LZMA compressed */
+
+#define HEADER_SIZE         36
+#define ENTRY_HEADER_SIZE   12
+#define NATIVE_HEADER_SIZE  24
+
+/* Maximum size of a (32-bit) varint */
+#define MAX_VARINT_SIZE     5
+
+/* The journal is folded into a new snapshot once it is larger than both the
+   snapshot and this size (in bytes). */
+#define MIN_JOURNAL_SIZE    65536
+
+/* The changes made during a turn, waiting to be written. */
+typedef struct Delta
+{
+    struct Delta    *next;          /* next delta in queue */
+    int             turn;           /* turn number */
+    int             count;          /* number of changed variables */
+    Value           pairs[1];       /* (index, value) pairs (2*count) */
+} Delta;
+
+struct SaveFile
+{
+    char        *path;              /* path to saved game file */
+    int         fd;                 /* file descriptor */
+    int         nval;               /* number of variables */
+    uint64_t    hash;               /* module hash */
+    Value       *state;             /* variables as written to the file */
+    bool        created;            /* was the file newly created? */
+    bool        have_snapshot;      /* is there a snapshot to journal to? */
+    bool        compress;           /* compress snapshots? */
+    size_t      snapshot_size;      /* size of the snapshot (in bytes) */
+    size_t      journal_size;       /* size of the journal (in bytes) */
+    int         turn;               /* number of the last turn saved */
+    int         durable;            /* number of the last turn written */
+    int         failed;             /* set when writing fails */
+    int         window;             /* commit window (in milliseconds) */
+    Delta       *queue;             /* deltas to be written (newest first) */
+    Value       *map;               /* shared mapping of snapshot (or NULL) */
+    size_t      map_offset;         /* offset of values in native snapshot */
+    bool        sync;               /* sync mapping after each turn? */
+#ifdef WITH_THREADS
+    bool        running;            /* is the writer thread running? */
+    bool        closing;            /* should the writer thread stop? */
+    pthread_t       thread;
+    pthread_mutex_t lock;           /* protects `closing' */
+    pthread_cond_t  cond;           /* signalled when deltas are queued */
+#endif
+};
+
+static void put_uint32(unsigned char *p, uint32_t i)
+{
+    p[0] = (i >> 24)&255;
+    p[1] = (i >> 16)&255;
+    p[2] = (i >>  8)&255;
+    p[3] = (i >>  0)&255;
+}
+
+static uint32_t get_uint32(const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static unsigned char *put_varint(unsigned char *p, uint32_t i)
+{
+    while (i >= 0x80)
+    {
+        *p++ = (unsigned char)(i | 0x80);
+        i >>= 7;
+    }
+    *p++ = (unsigned char)i;
+    return p;
+}
+
+/* Reads a varint from `p' (which must lie before `end'). Returns a pointer
+   past it, or NULL if it is not valid. */
+static const unsigned char *get_varint( const unsigned char *p,
+                                        const unsigned char *end,
+                                        uint32_t *i )
+{
+    uint32_t res = 0;
+    int shift;
+
+    for (shift = 0; p < end && shift < 7*MAX_VARINT_SIZE; shift += 7)
+    {
+        res |= (uint32_t)(*p & 0x7f) << shift;
+        if (!(*p++ & 0x80))
+        {
+            *i = res;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static uint32_t zigzag(int32_t i)
+{
+    return ((uint32_t)i << 1) ^ -((uint32_t)i >> 31);
+}
+
+static int32_t unzigzag(uint32_t u)
+{
+    return (int32_t)((u >> 1) ^ -(u & 1));
+}
+
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t size)
+{
+    /* 64-bit FNV-1a */
+    const unsigned char *p = data;
+
+    while (size-- > 0)
+        hash = (hash ^ *p++)*1099511628211ull;
+    return hash;
+}
+
+/* Computes a hash that identifies the module a game is saved for, from its
+   variable layout, strings and words. */
+static uint64_t hash_module(const Module *mod)
+{
+    uint64_t hash = 14695981039346656037ull;
+    unsigned char counts[16];
+    int n;
+
+    put_uint32(counts +  0, mod->num_entities);
+    put_uint32(counts +  4, mod->num_properties);
+    put_uint32(counts +  8, mod->num_globals);
+    put_uint32(counts + 12, mod->nfunction);
+    hash = hash_bytes(hash, counts, sizeof(counts));
+    for (n = 0; n < mod->nstring; ++n)
+        hash = hash_bytes(hash, mod->strings[n], strlen(mod->strings[n]) + 1);
+    for (n = 0; n < mod->nword; ++n)
+        hash = hash_bytes(hash, mod->words[n], strlen(mod->words[n]) + 1);
+    return hash;
+}
+
+#ifdef WITH_LZMA
+static void *lzma_alloc(void *p, size_t size)
+{
+    (void)p;
+    return malloc(size);
+}
+
+static void lzma_free(void *p, void *addr)
+{
+    (void)p;
+    free(addr);
+}
+
+static ISzAlloc szalloc = { lzma_alloc, lzma_free };
+
+/* Output callback that writes compressed data to a buffer, up to a limit. */
+typedef struct BufferOutput
+{
+    ISeqOutStream   out;
+    unsigned char   *data;
+    size_t          size, capacity;
+} BufferOutput;
+
+static size_t buffer_write(void *p, const void *buf, size_t size)
+{
+    BufferOutput *bo = p;
+
+    if (size > bo->capacity - bo->size)
+        return 0;
+    memcpy(bo->data + bo->size, buf, size);
+    bo->size += size;
+    return size;
+}
+
+/* Compresses `size' bytes of `src' into `dst' (properties first). Returns
+   the compressed size, or 0 if the data cannot be compressed into fewer
+   than `size' bytes. */
+static size_t compress_data( const unsigned char *src, size_t size,
+                             unsigned char *dst )
+{
+    BufferOutput output = { { buffer_write }, dst, LZMA_PROPS_SIZE, size };
+    CLzmaEncProps props;
+
+    if (size <= LZMA_PROPS_SIZE)
+        return 0;
+    LzmaEncProps_Init(&props);
+    if (props.dictSize == 0 || props.dictSize > size)
+        props.dictSize = size;
+    LzmaEncProps_Normalize(&props);
+    LzmaEncProps_Encode(&props, dst);
+    if (LzmaEncode(&output.out, src, size, &props, &szalloc) != SZ_OK)
+        return 0;
+    return output.size;
+}
+
+static bool decompress_data( const unsigned char *src, size_t src_size,
+                             unsigned char *dst, size_t dst_size )
+{
+    SizeT dst_len = dst_size, src_len;
+    ELzmaStatus status;
+
+    if (src_size < LZMA_PROPS_SIZE)
+        return false;
+    src_len = src_size - LZMA_PROPS_SIZE;
+    return LzmaDecode( dst, &dst_len, src + LZMA_PROPS_SIZE, &src_len,
+                       src, LZMA_PROPS_SIZE, LZMA_FINISH_END,
+                       &status, &szalloc ) == SZ_OK &&
+           status == LZMA_STATUS_FINISHED_WITH_MARK && dst_len == dst_size;
+}
+#endif
+
+static bool sync_fd(int fd)
+{
+#if defined(_POSIX_SYNCHRONIZED_IO) && _POSIX_SYNCHRONIZED_IO > 0
+    return fdatasync(fd) == 0;
+#else
+    return fsync(fd) == 0;
+#endif
+}
+
+static bool write_all(int fd, const void *buf, size_t size)
+{
+    const char *p = buf;
+    ssize_t n;
+
+    while (size > 0)
+    {
+        n = write(fd, p, size);
+        if (n <= 0)
+            return false;
+        p    += n;
+        size -= n;
+    }
+    return true;
+}
+
+/* Encodes the current state as snapshot data into `buf', which must hold at
+   least 2*MAX_VARINT_SIZE bytes per variable. Returns the size written. */
+static size_t encode_state(const SaveFile *sf, unsigned char *buf)
+{
+    unsigned char *p = buf;
+    int n, next = 0;
+
+    for (n = 0; n < sf->nval; ++n)
+    {
+        if (sf->state[n] != val_nil)
+        {
+            p = put_varint(p, n - next);
+            p = put_varint(p, zigzag(sf->state[n]));
+            next = n + 1;
+        }
+    }
+    return p - buf;
+}
+
+static bool decode_state( SaveFile *sf, const unsigned char *p,
+                          const unsigned char *end )
+{
+    uint32_t gap, value;
+    int n;
+
+    for (n = 0; n < sf->nval; ++n)
+        sf->state[n] = val_nil;
+    n = 0;
+    while (p < end)
+    {
+        p = get_varint(p, end, &gap);
+        if (p == NULL || gap >= (uint32_t)(sf->nval - n))
+            return false;
+        p = get_varint(p, end, &value);
+        if (p == NULL)
+            return false;
+        n += gap;
+        sf->state[n++] = unzigzag(value);
+    }
+    return true;
+}
+
+/* Encodes a journal entry (header and data) into `buf', which must hold
+   ENTRY_HEADER_SIZE plus 2*MAX_VARINT_SIZE bytes per pair. Returns the size
+   written. */
+static size_t encode_entry(const Delta *d, unsigned char *buf)
+{
+    unsigned char *p = buf + ENTRY_HEADER_SIZE;
+    int n, next = 0;
+
+    for (n = 0; n < d->count; ++n)
+    {
+        p = put_varint(p, zigzag(d->pairs[2*n] - next));
+        p = put_varint(p, zigzag(d->pairs[2*n + 1]));
+        next = d->pairs[2*n] + 1;
+    }
+    put_uint32(buf + 0, (uint32_t)(p - buf - ENTRY_HEADER_SIZE));
+    put_uint32(buf + 4, (uint32_t)d->turn);
+    put_uint32( buf + 8, crc32c( crc32c(0, buf, 8),
+                                 buf + ENTRY_HEADER_SIZE,
+                                 p - buf - ENTRY_HEADER_SIZE ) );
+    return p - buf;
+}
+
+/* Applies the changes listed in a journal entry's data to the state, if all
+   of them are valid. */
+static bool apply_entry( SaveFile *sf, const unsigned char *data,
+                         const unsigned char *end )
+{
+    const unsigned char *p;
+    uint32_t delta, value;
+    int64_t index;
+    bool apply;
+
+    /* Validate first, then apply */
+    for (apply = false; ; apply = true)
+    {
+        for (p = data, index = 0; p < end; ++index)
+        {
+            p = get_varint(p, end, &delta);
+            if (p == NULL)
+                return false;
+            index += unzigzag(delta);
+            if (index < 0 || index >= sf->nval)
+                return false;
+            p = get_varint(p, end, &value);
+            if (p == NULL)
+                return false;
+            if (apply)
+                sf->state[index] = unzigzag(value);
+        }
+        if (apply)
+            return true;
+    }
+}
+
+/* Syncs the directory containing the saved game, so that a rename of the
+   file is durable. */
+static void sync_dir(SaveFile *sf)
+{
+    char *dir_path, *p;
+    int fd;
+
+    dir_path = strdup(sf->path);
+    if (dir_path == NULL)
+        return;
+    p = strrchr(dir_path, '/');
+    if (p == NULL)
+        strcpy(dir_path, ".");
+    else
+        p[p == dir_path] = '\0';
+    fd = open(dir_path, O_RDONLY);
+    if (fd >= 0)
+    {
+        fsync(fd);
+        close(fd);
+    }
+    free(dir_path);
+}
+
+/* Writes the current state, which includes all turns up to `last_turn', as a
+   new snapshot (or, if `native' is set, as an array of values in the host's
+   format, to be mapped into memory), which replaces the saved game file (and
+   its journal) atomically. */
+static bool write_snapshot(SaveFile *sf, bool native, int last_turn)
+{
+    unsigned char *buf = NULL, *data, *packed = NULL;
+    size_t size, data_size = 0;
+    char *temp_path;
+    bool ok;
+    int fd, flags = 0;
+
+    if (native)
+    {
+        /* The values start on a page boundary, so they can be mapped */
+        sf->map_offset = sysconf(_SC_PAGESIZE);
+        if (sf->map_offset < NATIVE_HEADER_SIZE)
+            sf->map_offset = NATIVE_HEADER_SIZE;
+        size = sf->map_offset + sizeof(Value)*sf->nval;
+        buf = calloc(1, size);
+        if (buf == NULL)
+            return false;
+        data = buf;
+        memcpy(data, NATIVE_MAGIC, 4);
+        data[4] = SAVE_VERSION;
+        put_uint32(data +  8, (uint32_t)(sf->hash >> 32));
+        put_uint32(data + 12, (uint32_t)sf->hash);
+        put_uint32(data + 16, sf->nval);
+        put_uint32(data + 20, sf->map_offset);
+        memcpy(data + sf->map_offset, sf->state, sizeof(Value)*sf->nval);
+    }
+    else
+    {
+        buf = malloc(HEADER_SIZE + 2*MAX_VARINT_SIZE*(size_t)sf->nval);
+        if (buf == NULL)
+            return false;
+        data = buf;
+        data_size = size = encode_state(sf, buf + HEADER_SIZE);
+#ifdef WITH_LZMA
+        if (sf->compress)
+        {
+            packed = malloc(HEADER_SIZE + data_size);
+            if (packed != NULL)
+            {
+                size = compress_data( buf + HEADER_SIZE, data_size,
+                                      packed + HEADER_SIZE );
+                if (size > 0)
+                {
+                    free(buf);
+                    data = buf = packed;
+                    flags |= SAVE_LZMA;
+                }
+                else
+                {
+                    free(packed);
+                    size = data_size;
+                }
+            }
+        }
+#else
+        (void)packed;
+#endif
+        memcpy(data, SAVE_MAGIC, 4);
+        data[4] = SAVE_VERSION;
+        data[5] = flags;
+        data[6] = data[7] = 0;
+        put_uint32(data +  8, (uint32_t)(sf->hash >> 32));
+        put_uint32(data + 12, (uint32_t)sf->hash);
+        put_uint32(data + 16, sf->nval);
+        put_uint32(data + 20, last_turn);
+        put_uint32(data + 24, size);
+        put_uint32(data + 28, data_size);
+        put_uint32( data + 32, crc32c( crc32c(0, data, 32),
+                                       data + HEADER_SIZE, size ) );
+        size += HEADER_SIZE;
+    }
+
+    temp_path = malloc(strlen(sf->path) + 8);
+    if (temp_path == NULL)
+    {
+        free(buf);
+        return false;
+    }
+    sprintf(temp_path, "%s.XXXXXX", sf->path);
+    fd = mkstemp(temp_path);
+    ok = fd >= 0 && fchmod(fd, 0644) == 0 && write_all(fd, data, size) &&
+         sync_fd(fd) && rename(temp_path, sf->path) == 0;
+    free(buf);
+    if (!ok)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+            unlink(temp_path);
+        }
+        free(temp_path);
+        return false;
+    }
+    free(temp_path);
+    close(sf->fd);
+    sf->fd = fd;
+    sync_dir(sf);
+
+    sf->have_snapshot = !native;
+    sf->snapshot_size = size;
+    sf->journal_size  = 0;
+    return true;
+}
+
+/* Writes a list of deltas (oldest first) to the file, as journal entries or
+   as part of a new snapshot, and frees them. */
+static bool commit_deltas(SaveFile *sf, Delta *deltas)
+{
+    Delta *d, *next;
+    unsigned char *buf;
+    size_t size = 0, max_size = 0;
+    bool ok;
+    int n, last_turn = 0;
+
+    for (d = deltas; d != NULL; d = d->next)
+    {
+        for (n = 0; n < d->count; ++n)
+            sf->state[d->pairs[2*n]] = d->pairs[2*n + 1];
+        max_size += ENTRY_HEADER_SIZE + 2*MAX_VARINT_SIZE*(size_t)d->count;
+        last_turn = d->turn;
+    }
+
+    /* Append all entries with a single write, or write a new snapshot */
+    ok = false;
+    buf = malloc(max_size);
+    if (buf != NULL)
+    {
+        for (d = deltas; d != NULL; d = d->next)
+            size += encode_entry(d, buf + size);
+        if (sf->have_snapshot &&
+            ( sf->journal_size + size <= sf->snapshot_size ||
+              sf->journal_size + size <= MIN_JOURNAL_SIZE ))
+        {
+            ok = write_all(sf->fd, buf, size) && sync_fd(sf->fd);
+            sf->journal_size += size;
+        }
+        else
+        {
+            ok = write_snapshot(sf, false, last_turn);
+        }
+        free(buf);
+    }
+
+    for (d = deltas; d != NULL; d = next)
+    {
+        next = d->next;
+        free(d);
+    }
+    if (!ok)
+    {
+        __atomic_store_n(&sf->failed, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+    __atomic_store_n(&sf->durable, last_turn, __ATOMIC_RELEASE);
+    return true;
+}
+
+#ifdef WITH_THREADS
+/* Removes all deltas from the queue, and returns them oldest first. */
+static Delta *take_deltas(SaveFile *sf)
+{
+    Delta *d, *next, *list = NULL;
+
+    for (d = __atomic_exchange_n(&sf->queue, NULL, __ATOMIC_ACQUIRE);
+         d != NULL; d = next)
+    {
+        next = d->next;
+        d->next = list;
+        list = d;
+    }
+    return list;
+}
+
+static void *writer_main(void *arg)
+{
+    SaveFile *sf = arg;
+    struct timespec deadline;
+    bool closing;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&sf->lock);
+        while (__atomic_load_n(&sf->queue, __ATOMIC_ACQUIRE) == NULL &&
+               !sf->closing)
+            pthread_cond_wait(&sf->cond, &sf->lock);
+
+        /* Wait for more turns to commit along with the first */
+        if (!sf->closing && sf->window > 0)
+        {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec  += sf->window/1000;
+            deadline.tv_nsec += sf->window%1000*1000000L;
+            if (deadline.tv_nsec >= 1000000000L)
+            {
+                deadline.tv_sec  += 1;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            while (!sf->closing &&
+                   pthread_cond_timedwait(&sf->cond, &sf->lock, &deadline)
+                   != ETIMEDOUT) { }
+        }
+        closing = sf->closing;
+        pthread_mutex_unlock(&sf->lock);
+
+        if (__atomic_load_n(&sf->queue, __ATOMIC_ACQUIRE) != NULL)
+            commit_deltas(sf, take_deltas(sf));
+        else
+        if (closing)
+            break;
+    }
+    return NULL;
+}
+#endif
+
+SaveFile *open_save_file( const char *path, const Module *mod, bool create,
+                          int window )
+{
+    SaveFile *sf;
+    int n, nval = mod->num_entities*mod->num_properties + mod->num_globals;
+
+    sf = calloc(1, sizeof(SaveFile));
+    if (sf == NULL)
+        return NULL;
+    sf->path  = strdup(path);
+    sf->state = malloc(sizeof(Value)*(nval > 0 ? nval : 1));
+    if (sf->path == NULL || sf->state == NULL)
+        goto failed;
+    sf->fd = open(path, create ? O_RDWR|O_CREAT|O_TRUNC : O_RDWR, 0644);
+    if (sf->fd < 0)
+        goto failed;
+    sf->nval    = nval;
+    sf->hash    = hash_module(mod);
+    sf->window  = window;
+    sf->created = create;
+    for (n = 0; n < nval; ++n)
+        sf->state[n] = val_nil;
+#ifdef WITH_THREADS
+    pthread_mutex_init(&sf->lock, NULL);
+    pthread_cond_init(&sf->cond, NULL);
+#endif
+    return sf;
+
+failed:
+    free(sf->state);
+    free(sf->path);
+    free(sf);
+    return NULL;
+}
+
+void set_save_compression(SaveFile *sf, bool compress)
+{
+    sf->compress = compress;
+}
+
+/* Reads a snapshot (of `size' bytes, including its header) from `data'.
+   Returns the size of the snapshot, or 0 if it is not valid. */
+static size_t read_snapshot( SaveFile *sf, const unsigned char *data,
+                             size_t size )
+{
+    const unsigned char *src;
+    unsigned char *unpacked = NULL;
+    size_t stored_size, data_size;
+    bool ok;
+
+    if ( size < HEADER_SIZE || data[4] != SAVE_VERSION ||
+         (data[5] & ~SAVE_LZMA) != 0 ||
+         get_uint32(data +  8) != (uint32_t)(sf->hash >> 32) ||
+         get_uint32(data + 12) != (uint32_t)sf->hash ||
+         get_uint32(data + 16) != (uint32_t)sf->nval )
+        return 0;
+    stored_size = get_uint32(data + 24);
+    data_size   = get_uint32(data + 28);
+    if ( stored_size > size - HEADER_SIZE ||
+         crc32c(crc32c(0, data, 32), data + HEADER_SIZE, stored_size)
+         != get_uint32(data + 32) )
+        return 0;
+
+    src = data + HEADER_SIZE;
+    if (data[5] & SAVE_LZMA)
+    {
+#ifdef WITH_LZMA
+        unpacked = malloc(data_size > 0 ? data_size : 1);
+        if ( unpacked == NULL ||
+             !decompress_data(src, stored_size, unpacked, data_size) )
+        {
+            free(unpacked);
+            return 0;
+        }
+        src = unpacked;
+#else
+        return 0;
+#endif
+    }
+    else
+    if (data_size != stored_size)
+        return 0;
+    ok = decode_state(sf, src, src + data_size);
+    free(unpacked);
+    if (!ok)
+        return 0;
+    sf->turn = sf->durable = (int)get_uint32(data + 20);
+    return HEADER_SIZE + stored_size;
+}
+
+/* Checks a native snapshot (of `size' bytes) at `data', and stores the
+   offset of its values in `offset'. Returns false if the snapshot is not
+   valid for the module. */
+static bool read_native_snapshot( const SaveFile *sf,
+                                  const unsigned char *data, size_t size,
+                                  size_t *offset )
+{
+    if (size < NATIVE_HEADER_SIZE || memcmp(data, NATIVE_MAGIC, 4) != 0)
+    {
+        /* Values only (without header) */
+        *offset = 0;
+        return size == sizeof(Value)*sf->nval;
+    }
+    *offset = get_uint32(data + 20);
+    return data[4] == SAVE_VERSION &&
+           get_uint32(data +  8) == (uint32_t)(sf->hash >> 32) &&
+           get_uint32(data + 12) == (uint32_t)sf->hash &&
+           get_uint32(data + 16) == (uint32_t)sf->nval &&
+           *offset >= NATIVE_HEADER_SIZE && *offset <= size &&
+           size - *offset >= sizeof(Value)*sf->nval;
+}
+
+/* Reads the snapshot and journal of an existing file into sf->state. */
+static bool read_save_file(SaveFile *sf)
+{
+    const unsigned char *entry;
+    unsigned char *data;
+    struct stat st;
+    size_t size, pos, entry_size;
+    bool ok;
+
+    if (fstat(sf->fd, &st) != 0)
+        return false;
+    size = (size_t)st.st_size;
+    data = malloc(size > 0 ? size : 1);
+    if (data == NULL)
+        return false;
+    ok = lseek(sf->fd, 0, SEEK_SET) == 0 &&
+         read(sf->fd, data, size) == (ssize_t)size;
+    if (!ok)
+    {
+        free(data);
+        return false;
+    }
+
+    if (size < 4 || memcmp(data, SAVE_MAGIC, 4) != 0)
+    {
+        /* Native snapshot; new changes require a new snapshot */
+        ok = read_native_snapshot(sf, data, size, &pos);
+        if (ok)
+            memcpy(sf->state, data + pos, sizeof(Value)*sf->nval);
+        free(data);
+        sf->have_snapshot = false;
+        return ok;
+    }
+
+    pos = read_snapshot(sf, data, size);
+    if (pos == 0)
+    {
+        free(data);
+        return false;
+    }
+    sf->snapshot_size = pos;
+
+    /* Replay complete and valid journal entries */
+    while (size - pos >= ENTRY_HEADER_SIZE)
+    {
+        entry      = data + pos;
+        entry_size = get_uint32(entry);
+        if ( entry_size > size - pos - ENTRY_HEADER_SIZE ||
+             crc32c( crc32c(0, entry, 8), entry + ENTRY_HEADER_SIZE,
+                     entry_size ) != get_uint32(entry + 8) ||
+             !apply_entry( sf, entry + ENTRY_HEADER_SIZE,
+                           entry + ENTRY_HEADER_SIZE + entry_size ) )
+            break;
+        sf->turn = sf->durable = (int)get_uint32(entry + 4);
+        pos += ENTRY_HEADER_SIZE + entry_size;
+    }
+    free(data);
+
+    /* Discard whatever follows, so new entries are appended after the
+       last valid one */
+    if ( (pos < size && ftruncate(sf->fd, (off_t)pos) != 0) ||
+         lseek(sf->fd, (off_t)pos, SEEK_SET) != (off_t)pos )
+        return false;
+    sf->have_snapshot = true;
+    sf->journal_size  = pos - sf->snapshot_size;
+    return true;
+}
+
+bool load_save_file(SaveFile *sf, Variables *vars)
+{
+    if (vars->nval != sf->nval)
+        return false;
+    if (vars->vals != sf->map)
+    {
+        if (!read_save_file(sf))
+            return false;
+        memcpy(vars->vals, sf->state, sizeof(Value)*sf->nval);
+    }
+    clear_dirty_vars(vars);
+    return true;
+}
+
+Value *map_save_file(SaveFile *sf, bool sync)
+{
+#ifdef WITH_MMAP
+    void *addr;
+
+    /* Replace the file with a native snapshot of the current state, which
+       is then updated in place */
+    if ((!sf->created && !read_save_file(sf)) || !write_snapshot(sf, true, sf->turn))
+        return NULL;
+    addr = mmap( NULL, sizeof(Value)*sf->nval, PROT_READ|PROT_WRITE,
+                 MAP_SHARED, sf->fd, (off_t)sf->map_offset );
+    if (addr == MAP_FAILED)
+        return NULL;
+    sf->map  = addr;
+    sf->sync = sync;
+    return sf->map;
+#else
+    (void)sf;
+    (void)sync;
+    return NULL;
+#endif
+}
+
+bool save_changes(SaveFile *sf, Variables *vars)
+{
+    Delta *d;
+    int n;
+
+    if (__atomic_load_n(&sf->failed, __ATOMIC_RELAXED))
+        return false;
+    if (vars->ndirty == 0)
+        return true;
+
+#ifdef WITH_MMAP
+    if (sf->map != NULL)
+    {
+        /* Changes were written to the mapping already */
+        clear_dirty_vars(vars);
+        ++sf->turn;
+        if (!sf->sync)
+            return true;
+        if (msync(sf->map, sizeof(Value)*sf->nval, MS_SYNC) != 0)
+            return false;
+        sf->durable = sf->turn;
+        return true;
+    }
+#endif
+
+    d = malloc(sizeof(Delta) + (2*vars->ndirty - 1)*sizeof(Value));
+    if (d == NULL)
+        return false;
+    d->turn  = ++sf->turn;
+    d->count = vars->ndirty;
+    for (n = 0; n < vars->ndirty; ++n)
+    {
+        d->pairs[2*n]     = vars->dirty[n];
+        d->pairs[2*n + 1] = vars->vals[vars->dirty[n]];
+    }
+    clear_dirty_vars(vars);
+
+#ifdef WITH_THREADS
+    if (!sf->running)
+    {
+        sf->running = pthread_create(&sf->thread, NULL, writer_main, sf) == 0;
+    }
+    if (sf->running)
+    {
+        /* Push onto the queue (without locking) and wake up the writer */
+        d->next = __atomic_load_n(&sf->queue, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n( &sf->queue, &d->next, d, true,
+                                             __ATOMIC_RELEASE,
+                                             __ATOMIC_RELAXED )) { }
+        pthread_mutex_lock(&sf->lock);
+        pthread_cond_signal(&sf->cond);
+        pthread_mutex_unlock(&sf->lock);
+        return true;
+    }
+#endif
+
+    /* Write synchronously */
+    d->next = NULL;
+    return commit_deltas(sf, d);
+}
+
+int durable_turn(SaveFile *sf)
+{
+    return __atomic_load_n(&sf->durable, __ATOMIC_ACQUIRE);
+}
+
+bool close_save_file(SaveFile *sf)
+{
+    bool ok;
+
+#ifdef WITH_THREADS
+    if (sf->running)
+    {
+        pthread_mutex_lock(&sf->lock);
+        sf->closing = true;
+        pthread_cond_signal(&sf->cond);
+        pthread_mutex_unlock(&sf->lock);
+        pthread_join(sf->thread, NULL);
+    }
+    pthread_mutex_destroy(&sf->lock);
+    pthread_cond_destroy(&sf->cond);
+#endif
+    ok = !sf->failed;
+#ifdef WITH_MMAP
+    if (sf->map != NULL)
+    {
+        if (sf->sync && msync(sf->map, sizeof(Value)*sf->nval, MS_SYNC) != 0)
+            ok = false;
+        munmap(sf->map, sizeof(Value)*sf->nval);
+    }
+#endif
+    if (close(sf->fd) != 0)
+        ok = false;
+    free(sf->state);
+    free(sf->path);
+    free(sf);
+    return ok;
+}
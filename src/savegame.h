@@ -0,0 +1,75 @@
+#ifndef SAVEGAME_H_INCLUDED
+#define SAVEGAME_H_INCLUDED
+
+#include <stdbool.h>
+#include "interpreter.h"
+
+/* Saved games.
+
+   A saved game file consists of a snapshot of all variables, followed by a
+   journal of the variables changed since. The format is portable: integers
+   are stored as varints in a fixed byte order, and snapshots list only the
+   variables that are not nil (see savegame.c). Snapshots identify the module
+   the game was saved for by a hash of its contents, and can optionally be
+   compressed (see WITH_LZMA). Each journal entry holds the
+   changes made during one turn, and is protected by a checksum (see
+   crc32c.h), so a partially written entry (e.g. after a crash) is detected
+   and discarded when the game is loaded. Once the journal grows larger than
+   the snapshot, a new snapshot is written to a temporary file, which then
+   replaces the saved game.
+
+   Changes are written by a separate thread (see WITH_THREADS), so saving
+   never blocks the caller on disk I/O. The writer collects the changes of
+   all turns saved within a commit window, and makes them durable with a
+   single write and fdatasync() (group commit). Without threads, each turn is
+   written (and synced) when it is saved. Alternatively, the variables can be
+   mapped directly from the file (see map_save_file()). */
+
+typedef struct SaveFile SaveFile;
+
+/* Opens the saved game file at `path' for a game of module `mod'. If
+   `create' is set, a new file is created (replacing any existing file);
+   otherwise, the game must be loaded with load_save_file() before it is
+   saved. `window' is the commit window in milliseconds: the writer waits
+   this long after a turn is saved, to commit later turns along with it.
+   Returns NULL on failure. */
+SaveFile *open_save_file( const char *path, const Module *mod, bool create,
+                          int window );
+
+/* Selects whether snapshots are LZMA compressed (by default, they are not).
+   Compressed snapshots are smaller, but slower to write. */
+void set_save_compression(SaveFile *sf, bool compress);
+
+/* Loads the game from an existing file into `vars', and clears their dirty
+   flags. Discards any partially written journal entries. Fails if the game
+   was saved for a different module. If `vars' uses the file's mapping, the
+   game has been loaded already. Returns false on failure. */
+bool load_save_file(SaveFile *sf, Variables *vars);
+
+/* Maps the saved game into memory (with MAP_SHARED; see WITH_MMAP), for use
+   as the game's variables (see alloc_vars_at()). For an existing file, the
+   game is loaded first; a new file starts with all variables nil. The file
+   is then replaced by a snapshot, which the mapping covers, so changes to the
+   variables reach the file without being saved explicitly. The snapshot
+   consists of a header identifying the module, and an array of values in the
+   host's native format (starting on a page boundary), which is not portable.
+   save_changes() only ends the turn, and, if `sync' is set, waits until the
+   changed pages have been written with msync(). Unlike journal entries, turns
+   are not written atomically: after a crash, the file may contain part of the
+   last turn's changes. Returns NULL on failure. */
+Value *map_save_file(SaveFile *sf, bool sync);
+
+/* Saves the variables that are marked dirty in `vars' as the next turn, and
+   clears their dirty flags. Returns immediately; the changes are written in
+   the background. Returns false if saving failed (now or earlier). */
+bool save_changes(SaveFile *sf, Variables *vars);
+
+/* Returns the number of the last turn that has been written durably, where
+   turns are numbered from 1 by save_changes() (0 means none). */
+int durable_turn(SaveFile *sf);
+
+/* Waits until all saved turns have been written, and closes the file.
+   Returns false if any of them could not be written. */
+bool close_save_file(SaveFile *sf);
+
+#endif /* ndef SAVEGAME_H_INCLUDED */
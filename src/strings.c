@@ -1,33 +1,204 @@
 #include "strings.h"
 #include <string.h>
-#include <ctype.h>
 #include <stdbool.h>
 
-char *normalize(char *str)
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define HASH_INIT   2166136261u
+#define HASH_PRIME  16777619u
+
+/* Maps each byte of a command string to its normalized form: alphanumeric
+   characters map to their upper case form, white space characters map to a
+   space and all other characters map to zero (i.e. they are removed). This
+   matches isalnum()/isspace()/toupper() in the C locale. */
+static const char char_map[256] = {
+      0,   0,   0,   0,   0,   0,   0,   0,   0, ' ', ' ', ' ', ' ', ' ',   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    ' ',   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    '0', '1', '2', '3', '4', '5', '6', '7', '8', '9',   0,   0,   0,   0,   0,   0,
+      0, 'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H', 'I', 'J', 'K', 'L', 'M', 'N', 'O',
+    'P', 'Q', 'R', 'S', 'T', 'U', 'V', 'W', 'X', 'Y', 'Z',   0,   0,   0,   0,   0,
+      0, 'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H', 'I', 'J', 'K', 'L', 'M', 'N', 'O',
+    'P', 'Q', 'R', 'S', 'T', 'U', 'V', 'W', 'X', 'Y', 'Z',   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0 };
+
+/* State of the tokenizer while scanning a command string. */
+typedef struct Tokenizer
+{
+    char        *out;           /* output position */
+    bool        space;          /* last character written was a space */
+    const char  *word;          /* start of the current word */
+    unsigned    hash;           /* hash of the current word so far */
+    WordRef     *words;         /* output array of words */
+    size_t      nword, max_words;
+} Tokenizer;
+
+static void end_word(Tokenizer *t)
+{
+    if (t->nword < t->max_words)
+    {
+        t->words[t->nword].text = t->word;
+        t->words[t->nword].hash = t->hash;
+    }
+    t->nword++;
+}
+
+static void begin_word(Tokenizer *t)
+{
+    t->word  = t->out;
+    t->hash  = HASH_INIT;
+    t->space = false;
+}
+
+/* Processes a single normalized character (see char_map). */
+static void put_normalized(Tokenizer *t, char c)
+{
+    if (c == ' ')
+    {
+        if (!t->space)
+        {
+            end_word(t);
+            *t->out++ = ' ';
+            t->space = true;
+        }
+    }
+    else
+    if (c != '\0')
+    {
+        if (t->space)
+            begin_word(t);
+        t->hash *= HASH_PRIME;
+        t->hash ^= (unsigned char)c;
+        *t->out++ = c;
+    }
+}
+
+#ifdef __SSE2__
+/* Returns a mask of bytes in `v' that lie in the range [lo:hi]
+   (both bounds must be in the range [1:126]). */
+static __m128i in_range(__m128i v, char lo, char hi)
 {
-    char *p, *q;
-    bool space = true;
+    return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)),
+                         _mm_cmplt_epi8(v, _mm_set1_epi8(hi + 1)));
+}
 
-    for (p = q = str; *p; ++p)
+/* Processes the input string (which ends at `end') 16 bytes at a time, as
+   long as full blocks remain. Returns a pointer to the first unprocessed
+   character. */
+static char *tokenize_sse2(Tokenizer *t, char *p, const char *end)
+{
+    while (end - p >= 16)
     {
-        if (isalnum(*p))
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        __m128i lower = in_range(v, 'a', 'z');
+        __m128i alnum = _mm_or_si128(lower,
+                        _mm_or_si128(in_range(v, 'A', 'Z'), in_range(v, '0', '9')));
+        unsigned alnum_mask = _mm_movemask_epi8(alnum);
+        __m128i upper = _mm_sub_epi8(v, _mm_and_si128(lower, _mm_set1_epi8(32)));
+        char buf[16];
+        int i;
+
+        _mm_storeu_si128((__m128i*)buf, upper);
+        if (alnum_mask == 0xffff)
         {
-            space = false;
-            *q++ = isalpha(*p) ? toupper(*p) : *p;
+            /* Fast path: 16 alphanumeric characters. The output position never
+               exceeds the input position, so storing here is safe. */
+            if (t->space)
+                begin_word(t);
+            _mm_storeu_si128((__m128i*)t->out, upper);
+            for (i = 0; i < 16; ++i)
+            {
+                t->hash *= HASH_PRIME;
+                t->hash ^= (unsigned char)buf[i];
+            }
+            t->out += 16;
         }
         else
-        if (isspace(*p) && !space)
         {
-            space = true;
-            *q++ = ' ';
+            /* Slow path: classified characters are processed one at a time. */
+            unsigned space_mask = _mm_movemask_epi8(_mm_or_si128(
+                _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), in_range(v, '\t', '\r')));
+            for (i = 0; i < 16; ++i)
+            {
+                if (alnum_mask & (1u << i))
+                    put_normalized(t, buf[i]);
+                else
+                if (space_mask & (1u << i))
+                    put_normalized(t, ' ');
+            }
         }
+        p += 16;
     }
+    return p;
+}
+#endif
+
+size_t tokenize(char *str, WordRef *words, size_t max_words)
+{
+    Tokenizer t = { str, true, NULL, HASH_INIT, words, 0, max_words };
+    char *p = str, *end = str + strlen(str);
 
-    /* Remove trailing space */
-    if (q != str && isspace(q[-1]))
-        --q;
+#ifdef __SSE2__
+    p = tokenize_sse2(&t, p, end);
+#endif
+    while (p != end)
+        put_normalized(&t, char_map[(unsigned char)*p++]);
 
-    *q = '\0';
+    if (!t.space)
+        end_word(&t);   /* terminate last word */
+    else
+    if (t.out != str)
+        --t.out;        /* remove trailing space */
+
+    *t.out = '\0';
+    return t.nword;
+}
+
+bool ends_in_word(const char *str, size_t len)
+{
+    while (len > 0)
+    {
+        char ch = char_map[(unsigned char)str[--len]];
+        if (ch != 0)
+            return ch != ' ';
+    }
+    return false;
+}
+
+char *normalize(char *str)
+{
+    tokenize(str, NULL, 0);
     return str;
 }
 
+unsigned hash_word(const char *str)
+{
+    unsigned h = HASH_INIT;
+    while (*str != '\0' && *str != ' ')
+    {
+        h *= HASH_PRIME;
+        h ^= *(unsigned char*)str;
+        ++str;
+    }
+    return h;
+}
+
+unsigned hash_displace(unsigned hash, unsigned disp)
+{
+    unsigned h = hash ^ (disp*0x9e3779b9u);
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
@@ -1,7 +1,35 @@
 #ifndef STRINGS_H_INCLUDED
 #define STRINGS_H_INCLUDED
 
+#include <stdbool.h>
+#include <stdlib.h>
+
+/* A word in a normalized command string. */
+typedef struct WordRef
+{
+    const char  *text;      /* start of the word (terminated by space or 0) */
+    unsigned    hash;       /* equal to hash_word(text) */
+} WordRef;
+
 /* Normalizes a command string. Note that the argument string is modified! */
 char *normalize(char *str);
 
+/* Normalizes a command string (exactly like normalize()) while splitting it
+   into words and hashing them in the same pass. At most `max_words' words are
+   stored in `words', but the total number of words is returned. */
+size_t tokenize(char *str, WordRef *words, size_t max_words);
+
+/* Returns whether the first `len' characters of `str' end in a word, i.e.
+   whether the last word is not followed by white space (ignoring characters
+   that normalize() drops). */
+bool ends_in_word(const char *str, size_t len);
+
+/* Returns a hash value for the word at the start of `str' (i.e. the characters
+   up to the first space or zero character). */
+unsigned hash_word(const char *str);
+
+/* Mixes a word hash with a displacement value; used to compute slots in the
+   perfect hash table of words generated by the compiler. */
+unsigned hash_displace(unsigned hash, unsigned disp);
+
 #endif /* ndef STRINGS_H_INCLUDED */
@@ -0,0 +1,170 @@
+#undef NDEBUG  /* tests are performed by assertions */
+#include "interpreter.h"
+#include "io.h"
+#include "strings.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Tests process_batch() by running several interpreters for the same module
+   through batches of commands, and comparing their output and variables
+   against interpreters that process the same commands one at a time. Each
+   interpreter starts at a different line of the commands file, so batches
+   contain both identical and different commands. Some commands are passed
+   as words instead of lines. */
+
+#define NINTERP     6
+#define MAX_LINES   1000
+#define LINE_SIZE   256
+
+static char lines[MAX_LINES][LINE_SIZE];
+static int nline = 0;
+
+static void init_interpreter(Interpreter *I, Module *mod)
+{
+    memset(I, 0, sizeof(Interpreter));
+    I->mod    = mod;
+    I->vars   = alloc_vars(mod);
+    I->stack  = AR_alloc(sizeof(Value));
+    I->output = AR_alloc(sizeof(char));
+    assert(I->vars != NULL && I->stack != NULL && I->output != NULL);
+    reinitialize(I);
+}
+
+static void free_interpreter(Interpreter *I)
+{
+    AR_free(I->output);
+    AR_free(I->stack);
+    free_vars(I->vars);
+}
+
+/* Converts a normalized command line to words. Returns the number of words,
+   or -1 if some word is not in the word table. */
+static int line_to_words(const Module *mod, char *line, int *words)
+{
+    char *word;
+    int nword = 0;
+
+    for (word = strtok(line, " "); word != NULL; word = strtok(NULL, " "))
+    {
+        if (nword == MAX_COMMAND_WORDS)
+            return -1;
+        if ((words[nword++] = find_word(mod, word)) < 0)
+            return -1;
+    }
+    return nword;
+}
+
+static void check_same(Interpreter *I, Interpreter *J)
+{
+    assert(AR_size(I->output) == AR_size(J->output));
+    assert(AR_size(I->output) == 0 ||
+           memcmp(AR_data(I->output), AR_data(J->output),
+                  AR_size(I->output)) == 0);
+    assert(cmp_vars(I->vars, J->vars) == 0);
+}
+
+static void run(Module *mod)
+{
+    Interpreter batch[NINTERP], single[NINTERP];
+    CommandRequest reqs[NINTERP];
+    char buf[NINTERP][LINE_SIZE];
+    int words[NINTERP][MAX_COMMAND_WORDS];
+    int n, k, nword;
+
+    for (k = 0; k < NINTERP; ++k)
+    {
+        init_interpreter(&batch[k], mod);
+        init_interpreter(&single[k], mod);
+        check_same(&batch[k], &single[k]);
+    }
+
+    for (n = 0; n < nline; ++n)
+    {
+        for (k = 0; k < NINTERP; ++k)
+        {
+            const char *line = lines[(n + k/2)%nline];
+
+            reqs[k].I     = &batch[k];
+            reqs[k].line  = buf[k];
+            reqs[k].words = NULL;
+            reqs[k].nword = 0;
+            strcpy(buf[k], line);
+            if (k%3 == 2)
+            {
+                /* Pass the command as words, if possible */
+                char tmp[LINE_SIZE];
+                strcpy(tmp, line);
+                normalize(tmp);
+                nword = line_to_words(mod, tmp, words[k]);
+                if (nword > 0)
+                {
+                    reqs[k].line  = NULL;
+                    reqs[k].words = words[k];
+                    reqs[k].nword = nword;
+                }
+            }
+
+            AR_clear(single[k].output);
+            if (reqs[k].line != NULL)
+            {
+                char tmp[LINE_SIZE];
+                strcpy(tmp, line);
+                process_command(&single[k], tmp);
+            }
+            else
+            {
+                process_command_words(&single[k], reqs[k].words, reqs[k].nword);
+            }
+        }
+
+        process_batch(reqs, NINTERP);
+
+        for (k = 0; k < NINTERP; ++k)
+            check_same(&batch[k], &single[k]);
+    }
+
+    for (k = 0; k < NINTERP; ++k)
+    {
+        free_interpreter(&batch[k]);
+        free_interpreter(&single[k]);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    IOStream ios;
+    Module *mod;
+    FILE *fp;
+    bool ok;
+
+    if (argc != 3)
+    {
+        printf("Usage: %s <module> <commands file>\n", argv[0]);
+        return 1;
+    }
+
+    ok = ios_open(&ios, argv[1], IOM_RDONLY, IOC_AUTO);
+    assert(ok);
+    mod = load_module(&ios);
+    ios_close(&ios);
+    assert(mod != NULL);
+
+    fp = fopen(argv[2], "rt");
+    assert(fp != NULL);
+    while (nline < MAX_LINES && fgets(lines[nline], LINE_SIZE, fp) != NULL)
+    {
+        lines[nline][strcspn(lines[nline], "\r\n")] = '\0';
+        if (lines[nline][0] != '\0')
+            ++nline;
+    }
+    fclose(fp);
+    assert(nline > 0);
+
+    run(mod);
+    free_module(mod);
+
+    printf("All batch tests passed (%d commands, %d interpreters).\n",
+           nline, NINTERP);
+    return 0;
+}
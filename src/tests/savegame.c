@@ -0,0 +1,220 @@
+#undef NDEBUG  /* tests are performed by assertions */
+#include "savegame.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Tests saved games: round trips with and without compression (including a
+   journal long enough to be folded into a new snapshot), torn journal
+   entries, module mismatches and legacy native snapshots. */
+
+#define PATH "test-savegame.bin"
+
+static char *strings[] = { "Hello, world!", "Goodbye." };
+static char *other_strings[] = { "Hello, world!", "Farewell." };
+
+static void init_module(Module *mod, char **strs)
+{
+    memset(mod, 0, sizeof(Module));
+    mod->num_entities   = 50;
+    mod->num_properties = 4;
+    mod->num_globals    = 8;
+    mod->nstring        = 2;
+    mod->strings        = strs;
+}
+
+/* Changes some variables, as during turn `turn'. */
+static void change_vars(Variables *vars, int turn)
+{
+    int n;
+
+    for (n = turn%7; n < vars->nval; n += 7)
+        set_var(vars, n, n%3 == 0 ? val_nil : turn*1000 - n);
+}
+
+/* Changes some variables for turn `turn', and saves them. */
+static void play_turn(SaveFile *sf, Variables *vars, int turn)
+{
+    change_vars(vars, turn);
+    assert(save_changes(sf, vars));
+}
+
+/* Plays `nturn' turns in a new saved game, and returns the variables. */
+static Variables *play(Module *mod, int nturn, bool compress)
+{
+    Variables *vars = alloc_vars(mod);
+    SaveFile *sf = open_save_file(PATH, mod, true, 0);
+    int turn;
+
+    assert(vars != NULL && sf != NULL);
+    set_save_compression(sf, compress);
+    assert(save_changes(sf, vars));     /* initial state (turn 1) */
+    for (turn = 2; turn <= nturn; ++turn)
+        play_turn(sf, vars, turn);
+    assert(close_save_file(sf));
+    return vars;
+}
+
+/* Loads the saved game, and returns the variables (or NULL on failure). */
+static Variables *load(Module *mod, int *turn)
+{
+    Variables *vars = alloc_vars(mod);
+    SaveFile *sf = open_save_file(PATH, mod, false, 0);
+    bool ok;
+
+    assert(vars != NULL && sf != NULL);
+    ok = load_save_file(sf, vars);
+    if (turn != NULL)
+        *turn = durable_turn(sf);
+    assert(close_save_file(sf));
+    if (!ok)
+    {
+        free_vars(vars);
+        return NULL;
+    }
+    assert(vars->ndirty == 0);
+    return vars;
+}
+
+static bool same_vars(const Variables *a, const Variables *b)
+{
+    return a->nval == b->nval &&
+           memcmp(a->vals, b->vals, sizeof(Value)*a->nval) == 0;
+}
+
+static off_t file_size()
+{
+    struct stat st;
+    assert(stat(PATH, &st) == 0);
+    return st.st_size;
+}
+
+static void test_round_trip(Module *mod, int nturn, bool compress)
+{
+    Variables *saved = play(mod, nturn, compress), *loaded;
+    int turn;
+
+    loaded = load(mod, &turn);
+    assert(loaded != NULL && same_vars(saved, loaded));
+    assert(turn == nturn);
+
+    /* Continue the loaded game */
+    SaveFile *sf = open_save_file(PATH, mod, false, 0);
+    assert(load_save_file(sf, loaded));
+    change_vars(saved, nturn + 1);
+    play_turn(sf, loaded, nturn + 1);
+    assert(close_save_file(sf));
+    free_vars(loaded);
+    loaded = load(mod, &turn);
+    assert(loaded != NULL && same_vars(saved, loaded));
+    assert(turn == nturn + 1);
+
+    free_vars(saved);
+    free_vars(loaded);
+}
+
+static void test_torn_entry(Module *mod)
+{
+    Variables *before = play(mod, 5, false), *after, *loaded;
+    SaveFile *sf;
+    off_t size;
+    int turn;
+    FILE *fp;
+
+    /* Save one more turn, then cut off the last byte of its entry */
+    after = load(mod, NULL);
+    sf = open_save_file(PATH, mod, false, 0);
+    assert(after != NULL && sf != NULL && load_save_file(sf, after));
+    size = file_size();
+    play_turn(sf, after, 6);
+    assert(close_save_file(sf));
+    assert(file_size() > size);
+    assert(truncate(PATH, file_size() - 1) == 0);
+    loaded = load(mod, &turn);
+    assert(loaded != NULL && same_vars(before, loaded) && turn == 5);
+    assert(file_size() == size);    /* torn entry was discarded */
+    free_vars(loaded);
+
+    /* Corrupt a byte in the data of the last entry */
+    sf = open_save_file(PATH, mod, false, 0);
+    assert(sf != NULL && load_save_file(sf, after));
+    play_turn(sf, after, 6);
+    assert(close_save_file(sf));
+    fp = fopen(PATH, "r+b");
+    assert(fp != NULL);
+    assert(fseek(fp, -1, SEEK_END) == 0);
+    assert(fputc(0x55, fp) != EOF && fclose(fp) == 0);
+    loaded = load(mod, &turn);
+    assert(loaded != NULL && same_vars(before, loaded) && turn == 5);
+    free_vars(loaded);
+
+    free_vars(before);
+    free_vars(after);
+}
+
+static void test_module_mismatch(Module *mod, Module *other)
+{
+    Variables *saved = play(mod, 3, false);
+
+    assert(load(other, NULL) == NULL);
+#ifdef WITH_MMAP
+    SaveFile *sf = open_save_file(PATH, mod, false, 0);
+    assert(sf != NULL && map_save_file(sf, false) != NULL);
+    assert(close_save_file(sf));
+    sf = open_save_file(PATH, other, false, 0);
+    assert(sf != NULL && map_save_file(sf, false) == NULL);
+    assert(close_save_file(sf));
+    Variables *loaded = load(mod, NULL);
+    assert(loaded != NULL && same_vars(saved, loaded));
+    free_vars(loaded);
+#endif
+    free_vars(saved);
+}
+
+static void test_legacy_native(Module *mod)
+{
+    Variables *saved = play(mod, 4, false), *loaded;
+    FILE *fp;
+
+    /* Files written before native snapshots had a header hold only the
+       values of all variables */
+    fp = fopen(PATH, "wb");
+    assert(fp != NULL);
+    assert(fwrite(saved->vals, sizeof(Value), saved->nval, fp) ==
+           (size_t)saved->nval);
+    assert(fclose(fp) == 0);
+    loaded = load(mod, NULL);
+    assert(loaded != NULL && same_vars(saved, loaded));
+    free_vars(loaded);
+
+    /* A file of the wrong size is rejected */
+    assert(truncate(PATH, sizeof(Value)*(saved->nval - 1)) == 0);
+    assert(load(mod, NULL) == NULL);
+
+    free_vars(saved);
+}
+
+int main()
+{
+    Module mod, other;
+
+    init_module(&mod, strings);
+    init_module(&other, other_strings);
+
+    test_round_trip(&mod, 10, false);
+    test_round_trip(&mod, 500, false);
+#ifdef WITH_LZMA
+    test_round_trip(&mod, 10, true);
+    test_round_trip(&mod, 500, true);
+#endif
+    test_torn_entry(&mod);
+    test_module_mismatch(&mod, &other);
+    test_legacy_native(&mod);
+
+    unlink(PATH);
+    printf("All saved game tests passed.\n");
+    return 0;
+}
@@ -1,41 +1,120 @@
+#undef NDEBUG  /* tests are performed by assertions */
 #include "strings.h"
+#include <assert.h>
+#include <ctype.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
-const char *strings[] = {
-    "foo",
-    "bar",
-    "baz",
-    "quux",
-    "w00t",
-    "foo",
-    "baz",
-    "blaat",
-    "woep",
-    NULL
-};
-
 const char *commands[] = {
     "TEST",
     "FooBar",
     "\tDit is een test  ",
     "Bla\r123456-abc   xyzzy",
     "    a   B   c   ^&*   d  e  F ",
+    "AbcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789 x",
+    "  take the   lamp, then go north-east; and open\tthe door!!  ",
+    NULL
 };
 
-int main()
+/* Reference implementation of normalize(), one character at a time. */
+static char *normalize_scalar(char *str)
+{
+    char *p, *q;
+    bool space = true;
+
+    for (p = q = str; *p; ++p)
+    {
+        if (isalnum((unsigned char)*p))
+        {
+            space = false;
+            *q++ = toupper((unsigned char)*p);
+        }
+        else
+        if (isspace((unsigned char)*p) && !space)
+        {
+            space = true;
+            *q++ = ' ';
+        }
+    }
+
+    /* Remove trailing space */
+    if (q != str && q[-1] == ' ')
+        --q;
+
+    *q = '\0';
+    return str;
+}
+
+/* Checks that tokenize() normalizes `str' exactly like normalize_scalar(),
+   and splits it into the right words. The string is copied to each offset
+   in a buffer, so both vectorized and scalar parts of tokenize() see every
+   alignment and length of the tail. */
+static void check(const char *str)
 {
-    const char **p, *q;
+    char expected[256], buf[256 + 16];
+    WordRef words[128];
+    size_t len = strlen(str), nword, n, offset;
+    const char *p;
 
-    for (p = strings; *p; ++p)
+    assert(len < sizeof(expected));
+    strcpy(expected, str);
+    normalize_scalar(expected);
+    for (offset = 0; offset < 16; ++offset)
     {
-        q = internalize(*p);
-        printf("[%s] [%s] %d\n", *p, q, (int)q);
+        char *s = buf + offset;
+        strcpy(s, str);
+        nword = tokenize(s, words, 128);
+        assert(strcmp(s, expected) == 0);
+
+        /* Words start after each space, and their hashes must match */
+        for (n = 0, p = s; *p != '\0'; ++n)
+        {
+            assert(n < nword && words[n].text == p);
+            assert(words[n].hash == hash_word(p));
+            p += strcspn(p, " ");
+            if (*p == ' ')
+                ++p;
+        }
+        assert(n == nword);
     }
+}
+
+/* Returns a random string of `len' characters, mostly letters, digits and
+   white space. */
+static const char *random_string(size_t len)
+{
+    static const char alphabet[] = "aZ09 \t\r\n\v\f.,-!";
+    static char buf[256];
+    size_t n;
+
+    for (n = 0; n < len; ++n)
+    {
+        int c = rand()%512;
+        buf[n] = c < 256 ? alphabet[c%(sizeof(alphabet) - 1)] :
+                 c < 384 ? "abcxyzABCXYZ0189"[c%16] : (char)(c%255 + 1);
+    }
+    buf[len] = '\0';
+    return buf;
+}
+
+int main()
+{
+    const char **p;
+    int n;
 
     for (p = commands; *p; ++p)
     {
-        printf("[%s]\n", normalize(strdup(*p)));
+        char *s = strdup(*p);
+        check(*p);
+        printf("[%s]\n", normalize(s));
+        free(s);
     }
+
+    srand(1);
+    for (n = 0; n < 100000; ++n)
+        check(random_string(rand()%100));
+
+    printf("All string tests passed.\n");
     return 0;
 }
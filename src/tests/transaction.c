@@ -0,0 +1,158 @@
+#undef NDEBUG  /* tests are performed by assertions */
+#include "transaction.h"
+#include "undo.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Tests nested transactions, with and without undo, using a module that only
+   defines variables. Commands are simulated by storing values and writing
+   output directly. */
+
+static int quit_calls = 0, pause_calls = 0;
+
+static void test_quit(Interpreter *I, int code)
+{
+    (void)I;
+    assert(code == 3);
+    ++quit_calls;
+}
+
+static void test_pause(Interpreter *I)
+{
+    (void)I;
+    ++pause_calls;
+}
+
+static Callbacks callbacks = { &test_quit, &test_pause };
+
+/* Simulates a command that stores `val' in the first `count' variables, and
+   writes `str'. */
+static void command(Interpreter *I, int count, Value val, const char *str)
+{
+    int n;
+
+    for (n = 0; n < count; ++n)
+        set_var(I->vars, n, val);
+    for ( ; *str != '\0'; ++str)
+        AR_push(I->output, str);
+}
+
+/* Checks that the output is equal to `str'. */
+static void check_output(Interpreter *I, const char *str)
+{
+    assert(AR_size(I->output) == strlen(str));
+    assert(memcmp(AR_data(I->output), str, strlen(str)) == 0);
+}
+
+/* Checks that the first `count' variables have value `val', and the rest
+   are nil. */
+static void check_vars(Interpreter *I, int count, Value val)
+{
+    int n;
+
+    for (n = 0; n < I->vars->nval; ++n)
+        assert(I->vars->vals[n] == (n < count ? val : val_nil));
+}
+
+static void test_nesting(Interpreter *I)
+{
+    Array *output = I->output;
+
+    assert(transaction_depth(I) == 0);
+    command(I, 2, 1, "a");
+
+    /* Roll back an inner transaction, commit the outer one */
+    assert(begin_transaction(I));
+    command(I, 4, 2, "b");
+    check_output(I, "b");
+    assert(begin_transaction(I));
+    assert(transaction_depth(I) == 2);
+    command(I, 8, 3, "c");
+    (*I->callbacks->quit)(I, 3);
+    (*I->callbacks->pause)(I);
+    check_vars(I, 8, 3);
+    rollback_transaction(I);
+    check_vars(I, 4, 2);
+    check_output(I, "b");
+    commit_transaction(I);
+    assert(transaction_depth(I) == 0);
+    assert(I->output == output && I->callbacks == &callbacks);
+    check_vars(I, 4, 2);
+    check_output(I, "ab");
+    assert(quit_calls == 0 && pause_calls == 0);
+
+    /* Commit an inner transaction, roll back the outer one */
+    assert(begin_transaction(I));
+    command(I, 6, 4, "d");
+    assert(begin_transaction(I));
+    command(I, 1, 5, "e");
+    (*I->callbacks->quit)(I, 3);
+    commit_transaction(I);
+    check_output(I, "de");
+    rollback_transaction(I);
+    check_vars(I, 4, 2);
+    check_output(I, "ab");
+    assert(quit_calls == 0);
+
+    /* Commit both; quit() is performed at the end */
+    assert(begin_transaction(I));
+    assert(begin_transaction(I));
+    command(I, 3, 6, "f");
+    (*I->callbacks->quit)(I, 3);
+    commit_transaction(I);
+    assert(quit_calls == 0);
+    commit_transaction(I);
+    assert(quit_calls == 1 && pause_calls == 0);
+    check_output(I, "abf");
+
+    /* reset() is rolled back too */
+    assert(begin_transaction(I));
+    clear_vars(I->vars);
+    check_vars(I, 0, val_nil);
+    rollback_transaction(I);
+    assert(I->vars->vals[0] == 6 && I->vars->vals[3] == 2);
+}
+
+int main()
+{
+    Module mod;
+    Array stack = AR_INIT(sizeof(Value)), output = AR_INIT(sizeof(char));
+    Interpreter in, *I = &in;
+
+    memset(&mod, 0, sizeof(mod));
+    mod.num_globals = 10;
+    memset(I, 0, sizeof(*I));
+    I->mod       = &mod;
+    I->vars      = alloc_vars(&mod);
+    I->stack     = &stack;
+    I->output    = &output;
+    I->callbacks = &callbacks;
+    assert(I->vars != NULL);
+
+    /* Without undo */
+    test_nesting(I);
+    assert(I->vars->log == NULL);
+
+    /* With undo: rolled back changes are not part of the turn, and committed
+       changes can be undone along with it */
+    clear_vars(I->vars);
+    AR_clear(I->output);
+    quit_calls = 0;
+    assert(enable_undo(I, 10, 1 << 16));
+    test_nesting(I);
+    assert(I->vars->log != NULL);
+    end_turn(I);
+    assert(undo_turn(I));
+    check_vars(I, 0, val_nil);
+    assert(!undo_turn(I));
+    assert(redo_turn(I));
+    assert(I->vars->vals[0] == 6 && I->vars->vals[3] == 2);
+    disable_undo(I);
+
+    free_vars(I->vars);
+    AR_destroy(&stack);
+    AR_destroy(&output);
+    printf("All transaction tests passed.\n");
+    return 0;
+}
@@ -0,0 +1,131 @@
+#include "transaction.h"
+#include "debug.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* An open transaction. */
+struct Transaction
+{
+    struct Transaction *outer;  /* enclosing transaction (or NULL) */
+    size_t      start;          /* size of write log when transaction began */
+    Array       *log;           /* write log in use before (or NULL) */
+    Array       own_log;        /* write log (if there was none before) */
+    Array       *output;        /* output buffer in use before */
+    Array       own_output;     /* output of the transaction */
+    Callbacks   *callbacks;     /* callbacks in use before */
+    bool        quit;           /* was quit() called? */
+    int         quit_code;      /* exit code passed to quit() */
+};
+
+/* Records a call to quit(), to be performed when the transaction commits. */
+static void transaction_quit(Interpreter *I, int code)
+{
+    I->transaction->quit      = true;
+    I->transaction->quit_code = code;
+}
+
+/* Ignores a call to pause(), since output is not shown during a
+   transaction. */
+static void transaction_pause(Interpreter *I)
+{
+    (void)I;  /* unused */
+}
+
+static Callbacks transaction_callbacks = {
+    &transaction_quit, &transaction_pause };
+
+bool begin_transaction(Interpreter *I)
+{
+    struct Transaction *t = malloc(sizeof(struct Transaction));
+
+    if (t == NULL)
+        return false;
+    t->outer  = I->transaction;
+    t->log    = I->vars->log;
+    t->output = I->output;
+    t->callbacks = I->callbacks;
+    t->quit   = false;
+    t->quit_code = 0;
+    AR_create(&t->own_log, sizeof(VarWrite));
+    AR_create(&t->own_output, sizeof(char));
+    if (t->log == NULL)
+        I->vars->log = &t->own_log;
+    t->start = AR_size(I->vars->log);
+    I->output = &t->own_output;
+    I->callbacks = &transaction_callbacks;
+    I->transaction = t;
+    return true;
+}
+
+/* Closes the innermost transaction, restoring the write log, output buffer
+   and callbacks that were in use before it began. */
+static void end_transaction(Interpreter *I)
+{
+    struct Transaction *t = I->transaction;
+
+    I->vars->log = t->log;
+    I->output = t->output;
+    I->callbacks = t->callbacks;
+    I->transaction = t->outer;
+    AR_destroy(&t->own_log);
+    AR_destroy(&t->own_output);
+    free(t);
+}
+
+void commit_transaction(Interpreter *I)
+{
+    struct Transaction *t = I->transaction;
+    bool quit;
+    int quit_code;
+    size_t size;
+
+    assert(t != NULL);
+    quit      = t->quit;
+    quit_code = t->quit_code;
+    size = AR_size(t->output);
+    AR_resize(t->output, size + AR_size(&t->own_output));
+    memcpy( AR_at(t->output, size), AR_data(&t->own_output),
+            AR_size(&t->own_output) );
+    end_transaction(I);
+
+    /* Pass on a call to quit() */
+    if (quit)
+    {
+        if (I->transaction != NULL)
+            transaction_quit(I, quit_code);
+        else
+        if (I->callbacks != NULL && I->callbacks->quit != NULL)
+            (*I->callbacks->quit)(I, quit_code);
+    }
+}
+
+void rollback_transaction(Interpreter *I)
+{
+    struct Transaction *t = I->transaction;
+    Array *log = I->vars->log;
+    VarWrite *w;
+    size_t n;
+
+    assert(t != NULL);
+
+    /* Restoring values is not a write to be recorded */
+    I->vars->log = NULL;
+    for (n = AR_size(log); n > t->start; --n)
+    {
+        w = AR_at(log, n - 1);
+        set_var(I->vars, w->index, w->old);
+    }
+    AR_resize(log, t->start);
+    I->vars->log = log;
+    end_transaction(I);
+}
+
+int transaction_depth(const Interpreter *I)
+{
+    const struct Transaction *t;
+    int depth = 0;
+
+    for (t = I->transaction; t != NULL; t = t->outer)
+        ++depth;
+    return depth;
+}
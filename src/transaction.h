@@ -0,0 +1,49 @@
+#ifndef TRANSACTION_H_INCLUDED
+#define TRANSACTION_H_INCLUDED
+
+#include <stdbool.h>
+#include "interpreter.h"
+
+/* Transactions.
+
+   A transaction allows commands to be executed speculatively (e.g. to find
+   hints, or to let a planner try out actions): after process_command(), the
+   output and the changed variables can be inspected, and the changes either
+   kept (committed) or discarded (rolled back).
+
+   While a transaction is open, every store to a variable is recorded in a
+   write log (see set_var()) as the variable's index and previous value, and
+   output is collected in a separate buffer, which I->output points to.
+   Rolling back restores the previous values in reverse order, so its cost is
+   proportional to the number of writes, regardless of the size of the game
+   state. Restored variables remain marked dirty (see clear_dirty_vars()).
+
+   While a transaction is open, I->callbacks is replaced as well: a call to
+   quit() is recorded, and performed only when the outermost transaction
+   commits, and calls to pause() are ignored.
+
+   Transactions can be nested: committing an inner transaction makes its
+   changes part of the enclosing one, which may still roll them back. When
+   undo is enabled (see undo.h), transactions share its write log, so the
+   changes of committed transactions can be undone as part of the turn.
+   Undo must not be enabled or disabled, and I->vars must not be replaced,
+   while a transaction is open. */
+
+/* Begins a (possibly nested) transaction. Returns false if memory could not
+   be allocated. */
+bool begin_transaction(Interpreter *I);
+
+/* Commits the innermost transaction: its output is appended to the output of
+   the enclosing transaction (or the interpreter's output buffer), and a call
+   to quit() made during it is passed on to the enclosing transaction (or
+   performed). */
+void commit_transaction(Interpreter *I);
+
+/* Rolls back the innermost transaction: variables written since it began are
+   restored, and its output is discarded. */
+void rollback_transaction(Interpreter *I);
+
+/* Returns the number of open transactions. */
+int transaction_depth(const Interpreter *I);
+
+#endif /* ndef TRANSACTION_H_INCLUDED */
@@ -0,0 +1,172 @@
+#include "undo.h"
+#include <stdlib.h>
+
+/* The writes of a turn in the history. */
+typedef struct UndoTurn
+{
+    size_t      start;          /* index of first write in ring buffer */
+    size_t      count;          /* number of writes */
+} UndoTurn;
+
+/* Undo history. Writes are stored in a ring buffer, turns in another; the
+   first `ndone' turns can be undone, and the rest redone. */
+struct UndoHistory
+{
+    Array       log;            /* writes of the current turn */
+    VarWrite    *writes;        /* ring buffer of writes */
+    size_t      capacity;       /* size of ring buffer (in writes) */
+    size_t      head;           /* index of oldest write */
+    size_t      used;           /* number of writes stored */
+    UndoTurn    *turns;         /* ring buffer of turns */
+    int         max_turns;      /* size of ring buffer (in turns) */
+    int         first;          /* index of oldest turn */
+    int         nturn;          /* number of turns stored */
+    int         ndone;          /* number of turns that can be undone */
+};
+
+static UndoTurn *get_turn(struct UndoHistory *h, int n)
+{
+    return &h->turns[(h->first + n)%h->max_turns];
+}
+
+static VarWrite *get_write(struct UndoHistory *h, const UndoTurn *t, size_t n)
+{
+    return &h->writes[(t->start + n)%h->capacity];
+}
+
+bool enable_undo(Interpreter *I, int max_turns, size_t max_size)
+{
+    struct UndoHistory *h;
+
+    disable_undo(I);
+    h = calloc(1, sizeof(struct UndoHistory));
+    if (h == NULL)
+        return false;
+    h->capacity  = max_size/sizeof(VarWrite);
+    h->max_turns = max_turns;
+    if (h->capacity == 0 || h->max_turns <= 0)
+    {
+        free(h);
+        return false;
+    }
+    h->writes = malloc(h->capacity*sizeof(VarWrite));
+    h->turns  = malloc(h->max_turns*sizeof(UndoTurn));
+    if (h->writes == NULL || h->turns == NULL)
+    {
+        free(h->writes);
+        free(h->turns);
+        free(h);
+        return false;
+    }
+    AR_create(&h->log, sizeof(VarWrite));
+    I->undo = h;
+    I->vars->log = &h->log;
+    return true;
+}
+
+void disable_undo(Interpreter *I)
+{
+    struct UndoHistory *h = I->undo;
+
+    if (h == NULL)
+        return;
+    if (I->vars->log == &h->log)
+        I->vars->log = NULL;
+    AR_destroy(&h->log);
+    free(h->writes);
+    free(h->turns);
+    free(h);
+    I->undo = NULL;
+}
+
+void end_turn(Interpreter *I)
+{
+    struct UndoHistory *h = I->undo;
+    size_t n, count;
+    UndoTurn *t;
+
+    if (h == NULL || AR_empty(&h->log))
+        return;
+    count = AR_size(&h->log);
+
+    /* Discard turns that could be redone */
+    while (h->nturn > h->ndone)
+        h->used -= get_turn(h, --h->nturn)->count;
+
+    if (count > h->capacity)
+    {
+        /* Too large to keep; nothing before it can be undone either */
+        h->head = h->used = 0;
+        h->first = h->nturn = h->ndone = 0;
+        AR_clear(&h->log);
+        return;
+    }
+
+    /* Discard the oldest turns to make room */
+    while (h->nturn == h->max_turns || h->used + count > h->capacity)
+    {
+        t = get_turn(h, 0);
+        h->head   = (h->head + t->count)%h->capacity;
+        h->used  -= t->count;
+        h->first  = (h->first + 1)%h->max_turns;
+        h->nturn -= 1;
+        h->ndone -= 1;
+    }
+
+    t = get_turn(h, h->nturn);
+    t->start = (h->head + h->used)%h->capacity;
+    t->count = count;
+    for (n = 0; n < count; ++n)
+        *get_write(h, t, n) = *(VarWrite*)AR_at(&h->log, n);
+    h->used += count;
+    h->nturn += 1;
+    h->ndone += 1;
+    AR_clear(&h->log);
+}
+
+/* Exchanges the values of the variables written during a turn with the
+   values recorded in the history, in reverse order (to undo the turn) or in
+   order (to redo it). */
+static void swap_turn(Interpreter *I, const UndoTurn *t, bool reverse)
+{
+    struct UndoHistory *h = I->undo;
+    Array *log = I->vars->log;
+    VarWrite *w;
+    Value val;
+    size_t n;
+
+    /* Restoring values is not a write to be recorded */
+    I->vars->log = NULL;
+    for (n = 0; n < t->count; ++n)
+    {
+        w   = get_write(h, t, reverse ? t->count - 1 - n : n);
+        val = I->vars->vals[w->index];
+        set_var(I->vars, w->index, w->old);
+        w->old = val;
+    }
+    I->vars->log = log;
+}
+
+bool undo_turn(Interpreter *I)
+{
+    struct UndoHistory *h = I->undo;
+
+    end_turn(I);
+    if (h == NULL || h->ndone == 0)
+        return false;
+    h->ndone -= 1;
+    swap_turn(I, get_turn(h, h->ndone), true);
+    return true;
+}
+
+bool redo_turn(Interpreter *I)
+{
+    struct UndoHistory *h = I->undo;
+
+    end_turn(I);
+    if (h == NULL || h->ndone == h->nturn)
+        return false;
+    swap_turn(I, get_turn(h, h->ndone), false);
+    h->ndone += 1;
+    return true;
+}
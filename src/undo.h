@@ -0,0 +1,44 @@
+#ifndef UNDO_H_INCLUDED
+#define UNDO_H_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "interpreter.h"
+
+/* Undo and redo.
+
+   While undo is enabled, every store to a variable is recorded in a write log
+   (see set_var()) as the variable's index and previous value. When a turn
+   ends, its writes are moved into a history, from which the oldest turns are
+   discarded to stay within the configured number of turns and size. Undoing
+   a turn restores the previous values in reverse order, and keeps the values
+   it replaced, so that the turn can be redone. The cost of undoing or redoing
+   a turn is proportional to the number of writes made during it, regardless
+   of the size of the game state.
+
+   Restored variables are marked dirty as usual, so saved games are updated
+   accordingly. Undo history is not saved. */
+
+/* Enables undo for the interpreter, keeping the writes of up to `max_turns'
+   turns, and at most `max_size' bytes of them. A turn with more writes than
+   that clears the history. Returns false if memory could not be allocated.
+   Must be called again if I->vars is replaced. */
+bool enable_undo(Interpreter *I, int max_turns, size_t max_size);
+
+/* Disables undo, and frees the history. */
+void disable_undo(Interpreter *I);
+
+/* Ends the current turn. If any variables were written during the turn, it
+   becomes the last turn that can be undone, and turns that were undone
+   before can no longer be redone. */
+void end_turn(Interpreter *I);
+
+/* Undoes the last turn (ending the current turn first). Returns false if
+   there is no turn to undo. */
+bool undo_turn(Interpreter *I);
+
+/* Redoes the last turn that was undone. Returns false if there is none
+   (including when variables have been written since it was undone). */
+bool redo_turn(Interpreter *I);
+
+#endif /* ndef UNDO_H_INCLUDED */